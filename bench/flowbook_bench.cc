@@ -0,0 +1,466 @@
+/**
+ * Microbenchmarks of the flow key hash, the burst parser and flowbook_table.
+ * Author: Hao Zheng
+ * Date: 2023/3/30
+ *
+ * Needs no NIC and no hugepages: EAL runs with --no-huge, packets are
+ * synthetic mbufs and the key streams are generated up front, so only the
+ * component itself is timed. Cache misses come from perf_event_open(2) and
+ * are reported as n/a where the kernel does not allow it (containers).
+ *
+ *   flowbook_bench [EAL args] -- [--sizes N,N..] [--threads N,N..] [--ops N]
+ *                  [--baseline FILE] [--save-baseline FILE] [--tolerance PCT]
+ *
+ * With --baseline, a case that got more than PCT (default 10) percent
+ * slower than its line in FILE fails the run, and so does a FILE without
+ * any case: an empty baseline would pass every regression.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <netinet/in.h>
+#include <rte_eal.h>
+#include <rte_ether.h>
+#include <rte_ip.h>
+#include <rte_mbuf.h>
+#include <rte_udp.h>
+
+#include "flowbook_entry.h"
+#include "flowbook_parse.h"
+#include "flowbook_table.h"
+
+#define BENCH_OPS_DEFAULT       (4 * 1024 * 1024)  // per thread and case
+#define BENCH_BURST             32
+#define BENCH_PKTS              1024    // distinct packets of the parser cases
+#define BENCH_TOLERANCE_DEFAULT 10.0    // percent
+
+/* Head of a baseline file, the same for bench/baseline.txt and --save-baseline. */
+static const char* BENCH_BASELINE_HEADER =
+    "# flowbook_bench baseline: <case> <ns/op>, one line per case.\n"
+    "# Numbers only mean something on the box they were taken on. Record them on\n"
+    "# the reference machine with\n"
+    "#   ./build/flowbook_bench --no-huge -m 1024 --no-pci -- --save-baseline bench/baseline.txt\n"
+    "# and pass '--baseline' in the benchmark() of meson.build. Cases without a\n"
+    "# line here are measured but never fail.\n";
+#define BENCH_ZIPF_S            1.0
+#define BENCH_ELEPHANTS         1024    // heavy flows of the mice workload
+
+using BenchClock = std::chrono::steady_clock;
+
+enum workload { UNIFORM, ZIPF, SCAN, MICE };
+static const char* workload_name[] = {"uniform", "zipf", "scan", "mice"};
+
+/* Hardware cache misses of the calling thread, -1 if not available. */
+class perf_cache_misses {
+
+public:
+    perf_cache_misses() : m_fd(-1)
+    {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        m_fd = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+
+    ~perf_cache_misses()
+    {
+        if (m_fd >= 0)
+            close(m_fd);
+    }
+
+    void start()
+    {
+        if (m_fd >= 0) {
+            ioctl(m_fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(m_fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+
+    int64_t stop()
+    {
+        uint64_t count;
+        if (m_fd < 0)
+            return -1;
+        ioctl(m_fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(m_fd, &count, sizeof(count)) != sizeof(count))
+            return -1;
+        return (int64_t)count;
+    }
+
+private:
+    int m_fd;
+};
+
+struct bench_result {
+    std::string name;
+    double ns_per_op;       // per thread
+    double mpps;            // all threads
+    double misses_per_op;   // < 0: n/a
+    double bytes_per_flow;  // 0: n/a
+};
+
+/* A distinct flow per id, @salt keeps the streams of two threads apart. */
+static flow_key
+bench_key(uint64_t id, uint32_t salt)
+{
+    flow_key key;
+    key._srcip = htonl((uint32_t)id);
+    key._dstip = htonl(0x0a000000u | (salt << 16) | (uint32_t)(id >> 32));
+    key._srcport = (uint16_t)(1024 + id % 50000);
+    key._dstport = (uint16_t)(id % 7 == 0 ? 53 : 443);
+    key._protocol = (id & 1) ? IPPROTO_TCP : IPPROTO_UDP;
+    return key;
+}
+
+/*
+ * @ops keys of @w over @nb_flows flows:
+ *   uniform: every flow equally likely,
+ *   zipf:    rank r drawn with probability ~ 1 / r^BENCH_ZIPF_S,
+ *   scan:    a new flow on every packet (port scan, spoofed DDoS),
+ *   mice:    90% one or two packet flows, 10% on a few elephants.
+ */
+static std::vector<flow_key>
+bench_keys(workload w, size_t nb_flows, size_t ops, uint32_t salt)
+{
+    std::vector<flow_key> keys(ops);
+    std::mt19937_64 rng(salt * 7919 + w);
+    std::vector<double> cdf;
+    uint64_t next_mouse = BENCH_ELEPHANTS;
+
+    if (w == ZIPF) {
+        double sum = 0;
+        cdf.resize(nb_flows);
+        for (size_t r = 0; r < nb_flows; ++r) {
+            sum += 1.0 / std::pow((double)(r + 1), BENCH_ZIPF_S);
+            cdf[r] = sum;
+        }
+        for (double& c : cdf)
+            c /= sum;
+    }
+    for (size_t i = 0; i < ops; ++i) {
+        uint64_t id = 0;
+        switch (w) {
+        case UNIFORM:
+            id = rng() % nb_flows;
+            break;
+        case ZIPF: {
+            double u = std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+            id = std::lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin();
+            id = std::min<uint64_t>(id, nb_flows - 1);
+            break;
+        }
+        case SCAN:
+            id = i;
+            break;
+        case MICE:
+            if (rng() % 10 == 0)
+                id = rng() % BENCH_ELEPHANTS;
+            else if (i > 0 && rng() % 2 == 0 && next_mouse > BENCH_ELEPHANTS)
+                id = next_mouse - 1;    // second packet of the last mouse
+            else
+                id = next_mouse++;
+            break;
+        }
+        keys[i] = bench_key(id, salt);
+    }
+    return keys;
+}
+
+static bench_result
+bench_hash(size_t ops)
+{
+    std::vector<flow_key> keys = bench_keys(UNIFORM, ops, ops, 0);
+    perf_cache_misses perf;
+    volatile uint32_t sink;
+    uint32_t acc = 0;
+
+    perf.start();
+    BenchClock::time_point t0 = BenchClock::now();
+    for (size_t i = 0; i < ops; ++i)
+        acc ^= keys[i].hash();
+    BenchClock::time_point t1 = BenchClock::now();
+    int64_t misses = perf.stop();
+    sink = acc;
+    (void)sink;
+
+    double ns = std::chrono::duration<double, std::nano>(t1 - t0).count() / ops;
+    return {"hash/flow_key", ns, 1e3 / ns, misses < 0 ? -1.0 : (double)misses / ops, 0};
+}
+
+/* Ethernet (optionally one VLAN tag) + IPv4 + UDP/TCP ports of @key. */
+static void
+bench_fill_pkt(struct rte_mbuf* m, const flow_key& key, bool vlan)
+{
+    uint16_t len = 128;
+    uint8_t* p = (uint8_t*)rte_pktmbuf_append(m, len);
+    struct rte_ether_hdr* eth = (struct rte_ether_hdr*)p;
+    memset(p, 0, len);
+    p += sizeof(*eth);
+    if (vlan) {
+        struct rte_vlan_hdr* vh = (struct rte_vlan_hdr*)p;
+        eth->ether_type = rte_cpu_to_be_16(RTE_ETHER_TYPE_VLAN);
+        vh->vlan_tci = rte_cpu_to_be_16(100);
+        vh->eth_proto = rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4);
+        p += sizeof(*vh);
+    } else {
+        eth->ether_type = rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4);
+    }
+    struct rte_ipv4_hdr* ip = (struct rte_ipv4_hdr*)p;
+    ip->version_ihl = RTE_IPV4_VHL_DEF;
+    ip->next_proto_id = key._protocol;
+    ip->src_addr = key._srcip;
+    ip->dst_addr = key._dstip;
+    struct rte_udp_hdr* l4 = (struct rte_udp_hdr*)(ip + 1);
+    l4->src_port = rte_cpu_to_be_16(key._srcport);
+    l4->dst_port = rte_cpu_to_be_16(key._dstport);
+}
+
+/* @vlan_share: one of N packets is VLAN tagged (0: none). */
+static bench_result
+bench_parse(const char* name, size_t ops, unsigned vlan_share)
+{
+    struct rte_mempool* pool = rte_pktmbuf_pool_create("bench_pool", BENCH_PKTS * 2, 0, 0,
+                                                       RTE_MBUF_DEFAULT_BUF_SIZE, SOCKET_ID_ANY);
+    struct rte_mbuf* pkts[BENCH_PKTS];
+    struct flowbook_burst out;
+    perf_cache_misses perf;
+    size_t nb_rec = 0;
+
+    if (pool == nullptr || rte_pktmbuf_alloc_bulk(pool, pkts, BENCH_PKTS) != 0) {
+        fprintf(stderr, "Error: cannot allocate the benchmark mbufs\n");
+        exit(EXIT_FAILURE);
+    }
+    std::vector<flow_key> keys = bench_keys(UNIFORM, 1 << 20, BENCH_PKTS, 1);
+    for (unsigned i = 0; i < BENCH_PKTS; ++i)
+        bench_fill_pkt(pkts[i], keys[i], vlan_share > 0 && i % vlan_share == 0);
+
+    // Whole bursts only, the packets are reused round robin.
+    size_t nb_pkts = (ops + BENCH_BURST - 1) / BENCH_BURST * BENCH_BURST;
+    perf.start();
+    BenchClock::time_point t0 = BenchClock::now();
+    for (size_t done = 0; done < nb_pkts; done += BENCH_BURST)
+        nb_rec += flowbook_parse_burst(&pkts[done % BENCH_PKTS], BENCH_BURST, 0, 0, 1, 0, 0, 1, &out);
+    BenchClock::time_point t1 = BenchClock::now();
+    int64_t misses = perf.stop();
+
+    for (unsigned i = 0; i < BENCH_PKTS; ++i)
+        rte_pktmbuf_free(pkts[i]);
+    rte_mempool_free(pool);
+    if (nb_rec != nb_pkts)
+        fprintf(stderr, "Warning: %s parsed %zu of %zu packets\n", name, nb_rec, nb_pkts);
+
+    double ns = std::chrono::duration<double, std::nano>(t1 - t0).count() / nb_pkts;
+    return {name, ns, 1e3 / ns, misses < 0 ? -1.0 : (double)misses / nb_pkts, 0};
+}
+
+/*
+ * @nb_threads writers, each on its own shard of a @table_size table,
+ * upsert @ops packets of @w in bursts like the RX loop does.
+ */
+static bench_result
+bench_upsert(workload w, size_t table_size, unsigned nb_threads, size_t ops)
+{
+    using FlowTable = flowbook_table<flow_key>::FlowTable;
+    // Epochs are never switched here: report on load only, never asked.
+    flowbook_table<flow_key> table(table_size, nb_threads, 0);
+    // Keyed flows stay at half the shard capacity, except for scans.
+    size_t nb_flows = std::max<size_t>(table_size / nb_threads / 2, 1);
+    std::vector<std::vector<flow_key>> keys(nb_threads);
+    std::vector<int64_t> misses(nb_threads, -1);
+    std::vector<std::thread> threads;
+    flow_attr attrs[BENCH_BURST];
+
+    for (unsigned t = 0; t < nb_threads; ++t)
+        keys[t] = bench_keys(w, nb_flows, ops, t);
+    for (unsigned i = 0; i < BENCH_BURST; ++i)
+        attrs[i].init_packet(1, 64);
+
+    BenchClock::time_point t0 = BenchClock::now();
+    for (unsigned t = 0; t < nb_threads; ++t) {
+        threads.emplace_back([&, t]{
+            perf_cache_misses perf;
+            table.register_writer(t);
+            perf.start();
+            for (size_t done = 0; done < ops; done += BENCH_BURST) {
+                uint32_t n = (uint32_t)std::min<size_t>(BENCH_BURST, ops - done);
+                table.upsert_bulk(t, &keys[t][done], attrs, n);
+                table.quiescent(t);
+            }
+            misses[t] = perf.stop();
+            table.unregister_writer(t);
+        });
+    }
+    for (std::thread& th : threads)
+        th.join();
+    BenchClock::time_point t1 = BenchClock::now();
+
+    // Both tables of a shard are allocated, count them against the flows.
+    size_t flows = 0;
+    double bytes = 0;
+    int64_t total_misses = 0;
+    for (unsigned t = 0; t < nb_threads; ++t) {
+        FlowTable* ft = table.get_curr_write_table(t);
+        flows += ft->size();
+        bytes += 2.0 * (ft->capacity() / FLOW_BUCKET_SLOTS * sizeof(flow_bucket) +
+                        ft->capacity() * sizeof(FlowTable::entry));
+        total_misses = (misses[t] < 0 || total_misses < 0) ? -1 : total_misses + misses[t];
+    }
+
+    double wall_ns = std::chrono::duration<double, std::nano>(t1 - t0).count();
+    char name[96];
+    snprintf(name, sizeof(name), "upsert/%s/%zu/t%u", workload_name[w], table_size, nb_threads);
+    return {name, wall_ns / ops, 1e3 * nb_threads * ops / wall_ns,
+            total_misses < 0 ? -1.0 : (double)total_misses / (ops * nb_threads),
+            flows > 0 ? bytes / flows : 0};
+}
+
+static std::vector<size_t>
+parse_list(const char* arg)
+{
+    std::vector<size_t> v;
+    std::stringstream ss(arg);
+    std::string item;
+    while (std::getline(ss, item, ','))
+        v.push_back(std::strtoull(item.c_str(), nullptr, 0));
+    return v;
+}
+
+/* Lines of "<case> <ns/op>", '#' starts a comment. */
+static std::map<std::string, double>
+load_baseline(const char* path)
+{
+    std::map<std::string, double> base;
+    std::ifstream in(path);
+    std::string line;
+    while (std::getline(in, line)) {
+        std::stringstream ss(line);
+        std::string name;
+        double ns;
+        if (line.empty() || line[0] == '#')
+            continue;
+        if (ss >> name >> ns)
+            base[name] = ns;
+    }
+    return base;
+}
+
+static void
+usage(const char* prgname)
+{
+    printf("%s [EAL options] -- [--sizes N,N..] [--threads N,N..] [--ops N]\n"
+           "  [--baseline FILE] [--save-baseline FILE] [--tolerance PCT]\n", prgname);
+}
+
+int
+main(int argc, char** argv)
+{
+    std::vector<size_t> sizes = {1 << 16, 1 << 20};
+    std::vector<size_t> nb_threads = {1, 2};
+    size_t ops = BENCH_OPS_DEFAULT;
+    const char* baseline = nullptr;
+    const char* save_baseline = nullptr;
+    double tolerance = BENCH_TOLERANCE_DEFAULT;
+    std::vector<bench_result> results;
+    int ret;
+
+    ret = rte_eal_init(argc, argv);
+    if (ret < 0) {
+        fprintf(stderr, "Error: cannot init EAL, try --no-huge -m 1024\n");
+        return EXIT_FAILURE;
+    }
+    argc -= ret;
+    argv += ret;
+    for (int i = 1; i < argc; ++i) {
+        std::string opt = argv[i];
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        const char* val = argv[++i];
+        if (opt == "--sizes")
+            sizes = parse_list(val);
+        else if (opt == "--threads")
+            nb_threads = parse_list(val);
+        else if (opt == "--ops")
+            ops = std::strtoull(val, nullptr, 0);
+        else if (opt == "--baseline")
+            baseline = val;
+        else if (opt == "--save-baseline")
+            save_baseline = val;
+        else if (opt == "--tolerance")
+            tolerance = std::atof(val);
+        else {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (ops < BENCH_BURST)
+        ops = BENCH_BURST;
+
+    results.push_back(bench_hash(ops));
+    results.push_back(bench_parse("parse/ipv4", ops, 0));
+    results.push_back(bench_parse("parse/mixed_vlan", ops, 8));
+    for (size_t size : sizes)
+        for (size_t t : nb_threads)
+            for (workload w : {UNIFORM, ZIPF, SCAN, MICE})
+                results.push_back(bench_upsert(w, size, (unsigned)t, ops));
+
+    std::map<std::string, double> base;
+    if (baseline != nullptr) {
+        base = load_baseline(baseline);
+        if (base.empty()) {
+            fprintf(stderr, "Error: no case in baseline %s, record one with --save-baseline\n",
+                    baseline);
+            rte_eal_cleanup();
+            return EXIT_FAILURE;
+        }
+    }
+    int nb_regressions = 0;
+    printf("%-36s %10s %10s %12s %12s\n", "case", "ns/op", "Mpps", "misses/op", "bytes/flow");
+    for (const bench_result& r : results) {
+        char misses[32] = "n/a";
+        char bytes[32] = "-";
+        if (r.misses_per_op >= 0)
+            snprintf(misses, sizeof(misses), "%.3f", r.misses_per_op);
+        if (r.bytes_per_flow > 0)
+            snprintf(bytes, sizeof(bytes), "%.1f", r.bytes_per_flow);
+        printf("%-36s %10.2f %10.2f %12s %12s", r.name.c_str(), r.ns_per_op, r.mpps, misses, bytes);
+        auto it = base.find(r.name);
+        if (it != base.end() && r.ns_per_op > it->second * (1.0 + tolerance / 100.0)) {
+            printf("  REGRESSION (baseline %.2f ns/op)", it->second);
+            nb_regressions++;
+        }
+        printf("\n");
+    }
+
+    if (save_baseline != nullptr) {
+        std::ofstream out(save_baseline);
+        out << BENCH_BASELINE_HEADER;
+        for (const bench_result& r : results)
+            out << r.name << " " << r.ns_per_op << "\n";
+    }
+    rte_eal_cleanup();
+    return nb_regressions > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
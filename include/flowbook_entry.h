@@ -8,33 +8,45 @@
 #define _FLOWBOOK_ENTRY_H_
 
 #include <cstdint>
-#include <vector>
+#include <cstring>
 #include <functional>
+#include <type_traits>
 #include <string>
 #include <arpa/inet.h>
+#include <rte_common.h>
+#include <rte_branch_prediction.h>
 #include "flowbook_hash.h"
+#include "flowbook_hdr.h"
+
+/**
+ * Number of per-window counters kept inline in a flow record (a ring of
+ * the latest windows). Sized so that key + attr fill one cache line.
+ */
+#define FLOW_ATTR_MAX_CTRS  8
+static_assert(FLOW_ATTR_MAX_CTRS <= FLOW_BOOK_PDU_MAX_CTRS,
+              "flow record cannot hold more windows than a flowbook pdu");
 
 
 /**
  * Definition for the key of a flow record.
+ * Packed into 13 bytes: no padding, so it can be compared and hashed as raw bytes.
+ * All key types provide hash(), to_string(), operator== and LOG_PREFIX (the
+ * name of their report files); flowbook_table is instantiated per key type.
 */
 struct flow_key {
+    static constexpr const char* LOG_PREFIX = "flow_status";
+
     uint32_t _srcip;
     uint32_t _dstip;
     uint16_t _srcport;
     uint16_t _dstport;
     uint8_t  _protocol;
-    size_t hash() const{
-        /**
-         * TODO:  choose a better hash func.
-        */
-        static flow_hasher flow_hasher;
-        size_t h1 = flow_hasher.run((const char*)&_srcip, 4);
-        size_t h2 = flow_hasher.run((const char*)&_dstip, 4);
-        size_t h3 = flow_hasher.run((const char*)&_srcport, 2);
-        size_t h4 = flow_hasher.run((const char*)&_dstport, 2);
-        size_t h5 = flow_hasher.run((const char*)&_protocol, 1);
-        return h1 ^ h2 ^ h3 ^ h4 ^ h5;
+    /**
+     * One CRC32C pass over the packed 13 bytes. Unlike xor-ing per field
+     * hashes, A->B and B->A flows get different values.
+    */
+    uint32_t hash() const{
+        return flow_hash_crc(this, sizeof(flow_key));
     }
     std::string to_string() const{
         char format[100];
@@ -49,28 +61,190 @@ struct flow_key {
         sprintf(format, "FlowKey=(%s:%hu => %s:%hu, %hhu)", srcbuf, _srcport, dstbuf, _dstport, _protocol);
         return std::string(format);
     }
-};
+    bool operator==(const flow_key& rhs) const{
+        return memcmp(this, &rhs, sizeof(flow_key)) == 0;
+    }
+} __rte_packed;
+
+static_assert(sizeof(flow_key) == 13, "flow_key must stay packed");
+
+/**
+ * IPv6 five-tuple, 37 bytes packed. VLAN tags of IPv6 packets are ignored.
+*/
+struct flow_key_v6 {
+    static constexpr const char* LOG_PREFIX = "flow6_status";
+    uint8_t  _srcip[16];
+    uint8_t  _dstip[16];
+    uint16_t _srcport;
+    uint16_t _dstport;
+    uint8_t  _protocol;
+    uint32_t hash() const{
+        return flow_hash_crc(this, sizeof(flow_key_v6));
+    }
+    std::string to_string() const{
+        char format[160];
+        char srcbuf[INET6_ADDRSTRLEN + 1];
+        char dstbuf[INET6_ADDRSTRLEN + 1];
+        if (nullptr == inet_ntop(AF_INET6, _srcip, srcbuf, sizeof(srcbuf)) 
+            || nullptr == inet_ntop(AF_INET6, _dstip, dstbuf, sizeof(dstbuf)) ){
+            return "UnkownIP";
+        }
+        sprintf(format, "FlowKey=([%s]:%hu => [%s]:%hu, %hhu)", srcbuf, _srcport, dstbuf, _dstport, _protocol);
+        return std::string(format);
+    }
+    bool operator==(const flow_key_v6& rhs) const{
+        return memcmp(this, &rhs, sizeof(flow_key_v6)) == 0;
+    }
+} __rte_packed;
+
+static_assert(sizeof(flow_key_v6) == 37, "flow_key_v6 must stay packed");
+
+/**
+ * IPv4 five-tuple of a VLAN (or QinQ) tagged packet, 17 bytes packed.
+ * Vlan ids are in host order, _inner_vid is 0 with a single tag.
+*/
+struct flow_key_vlan {
+    static constexpr const char* LOG_PREFIX = "flowvlan_status";
+    uint16_t _outer_vid;
+    uint16_t _inner_vid;
+    flow_key _v4;
+    uint32_t hash() const{
+        return flow_hash_crc(this, sizeof(flow_key_vlan));
+    }
+    std::string to_string() const{
+        char format[32];
+        sprintf(format, "Vlan=(%hu, %hu) ", _outer_vid, _inner_vid);
+        return std::string(format) + _v4.to_string();
+    }
+    bool operator==(const flow_key_vlan& rhs) const{
+        return memcmp(this, &rhs, sizeof(flow_key_vlan)) == 0;
+    }
+} __rte_packed;
+
+static_assert(sizeof(flow_key_vlan) == 17, "flow_key_vlan must stay packed");
 
 /**
  * Definition for the val of a flow record.
+ * Trivially copyable and allocation free: the window counters are a fixed
+ * ring where slot _ctr_head holds window _max_wid, the _ctr_num - 1 slots
+ * before it hold the preceding windows and all other slots are zero.
 */
 struct flow_attr {
-    uint32_t _start_wid;       // start time of a flow: only update at the init.
-    uint32_t _max_wid;        // last update time (used to aging and regard as the end of a flow)
-    uint16_t _packet_tot = 0;   // total number of packets of the flow
+    uint32_t _start_wid  = 0;   // start time of a flow: only update at the init.
+    uint32_t _max_wid    = 0;   // last update time (used to aging and regard as the end of a flow)
+    uint32_t _packet_tot = 0;   // total number of packets of the flow
     uint32_t _byte_tot   = 0;   // total bytes of a flow
-	uint16_t _packet_max = 0;   // max pcket number in 10-us window
-	uint32_t _byte_max   = 0;   // max byte  number in 10-us window
-    std::vector<uint8_t>  _pktctrs;
-    std::vector<uint16_t> _bytectrs;
+	uint16_t _packet_max = 0;   // max pcket number in one window
+    uint8_t  _ctr_head   = 0;   // ring slot of _max_wid
+    uint8_t  _ctr_num    = 0;   // valid slots in the ring
+	uint32_t _byte_max   = 0;   // max byte  number in one window
+    uint8_t  _pktctrs[FLOW_ATTR_MAX_CTRS]  = {};
+    uint16_t _bytectrs[FLOW_ATTR_MAX_CTRS] = {};
+
+    /**
+     * Set up the record of a single packet seen in window @wid.
+    */
+    void init_packet(uint32_t wid, uint32_t pkt_len){
+        *this = flow_attr();
+        _start_wid = _max_wid = wid;
+        _packet_tot = 1;
+        _byte_tot = pkt_len;
+        _ctr_num = 1;
+        _pktctrs[0] = 1;
+        _bytectrs[0] = (uint16_t)RTE_MIN(pkt_len, (uint32_t)UINT16_MAX);
+        _packet_max = _pktctrs[0];
+        _byte_max = _bytectrs[0];
+    }
+
+    /**
+     * Account @pkts / @bytes to window @wid and refresh the peaks. O(1): a
+     * newer window rotates the ring by at most FLOW_ATTR_MAX_CTRS slots, an
+     * older one is only counted if it is still in the ring.
+     * Window counters saturate, and so do the peaks derived from them.
+     * Totals are not touched.
+    */
+    void add_window(uint32_t wid, uint32_t pkts, uint32_t bytes){
+        unsigned slot;
+        if (likely(wid == _max_wid && _ctr_num > 0)) {
+            slot = _ctr_head;
+        } else if ((int32_t)(wid - _max_wid) > 0 || _ctr_num == 0) {
+            uint32_t steps = (_ctr_num == 0) ? 1 : wid - _max_wid;
+            if (steps >= FLOW_ATTR_MAX_CTRS) {
+                memset(_pktctrs, 0, sizeof(_pktctrs));
+                memset(_bytectrs, 0, sizeof(_bytectrs));
+                _ctr_num = 1;
+            } else {
+                for (uint32_t i = 0; i < steps; ++i) {
+                    _ctr_head = (_ctr_head + 1) % FLOW_ATTR_MAX_CTRS;
+                    _pktctrs[_ctr_head] = 0;
+                    _bytectrs[_ctr_head] = 0;
+                }
+                _ctr_num = (uint8_t)RTE_MIN((uint32_t)_ctr_num + steps, (uint32_t)FLOW_ATTR_MAX_CTRS);
+            }
+            _max_wid = wid;
+            slot = _ctr_head;
+        } else {
+            uint32_t age = _max_wid - wid;
+            if (age >= FLOW_ATTR_MAX_CTRS)
+                return;     // fell out of the ring, only the totals keep it
+            // Slots past _ctr_num are always zero, so the ring can grow back.
+            _ctr_num = (uint8_t)RTE_MAX((uint32_t)_ctr_num, age + 1);
+            slot = (_ctr_head + FLOW_ATTR_MAX_CTRS - age) % FLOW_ATTR_MAX_CTRS;
+        }
+        _pktctrs[slot] = (uint8_t)RTE_MIN(_pktctrs[slot] + pkts, (uint32_t)UINT8_MAX);
+        _bytectrs[slot] = (uint16_t)RTE_MIN(_bytectrs[slot] + bytes, (uint32_t)UINT16_MAX);
+        _packet_max = RTE_MAX(_packet_max, (uint16_t)_pktctrs[slot]);
+        _byte_max = RTE_MAX(_byte_max, (uint32_t)_bytectrs[slot]);
+    }
+
+    /**
+     * Merge another record of the same flow into this one: totals add up,
+     * peaks keep the larger one and the windows of @o are replayed oldest
+     * first. A single packet record costs one add_window().
+     * Window ids are compared modulo 2^32, like in add_window().
+    */
+    void merge(const flow_attr& o){
+        _packet_tot += o._packet_tot;
+        _byte_tot += o._byte_tot;
+        if ((int32_t)(o._start_wid - _start_wid) < 0)
+            _start_wid = o._start_wid;
+        for (uint32_t age = o._ctr_num; age-- > 0; ) {
+            unsigned slot = (o._ctr_head + FLOW_ATTR_MAX_CTRS - age) % FLOW_ATTR_MAX_CTRS;
+            if (o._pktctrs[slot] != 0)
+                add_window(o._max_wid - age, o._pktctrs[slot], o._bytectrs[slot]);
+        }
+        // The last window of @o may have no counter, e.g. a switch report, or
+        // @o none at all: it is still the last activity of the flow.
+        if ((int32_t)(o._max_wid - _max_wid) > 0)
+            add_window(o._max_wid, 0, 0);
+        _packet_max = RTE_MAX(_packet_max, o._packet_max);
+        _byte_max = RTE_MAX(_byte_max, o._byte_max);
+    }
+
     std::string to_string() const{
-        char format[100];
-        sprintf(format, "FlowAttr=(start_wid=%u, last_wid=%u, total_pkt=%hu, total_byte=%u)", 
-                                 _start_wid, _max_wid, _packet_tot, _byte_tot);
+        char format[160];
+        sprintf(format, "FlowAttr=(start_wid=%u, last_wid=%u, total_pkt=%u, total_byte=%u, "
+                        "peak_pkt=%hu, peak_byte=%u)", 
+                                 _start_wid, _max_wid, _packet_tot, _byte_tot, _packet_max, _byte_max);
         return std::string(format);
     }
 };
 
+static_assert(std::is_trivially_copyable<flow_attr>::value, "flow_attr must stay allocation free");
+static_assert(sizeof(flow_key) + sizeof(flow_attr) <= RTE_CACHE_LINE_SIZE,
+              "a flow record must fit into one cache line");
+
+/**
+ * A complete flow record, e.g. a flow that left the table before its epoch.
+*/
+template <typename Key>
+struct flow_record {
+    Key       key;
+    flow_attr attr;
+};
+
+static_assert(sizeof(flow_record<flow_key>) == RTE_CACHE_LINE_SIZE, "ring element size");
+
 namespace std {
     template <> struct hash<flow_key> {
         size_t operator()(const flow_key &kb) const 
@@ -78,22 +252,6 @@ namespace std {
             return kb.hash();
         }
     };
-
-    template <> struct equal_to<flow_key> {
-        bool operator()(const flow_key &lhs, const flow_key &rhs) const {
-            if(lhs._dstip != rhs._dstip)
-                return false;
-            if(lhs._srcip != rhs._srcip)
-                return false;
-            if(lhs._srcport != rhs._srcport)
-                return false;
-            if(lhs._dstport != rhs._dstport)
-                return false;
-            if(lhs._protocol != rhs._protocol)
-                return false;
-            return true;
-        }
-    };
 }
 
 # endif
\ No newline at end of file
@@ -0,0 +1,82 @@
+/**
+ * Eventdev transport of the Flowbook pipeline.
+ * Author: Hao Zheng
+ * Date: 2023/4/13
+ *
+ * Alternative to the SPSC rings of flowbook_pipeline. The RX lcores parse
+ * the bursts and send the flow records through an event device (the first
+ * one of the EAL, or a software event_sw created on the fly) to the
+ * workers. The tables get FLOWBOOK_EVENT_SHARDS_PER_WORKER shards per
+ * worker and the shard of a flow is the flow id of its events, scheduled
+ * ATOMIC: a shard is processed by one worker at a time, so the tables stay
+ * lock free, while the device hands idle shards to the least loaded
+ * workers, e.g. away from the one stuck with an elephant flow.
+ *
+ * Records travel in batches of one family and shard, one event each. The
+ * aging timers of a shard run on an event of that shard as well.
+ */
+
+#ifndef _FLOWBOOK_EVENT_H_
+#define _FLOWBOOK_EVENT_H_
+
+#include <stdint.h>
+
+#include <rte_common.h>
+#include <rte_eventdev.h>
+
+#include "flowbook_parse.h"
+
+#define FLOWBOOK_EVENT_SHARDS_PER_WORKER    4
+#define FLOWBOOK_EVENT_BATCH                32  // records per event
+#define FLOWBOOK_EVENT_DEQ_BURST            16  // events per worker dequeue
+
+/* sub_event_type of the events */
+enum flowbook_event_kind {
+	FLOWBOOK_EVENT_V4,
+	FLOWBOOK_EVENT_V6,
+	FLOWBOOK_EVENT_VLAN,
+	FLOWBOOK_EVENT_AGE,         /**< run the aging timers, no batch */
+};
+
+/* Records of one family and shard, the event_ptr of an event. */
+template <typename Key>
+struct flowbook_event_batch {
+	uint16_t n;
+	Key keys[FLOWBOOK_EVENT_BATCH];
+	uint32_t hashes[FLOWBOOK_EVENT_BATCH];
+	flow_attr attrs[FLOWBOOK_EVENT_BATCH];
+};
+
+/**
+ * Set up and start the event device: one producer port per RX lcore (@nb_rx,
+ * staging buffers on @rx_socket), one port per worker, @nb_shards atomic
+ * flows. @aging: also send an aging event to every shard each millisecond.
+ * Returns 0 on success.
+ */
+int flowbook_event_init(uint16_t nb_rx, const int *rx_socket,
+		uint16_t nb_workers, uint16_t nb_shards, int aging);
+
+/* RX lcore @rx_id: stage the records of @recs for their shards. */
+void flowbook_event_dispatch(uint16_t rx_id, const struct flowbook_burst *recs);
+
+/**
+ * RX lcore @rx_id, once per poll: send the full batches, every few polls
+ * the partly filled ones too, and the aging events. Runs the scheduler of
+ * a software device when no service lcore does.
+ */
+void flowbook_event_poll(uint16_t rx_id);
+
+/* Worker @worker: up to @nb_evs events, the shard of each is its flow_id. */
+uint16_t flowbook_event_recv(uint16_t worker, struct rte_event *evs,
+		uint16_t nb_evs);
+
+/* Worker: give the batches of @nb_evs processed events back. */
+void flowbook_event_done(const struct rte_event *evs, uint16_t nb_evs);
+
+/* Print the records sent, dropped and received, after the lcores joined. */
+void flowbook_event_report(void);
+
+/* Stop and close the event device, after the lcores joined. */
+void flowbook_event_free(void);
+
+#endif /* _FLOWBOOK_EVENT_H_ */
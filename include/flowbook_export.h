@@ -0,0 +1,117 @@
+/**
+ * Bulk PostgreSQL exporter for retired flow tables.
+ * Author: Hao Zheng
+ * Date: 2023/3/9
+ *
+ * A retired shard is streamed with COPY ... FROM STDIN (FORMAT binary) into
+ * two session-local staging tables, then merged into tb_<name>_info and
+ * tb_<name>_wid_counter of its key family with one set-based upsert each; the fids of the window
+ * counters are resolved by a join on the five-tuple. The cost of an export
+ * is the bytes written plus a handful of round trips, not one per flow.
+ * Window ids are exported as 64 bit ids, extended from the 32 bit ones of
+ * the records against the clock at begin(). Only compiled with -DENABLE_DB.
+ */
+
+#ifndef _FLOWBOOK_EXPORT_H_
+#define _FLOWBOOK_EXPORT_H_
+
+#ifdef ENABLE_DB
+
+#include <string>
+#include <vector>
+#include <libpq-fe.h>
+
+#include "flowbook_entry.h"
+
+#define FLOWBOOK_DB_CONNINFO    "dbname = dcbook_hw_test user = postgres password = postgres " \
+                                "hostaddr = 127.0.0.1 port = 5432"
+#define FLOWBOOK_COPY_CHUNK     (256 * 1024)    // bytes handed to libpq at once
+#define FLOWBOOK_EXPORT_ATTEMPTS    2           // a failed shard is exported once more
+
+/* Tables of one key family: tb_<name>_info and tb_<name>_wid_counter. */
+struct flowbook_export_schema {
+    const char* name;           // "flow", "flow6" or "flowvlan"
+    const char* key_defs;       // key columns with their types
+    const char* key_cols;       // key columns, the unique key of tb_<name>_info
+    int16_t nb_key_fields;
+};
+
+extern const flowbook_export_schema FLOWBOOK_SCHEMA_V4;
+extern const flowbook_export_schema FLOWBOOK_SCHEMA_V6;
+extern const flowbook_export_schema FLOWBOOK_SCHEMA_VLAN;
+
+template <typename Key> const flowbook_export_schema& flowbook_schema_of();
+template <> inline const flowbook_export_schema& flowbook_schema_of<flow_key>() { return FLOWBOOK_SCHEMA_V4; }
+template <> inline const flowbook_export_schema& flowbook_schema_of<flow_key_v6>() { return FLOWBOOK_SCHEMA_V6; }
+template <> inline const flowbook_export_schema& flowbook_schema_of<flow_key_vlan>() { return FLOWBOOK_SCHEMA_VLAN; }
+
+/**
+ * One database session, owned by a single reporting thread.
+ *
+ * Usage per shard:
+ *   begin();
+ *   copy_start(FLOWS);   put_flow(k, a)...;     copy_end();
+ *   copy_start(WINDOWS); put_windows(k, a)...;  copy_end();
+ *   commit();            // merges and commits, rolls back on any error
+*/
+class flowbook_exporter {
+
+public:
+    enum copy_target { FLOWS, WINDOWS };
+
+    flowbook_exporter(const flowbook_export_schema& schema, const char* conninfo = FLOWBOOK_DB_CONNINFO);
+    ~flowbook_exporter();
+
+    flowbook_exporter(const flowbook_exporter&) = delete;
+    flowbook_exporter& operator=(const flowbook_exporter&) = delete;
+
+    bool is_open() const { return m_conn != nullptr && PQstatus(m_conn) == CONNECTION_OK; }
+
+    bool begin();
+    bool copy_start(copy_target target);
+    /* Key: flow_key, flow_key_v6 or flow_key_vlan, of the schema. */
+    template <typename Key>
+    void put_flow(const Key& key, const flow_attr& attr);
+    template <typename Key>
+    void put_windows(const Key& key, const flow_attr& attr);
+    bool copy_end();
+    bool commit();
+
+    /* Number of flow / window rows merged by the last commit(). */
+    uint64_t nb_flows() const { return m_nb_flows; }
+    uint64_t nb_windows() const { return m_nb_windows; }
+
+private:
+    bool exec(const char* sql);
+    bool prepare_session();
+    bool flush();
+    void fail(const char* what);
+
+    void put_tuple_header(int16_t nb_fields);
+    void put_be32(uint32_t v);
+    void put_int4(uint32_t v);
+    void put_int8(uint64_t v);
+    void put_bytea(const void* data, uint32_t len);
+    void put_key(const flow_key& key);
+    void put_key(const flow_key_v6& key);
+    void put_key(const flow_key_vlan& key);
+
+    PGconn* m_conn;
+    bool m_failed;              // the running export hit an error
+    bool m_in_copy;
+    std::vector<char> m_buf;    // binary COPY data not yet given to libpq
+    uint64_t m_nb_flows;
+    uint64_t m_nb_windows;
+    uint64_t m_ref_wid;         // 64 bit window id at begin()
+    int16_t m_nb_key_fields;
+    // SQL of the key family, built once.
+    std::string m_staging_sql;
+    std::string m_copy_flows_sql;
+    std::string m_copy_windows_sql;
+    std::string m_merge_flows_sql;
+    std::string m_merge_windows_sql;
+};
+
+#endif // ENABLE_DB
+
+#endif // _FLOWBOOK_EXPORT_H_
@@ -0,0 +1,311 @@
+/**
+ * Open addressing flow table with SIMD probed buckets.
+ * Author: Hao Zheng
+ * Date: 2023/2/20
+ *
+ * Every bucket is exactly one cache line of tag bytes. A tag is the top
+ * 7 bits of the flow hash with the MSB set, so one SSE/AVX2 compare checks
+ * the whole bucket and only the entries with a matching tag are touched.
+ * The home bucket comes from the mixed hash (flow_hash_bucket), since the
+ * raw bits also picked the shard.
+ * Buckets are probed linearly; each bucket counts the entries that had to
+ * pass it, so a lookup stops at the first bucket nobody overflowed from.
+ * An entry is never placed more than FLOW_MAX_PROBE buckets from its home,
+ * so a lookup or insert touches a bounded number of cache lines even in
+ * a (nearly) full table; the insert fails instead.
+ * Each bucket also carries the table generation it was last written in:
+ * clear() only bumps the generation, a bucket of an older one reads as
+ * empty and is reset by the first insert that reaches it.
+ */
+
+#ifndef _FLOWBOOK_FLAT_TABLE_H_
+#define _FLOWBOOK_FLAT_TABLE_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <type_traits>
+#include <rte_common.h>
+#include <rte_branch_prediction.h>
+#include <rte_memory.h>
+#include <rte_prefetch.h>
+#include <rte_vect.h>
+
+#include "flowbook_hash.h"
+#include "flowbook_mem.h"
+
+#define FLOW_BUCKET_SLOTS   58   // 58 tags + generation + overflow counter = 64B
+#define FLOW_BUCKET_MASK    ((1ULL << FLOW_BUCKET_SLOTS) - 1)
+#define FLOW_MAX_PROBE      8    // buckets an entry may be away from its home
+
+#define FLOW_TAG_EMPTY      0x00
+#define FLOW_TAG_USED       0x80
+
+struct flow_bucket {
+    uint8_t  _tags[FLOW_BUCKET_SLOTS];
+    uint16_t _gen;              // table generation of the content
+    uint32_t _overflow;         // entries whose home bucket is before this one
+} __rte_cache_aligned;
+
+static_assert(sizeof(flow_bucket) == RTE_CACHE_LINE_SIZE, "bucket must be one cache line");
+
+/**
+ * Return a bitmap of the slots whose tag equals @tag.
+*/
+static inline uint64_t
+flow_bucket_match(const flow_bucket* b, uint8_t tag)
+{
+    uint64_t bits;
+#if defined(__AVX2__)
+    __m256i t  = _mm256_set1_epi8((char)tag);
+    __m256i lo = _mm256_load_si256((const __m256i*)b->_tags);
+    __m256i hi = _mm256_load_si256((const __m256i*)(b->_tags + 32));
+    bits  = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, t));
+    bits |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, t)) << 32;
+#elif defined(__SSE2__)
+    __m128i t = _mm_set1_epi8((char)tag);
+    bits = 0;
+    for (int i = 0; i < 4; ++i) {
+        __m128i v = _mm_load_si128((const __m128i*)(b->_tags + 16 * i));
+        bits |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, t)) << (16 * i);
+    }
+#else
+    bits = 0;
+    for (int i = 0; i < FLOW_BUCKET_SLOTS; ++i)
+        bits |= (uint64_t)(b->_tags[i] == tag) << i;
+#endif
+    // The last 6 bytes are the generation and the overflow counter, not tags.
+    return bits & FLOW_BUCKET_MASK;
+}
+
+/**
+ * Fixed capacity hash table for one shard. Not thread safe: only the owner
+ * lcore writes, other threads may only read load_factor().
+ * Key must provide operator==, Key and Attr must be trivially copyable.
+*/
+template <typename Key, typename Attr>
+class flat_flow_table {
+
+public:
+    struct entry {
+        Key  key;
+        Attr attr;
+    };
+    static_assert(std::is_trivially_copyable<entry>::value, "entries are kept in raw memory");
+
+    flat_flow_table(size_t capacity = 0)
+        : m_buckets(nullptr), m_entries(nullptr), m_bucket_mask(0), m_max_probe(0), m_gen(0)
+    {
+        std::atomic_init(&m_size, (size_t)0);
+        reserve(capacity);
+    }
+
+    ~flat_flow_table()
+    {
+        free_storage();
+    }
+
+    flat_flow_table(const flat_flow_table&) = delete;
+    flat_flow_table& operator=(const flat_flow_table&) = delete;
+
+    /**
+     * (Re)allocate room for at least @capacity flows in the hugepage heap of
+     * @socket_id, the socket of the owner lcore. Drops all content.
+    */
+    void reserve(size_t capacity, int socket_id = SOCKET_ID_ANY)
+    {
+        size_t nb_buckets = 1;
+        while (nb_buckets * FLOW_BUCKET_SLOTS < capacity)
+            nb_buckets <<= 1;
+
+        free_storage();
+        m_buckets = static_cast<flow_bucket*>(
+            flowbook_malloc_socket("flowbook_buckets", nb_buckets * sizeof(flow_bucket), socket_id));
+        // Cache line aligned, so that a one-line entry never straddles two.
+        m_entries = static_cast<entry*>(
+            flowbook_malloc_socket("flowbook_entries", nb_buckets * FLOW_BUCKET_SLOTS * sizeof(entry),
+                                   socket_id));
+        m_bucket_mask = nb_buckets - 1;
+        m_max_probe = nb_buckets < FLOW_MAX_PROBE ? nb_buckets : FLOW_MAX_PROBE;
+        wipe();
+    }
+
+    /**
+     * Find the attribute of @key, @hash must be the key hash.
+     * Returns nullptr if the flow is not in the table.
+    */
+    Attr* find(const Key& key, uint32_t hash)
+    {
+        size_t idx = home_bucket(hash);
+        uint8_t tag = hash_tag(hash);
+
+        for (size_t probe = 0; probe < m_max_probe; ++probe) {
+            const flow_bucket* b = &m_buckets[idx];
+            if (b->_gen != m_gen)
+                break;      // empty since the last clear()
+            uint64_t hits = flow_bucket_match(b, tag);
+            while (hits) {
+                entry* e = &m_entries[idx * FLOW_BUCKET_SLOTS + __builtin_ctzll(hits)];
+                if (likely(e->key == key))
+                    return &e->attr;
+                hits &= hits - 1;
+            }
+            if (b->_overflow == 0)
+                break;
+            idx = (idx + 1) & m_bucket_mask;
+        }
+        return nullptr;
+    }
+
+    /**
+     * Bulk lookup helpers. Stage 1 pulls in the home bucket, stage 2 (once
+     * the bucket has arrived) pulls in the first entry with a matching tag,
+     * so find() of a whole burst overlaps its cache misses.
+    */
+    void prefetch_bucket(uint32_t hash) const
+    {
+        rte_prefetch0(&m_buckets[home_bucket(hash)]);
+    }
+    void prefetch_entry(uint32_t hash) const
+    {
+        size_t idx = home_bucket(hash);
+        if (m_buckets[idx]._gen != m_gen)
+            return;
+        uint64_t hits = flow_bucket_match(&m_buckets[idx], hash_tag(hash));
+        if (hits)
+            rte_prefetch0(&m_entries[idx * FLOW_BUCKET_SLOTS + __builtin_ctzll(hits)]);
+    }
+
+    /**
+     * Insert @key which must not be in the table yet.
+     * Returns the (default initialized) attribute slot, nullptr if the
+     * FLOW_MAX_PROBE buckets from its home are full.
+    */
+    Attr* insert(const Key& key, uint32_t hash)
+    {
+        size_t home = home_bucket(hash);
+        size_t idx = home;
+
+        for (size_t probe = 0; probe < m_max_probe; ++probe) {
+            flow_bucket* b = &m_buckets[idx];
+            if (b->_gen != m_gen) {
+                // Left over from an older generation: reset it now.
+                memset(b->_tags, FLOW_TAG_EMPTY, sizeof(b->_tags));
+                b->_overflow = 0;
+                b->_gen = m_gen;
+            }
+            uint64_t free_slots = flow_bucket_match(b, FLOW_TAG_EMPTY);
+            if (free_slots) {
+                unsigned slot = __builtin_ctzll(free_slots);
+                entry* e = &m_entries[idx * FLOW_BUCKET_SLOTS + slot];
+                b->_tags[slot] = hash_tag(hash);
+                e->key = key;
+                e->attr = Attr();
+                // Mark every bucket the new entry passed by (all current).
+                for (size_t i = home; i != idx; i = (i + 1) & m_bucket_mask)
+                    m_buckets[i]._overflow++;
+                m_size.store(m_size.load(std::memory_order_relaxed) + 1,
+                             std::memory_order_relaxed);
+                return &e->attr;
+            }
+            idx = (idx + 1) & m_bucket_mask;
+        }
+        return nullptr;
+    }
+
+    /**
+     * Slot handles: a stable index of a stored flow until it is erased,
+     * e.g. for timers that refer to a flow without holding a pointer.
+    */
+    size_t slot_of(const Attr* attr) const
+    {
+        const entry* e = (const entry*)((const char*)attr - offsetof(entry, attr));
+        return e - m_entries;
+    }
+    entry* entry_at(size_t slot) { return &m_entries[slot]; }
+
+    /**
+     * Remove the flow in @slot, @hash must be the hash it was inserted with.
+    */
+    void erase(size_t slot, uint32_t hash)
+    {
+        size_t idx = slot / FLOW_BUCKET_SLOTS;
+        m_buckets[idx]._tags[slot % FLOW_BUCKET_SLOTS] = FLOW_TAG_EMPTY;
+        // Undo the overflow marks of insert().
+        for (size_t i = home_bucket(hash); i != idx; i = (i + 1) & m_bucket_mask)
+            m_buckets[i]._overflow--;
+        m_size.store(m_size.load(std::memory_order_relaxed) - 1,
+                     std::memory_order_relaxed);
+    }
+
+    /**
+     * Visit every stored flow as fn(const Key&, const Attr&).
+    */
+    template <typename F>
+    void for_each(F&& fn) const
+    {
+        for (size_t idx = 0; idx <= m_bucket_mask; ++idx) {
+            if (m_buckets[idx]._gen != m_gen)
+                continue;
+            uint64_t used = ~flow_bucket_match(&m_buckets[idx], FLOW_TAG_EMPTY) & FLOW_BUCKET_MASK;
+            while (used) {
+                const entry* e = &m_entries[idx * FLOW_BUCKET_SLOTS + __builtin_ctzll(used)];
+                fn(e->key, e->attr);
+                used &= used - 1;
+            }
+        }
+    }
+
+    /**
+     * Drop all flows in O(1). Only when the generation wraps (every 65536
+     * calls) the buckets are actually wiped.
+    */
+    void clear()
+    {
+        if (unlikely(++m_gen == 0))
+            wipe();
+        m_size.store(0, std::memory_order_relaxed);
+    }
+
+    size_t size() const { return m_size.load(std::memory_order_relaxed); }
+    size_t capacity() const { return (m_bucket_mask + 1) * FLOW_BUCKET_SLOTS; }
+    double load_factor() const { return (double)size() / capacity(); }
+
+private:
+    void wipe()
+    {
+        memset((void*)m_buckets, 0, (m_bucket_mask + 1) * sizeof(flow_bucket));
+        m_gen = 0;
+        m_size.store(0, std::memory_order_relaxed);
+    }
+
+    void free_storage()
+    {
+        rte_free(m_buckets);
+        rte_free(m_entries);
+        m_buckets = nullptr;
+        m_entries = nullptr;
+    }
+
+    size_t home_bucket(uint32_t hash) const
+    {
+        return flow_hash_bucket(hash) & m_bucket_mask;
+    }
+
+    static inline uint8_t hash_tag(uint32_t hash)
+    {
+        return FLOW_TAG_USED | (uint8_t)(hash >> 25);
+    }
+
+    flow_bucket* m_buckets;
+    entry* m_entries;
+    size_t m_bucket_mask;
+    size_t m_max_probe;         // FLOW_MAX_PROBE, or all buckets of a tiny table
+    uint16_t m_gen;             // current generation, see flow_bucket::_gen
+    // Written by the owner only, read by the reporter to decide a switch.
+    std::atomic<size_t> m_size;
+};
+
+#endif // _FLOWBOOK_FLAT_TABLE_H_
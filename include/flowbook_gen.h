@@ -0,0 +1,86 @@
+/**
+ * Synthetic traffic generator for Flowbook.
+ * Author: Hao Zheng
+ * Date: 2023/4/6
+ *
+ * A dedicated generator lcore crafts IPv4 TCP/UDP packets from a flow
+ * distribution and hands them to the RX lcores through one single-producer /
+ * single-consumer ring per RX lcore, in place of the ports. Packets go to
+ * the RX lcore of their flow hash, so every flow stays on one lcore; a full
+ * ring drops them like a NIC would. Runs without NIC and with --no-huge.
+ *
+ * Flow f is 10.0.0.0 + f % 2^24 => 192.168.0.1, source port 1024 + f / 2^24,
+ * destination port 80 (TCP) or 53 (UDP). Distributions:
+ *   uniform: every flow with the same probability,
+ *   zipf:    rank r with probability ~ 1 / r^skew, a few elephants,
+ *   syn:     a new TCP SYN flow on every packet (SYN flood, port scan).
+ */
+
+#ifndef _FLOWBOOK_GEN_H_
+#define _FLOWBOOK_GEN_H_
+
+#include <stdint.h>
+
+#include <rte_common.h>
+#include <rte_lcore.h>
+#include <rte_mbuf.h>
+#include <rte_ring.h>
+
+#define FLOWBOOK_GEN_FLOWS_DEFAULT  65536
+#define FLOWBOOK_GEN_PKT_LEN_MIN    64      // Ethernet + IPv4 + TCP fit
+#define FLOWBOOK_GEN_PKT_LEN_MAX    1518
+
+enum flowbook_gen_dist {
+	FLOWBOOK_GEN_UNIFORM,
+	FLOWBOOK_GEN_ZIPF,
+	FLOWBOOK_GEN_SYN,
+};
+
+struct flowbook_gen_conf {
+	enum flowbook_gen_dist dist;
+	uint32_t nb_flows;
+	double skew;                /**< zipf exponent */
+	uint8_t proto;              /**< IPPROTO_TCP, IPPROTO_UDP or 0: both */
+	uint16_t pkt_len;           /**< frame length without CRC */
+	double rate_mpps;           /**< 0: as fast as possible */
+	uint64_t nb_pkts;           /**< stop after that many packets, 0: never */
+};
+
+/* per RX lcore ring of generated packets, NULL: not generating */
+extern struct rte_ring *flowbook_gen_rings[RTE_MAX_LCORE];
+
+/**
+ * Parse a spec like "dist=zipf,skew=1.1,flows=1000000,proto=tcp,len=64,
+ * rate=20,pkts=0" into @conf; missing keys keep their defaults.
+ * Returns 0 on success.
+ */
+int flowbook_gen_parse(const char *spec, struct flowbook_gen_conf *conf);
+
+/**
+ * Create the rings of @nb_rx RX lcores (@ring_size packets each, on
+ * @rx_socket) and the mbufs of generator lcore @gen_lcore.
+ * Returns 0 on success.
+ */
+int flowbook_gen_init(const struct flowbook_gen_conf *conf, uint16_t nb_rx,
+		const int *rx_socket, unsigned gen_lcore, uint32_t ring_size);
+
+/**
+ * Body of the generator lcore, until *@quit. After the packet budget is
+ * spent it waits for the RX lcores to drain the rings and sets *@quit.
+ */
+void flowbook_gen_loop(volatile bool *quit);
+
+/* Up to @nb_pkts generated packets of RX lcore @rx_id; the caller frees them. */
+static inline uint16_t
+flowbook_gen_rx(uint16_t rx_id, struct rte_mbuf **pkts, uint16_t nb_pkts)
+{
+	return rte_ring_sc_dequeue_burst(flowbook_gen_rings[rx_id],
+			(void **)pkts, nb_pkts, NULL);
+}
+
+/* Print generated and dropped packets and the rate, after the lcores joined. */
+void flowbook_gen_report(void);
+
+void flowbook_gen_free(void);
+
+#endif /* _FLOWBOOK_GEN_H_ */
@@ -11,10 +11,54 @@
 #include <random>
 #include <vector>
 #include <unordered_set>
+#include <rte_hash_crc.h>
 
 #define MAX_PRIME32 1229
 #define MAX_BIG_PRIME32 50
 
+#define FLOW_HASH_SEED  0x9e3779b9   // the golden ratio; an arbitrary value
+
+/**
+ * Single pass CRC32C over a packed key.
+ * Uses the SSE4.2 / ARMv8 crc32 instructions when the CPU has them
+ * (rte_hash_crc picks the implementation at startup).
+*/
+static inline uint32_t
+flow_hash_crc(const void *key, uint32_t len)
+{
+	return rte_hash_crc(key, len, FLOW_HASH_SEED);
+}
+
+/**
+ * Which of @n lcores / shards owns the flow with @hash. The tables tag with
+ * the top bits and the RETA picks the RX queue with the low ones, so neither
+ * is used directly: a multiplicative (Fibonacci) mix spreads all bits over
+ * the top.
+*/
+static inline uint32_t
+flow_hash_owner(uint32_t hash, uint32_t n)
+{
+	return (uint32_t)(((uint64_t)(uint32_t)(hash * 0x9e3779b1u) * n) >> 32);
+}
+
+/**
+ * Home bucket bits of @hash in a flat table. The RSS hash of the NIC is
+ * reused as the flow hash, and its low bits chose the RETA entry, i.e. the
+ * shard; the top bits of the Fibonacci mix chose the owner in the pipeline
+ * modes. Within one shard both are nearly constant, so the bucket index
+ * comes from a full avalanche (the murmur3 finalizer) instead.
+*/
+static inline uint32_t
+flow_hash_bucket(uint32_t hash)
+{
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6bu;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35u;
+	hash ^= hash >> 16;
+	return hash;
+}
+
 class flow_hasher
 {
 public:
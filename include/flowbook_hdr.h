@@ -22,9 +22,12 @@ extern "C" {
 #endif
 
 #define FLOW_BOOK_PDU_MAX_CTRS   100
+#define FLOW_BOOK_PDU_UDP_PORT   19987
 
 /**
  * Flowbook header: UDP Port (19987)
+ * Followed by pdu_num struct flowbook_pdu. The counters of a pdu belong to
+ * the windows start_wid .. start_wid + max_wid_index.
  */
 struct flowbook_header {   
 	uint8_t np_id; 
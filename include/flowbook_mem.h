@@ -0,0 +1,36 @@
+/**
+ * NUMA local hugepage memory for the flow tables.
+ * Author: Hao Zheng
+ * Date: 2023/3/27
+ *
+ * Tables, timer wheels and sketches of a shard are only touched by the lcore
+ * that owns it, so they live on that lcore's socket, in the DPDK heap
+ * (hugepages: few TLB entries for gigabytes of flows).
+ */
+
+#ifndef _FLOWBOOK_MEM_H_
+#define _FLOWBOOK_MEM_H_
+
+#include <cstddef>
+#include <new>
+#include <rte_common.h>
+#include <rte_malloc.h>
+#include <rte_memory.h>
+
+/**
+ * Cache line aligned memory on @socket_id (SOCKET_ID_ANY: no preference).
+ * Falls back to any socket when the local heap is exhausted, remote memory
+ * beats no table. Throws std::bad_alloc like new. Release with rte_free().
+*/
+static inline void*
+flowbook_malloc_socket(const char* type, size_t size, int socket_id)
+{
+    void* p = rte_malloc_socket(type, size, RTE_CACHE_LINE_SIZE, socket_id);
+    if (p == nullptr && socket_id != SOCKET_ID_ANY)
+        p = rte_malloc_socket(type, size, RTE_CACHE_LINE_SIZE, SOCKET_ID_ANY);
+    if (p == nullptr)
+        throw std::bad_alloc();
+    return p;
+}
+
+#endif // _FLOWBOOK_MEM_H_
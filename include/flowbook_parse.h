@@ -0,0 +1,82 @@
+/**
+ * Burst header parser for Flowbook.
+ * Author: Hao Zheng
+ * Date: 2023/3/20
+ *
+ * Turns a burst of mbufs into flow records. Packet N + FLOWBOOK_PREFETCH_OFFSET
+ * is prefetched while packet N is parsed; an Ethernet / option-less IPv4
+ * packet (the common case) gets its five-tuple with one 16 byte load and
+ * one byte shuffle, everything else goes through the generic parser, which
+ * walks up to two VLAN tags, IPv4 options and IPv6 extension headers.
+ * Records are split by key family, each family has its own flow table.
+ * Reports of programmable switches (UDP FLOW_BOOK_PDU_UDP_PORT) are not
+ * flows themselves; they are set aside and decoded by flowbook_decode_pdus().
+ */
+
+#ifndef _FLOWBOOK_PARSE_H_
+#define _FLOWBOOK_PARSE_H_
+
+#include <stdint.h>
+
+#include <rte_mbuf.h>
+
+#include "flowbook_entry.h"
+
+#define FLOWBOOK_PARSE_MAX_BURST    64
+#define FLOWBOOK_PREFETCH_OFFSET    3
+#define FLOWBOOK_IPV6_MAX_EXT       4   /* extension headers walked per packet */
+
+/* Flow records of one key family, stored densely. */
+template <typename Key>
+struct flowbook_recs {
+	uint16_t n;
+	Key keys[FLOWBOOK_PARSE_MAX_BURST];
+	uint32_t hashes[FLOWBOOK_PARSE_MAX_BURST];
+	flow_attr attrs[FLOWBOOK_PARSE_MAX_BURST];
+};
+
+/*
+ * Output of flowbook_parse_burst(). IPv6 packets go to v6 whether tagged or
+ * not, tagged IPv4 packets to vlan. Untagged IPv4 switch reports go to
+ * pdu_pkts.
+ */
+struct flowbook_burst {
+	struct flowbook_recs<flow_key> v4;
+	struct flowbook_recs<flow_key_v6> v6;
+	struct flowbook_recs<flow_key_vlan> vlan;
+	uint16_t nb_pdu_pkts;
+	uint32_t pdu_wid;           /**< host window the reports arrived in */
+	struct rte_mbuf *pdu_pkts[FLOWBOOK_PARSE_MAX_BURST];
+};
+
+/**
+ * Parse @nb_rx (<= FLOWBOOK_PARSE_MAX_BURST) packets received on
+ * @portid/@queueid in window @wid into @out. Packets that are neither IPv4
+ * nor IPv6 are skipped.
+ * @ptype_hw: the PMD of the port fills m->packet_type.
+ * @rss_hash: take the flow hash from the NIC when the mbuf carries one.
+ * @pdu: set the switch reports aside into pdu_pkts. The IPv4 records then
+ *     always get the software hash: the decoded pdus can only get that one,
+ *     and a flow must hash the same whichever way it was seen.
+ * Returns the number of records over all families.
+ */
+uint16_t flowbook_parse_burst(struct rte_mbuf **pkts, uint16_t nb_rx,
+		uint16_t portid, uint16_t queueid, uint32_t wid,
+		int ptype_hw, int rss_hash, int pdu, struct flowbook_burst *out);
+
+/**
+ * Decode the flowbook_pdus of switch report @m, received in host window
+ * @wid, into @out, from pdu *@next on, until @out holds
+ * FLOWBOOK_PARSE_MAX_BURST records. Their window ids are moved from the
+ * clock of the switch to the host one by a per switch offset, learnt from
+ * its first report. The records are ready
+ * for upsert_bulk(), their hashes are computed from the keys (the RSS hash
+ * is the one of the report), like the IPv4 records of a burst parsed with
+ * @pdu. Truncated pdus are ignored.
+ * Returns 1 if @out is full and *@next is where to resume, 0 once the
+ * packet is done.
+ */
+int flowbook_decode_pdus(struct rte_mbuf *m, uint32_t wid, uint16_t *next,
+		struct flowbook_recs<flow_key> *out);
+
+#endif /* _FLOWBOOK_PARSE_H_ */
@@ -0,0 +1,49 @@
+/**
+ * RX / worker pipeline for Flowbook.
+ * Author: Hao Zheng
+ * Date: 2023/4/10
+ *
+ * For ports with fewer RX queues than cores. RX lcores poll the queues and
+ * parse the bursts; the flow records (key, hash, attributes: no mbuf leaves
+ * the RX lcore) go to the worker owning the flow, which upserts them into
+ * its table shard. Each RX lcore / worker pair has one single-producer /
+ * single-consumer ring per key family, so nothing is shared between
+ * writers. A full ring drops the records, like a full NIC queue.
+ */
+
+#ifndef _FLOWBOOK_PIPELINE_H_
+#define _FLOWBOOK_PIPELINE_H_
+
+#include <stdint.h>
+
+#include <rte_common.h>
+
+#include "flowbook_parse.h"
+
+/**
+ * Create the rings between @nb_rx RX lcores (staging buffers on
+ * @rx_socket) and @nb_workers workers (rings on @worker_socket), @ring_size
+ * records each. Returns 0 on success.
+ */
+int flowbook_pipeline_init(uint16_t nb_rx, const int *rx_socket,
+		uint16_t nb_workers, const int *worker_socket, uint32_t ring_size);
+
+/* RX lcore @rx_id: stage the records of @recs for their workers. */
+void flowbook_pipeline_dispatch(uint16_t rx_id, const struct flowbook_burst *recs);
+
+/* RX lcore @rx_id: push the staged records out. */
+void flowbook_pipeline_flush(uint16_t rx_id);
+
+/**
+ * Worker @worker: up to FLOWBOOK_PARSE_MAX_BURST records per family from
+ * RX lcore @rx_id into @out. Returns the number of records.
+ */
+uint16_t flowbook_pipeline_recv(uint16_t worker, uint16_t rx_id,
+		struct flowbook_burst *out);
+
+/* Print the records sent, dropped and received, after the lcores joined. */
+void flowbook_pipeline_report(void);
+
+void flowbook_pipeline_free(void);
+
+#endif /* _FLOWBOOK_PIPELINE_H_ */
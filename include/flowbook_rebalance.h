@@ -0,0 +1,115 @@
+/**
+ * RSS redirection table rebalancing for Flowbook.
+ * Author: Hao Zheng
+ * Date: 2023/4/17
+ *
+ * The RX lcores count their packets per RETA bucket (from the RSS hash of
+ * the mbufs) and the cycles of the polls that got packets. Every period the
+ * report lcore looks for a saturated lcore and plans to move its busiest
+ * buckets that fit to the least busy lcore polling the same port, about
+ * half of the packet gap. The move takes two checks of the tables: the
+ * RETA is written first, then, once every lcore that lost buckets polled
+ * its queues empty (or FLOWBOOK_REB_DRAIN_MS later), all tables switch
+ * their epoch. A moved bucket thus has records on both shards in the
+ * retiring epoch only, which the export adds up like any flow seen by two
+ * shards, and starts the new epoch on its new shard; no table state has to
+ * be handed over. Only packets still queued on the old queue when the drain
+ * times out land on the old shard in the new epoch. Forced switches are at
+ * most one per FLOWBOOK_REB_MIN_SWITCH_MS, whatever the period.
+ */
+
+#ifndef _FLOWBOOK_REBALANCE_H_
+#define _FLOWBOOK_REBALANCE_H_
+
+#include <stdint.h>
+
+#include <rte_common.h>
+#include <rte_ethdev.h>
+#include <rte_lcore.h>
+#include <rte_mbuf.h>
+
+#define FLOWBOOK_REB_BUSY_HIGH      0.85    // busy share of a saturated lcore
+#define FLOWBOOK_REB_MAX_MOVES      16      // buckets moved per round
+#define FLOWBOOK_REB_DRAIN_MS       200     // switch anyway after the RETA write
+#define FLOWBOOK_REB_MIN_SWITCH_MS  1000    // gap between two forced switches
+
+/* load of one RX lcore, written by it only */
+struct flowbook_reb_lcore {
+	uint64_t busy_tsc;          /**< cycles of the polls that got packets */
+	uint64_t loop_tsc;          /**< cycles of all polls */
+	uint64_t drained;           /**< polls that left every queue empty */
+	uint32_t *buckets[RTE_MAX_ETHPORTS];    /**< packets per RETA bucket, NULL: port not polled */
+} __rte_cache_aligned;
+
+extern struct flowbook_reb_lcore flowbook_reb_lcores[RTE_MAX_LCORE];
+/* RETA size - 1 of each port */
+extern uint16_t flowbook_reb_mask[RTE_MAX_ETHPORTS];
+
+/* Queue @queueid of @portid is polled by RX lcore @rx_id. */
+void flowbook_rebalance_add_queue(uint16_t portid, uint16_t queueid,
+		uint16_t rx_id);
+
+/**
+ * Read the RETAs of the ports of the added queues and allocate the bucket
+ * counters of the @nb_rx RX lcores on @rx_socket. Plans every @period_ms.
+ * Call after the ports started. Returns 0 on success.
+ */
+int flowbook_rebalance_start(uint32_t period_ms, uint16_t nb_rx,
+		const int *rx_socket);
+
+/* RX lcore @rx_id: count a burst of @portid, the mbufs carry the RSS hash. */
+static inline void
+flowbook_rebalance_count(uint16_t rx_id, uint16_t portid,
+		struct rte_mbuf **pkts, uint16_t nb_pkts)
+{
+	uint32_t *buckets = flowbook_reb_lcores[rx_id].buckets[portid];
+	uint16_t mask = flowbook_reb_mask[portid];
+	uint16_t i;
+
+	if (buckets == NULL)        /* the port has no usable RETA */
+		return;
+	for (i = 0; i < nb_pkts; i++)
+		buckets[pkts[i]->hash.rss & mask]++;
+}
+
+/**
+ * RX lcore @rx_id: account one poll of @diff_tsc cycles, @busy if it got
+ * packets, @drained if no queue returned a full burst.
+ */
+static inline void
+flowbook_rebalance_cycles(uint16_t rx_id, uint64_t diff_tsc, int busy,
+		int drained)
+{
+	struct flowbook_reb_lcore *l = &flowbook_reb_lcores[rx_id];
+
+	l->loop_tsc += diff_tsc;
+	if (busy)
+		l->busy_tsc += diff_tsc;
+	if (drained)
+		l->drained++;
+}
+
+/**
+ * Report lcore, on every check of the tables: sample the loads once the
+ * period expired and plan the moves, unless a forced switch is pending or
+ * the last one is less than FLOWBOOK_REB_MIN_SWITCH_MS ago. Returns 1 while
+ * moves are pending.
+ */
+int flowbook_rebalance_plan(void);
+
+/* Report lcore: write the pending moves into the RETAs, before the switch. */
+void flowbook_rebalance_apply(void);
+
+/**
+ * Report lcore: returns 1 once the tables have to switch for the applied
+ * moves, i.e. their old queues drained or the drain timed out. Only once
+ * per apply, the caller must switch all tables then.
+ */
+int flowbook_rebalance_switch_due(void);
+
+/* Print the busy share of every RX lcore and the moves, after the lcores joined. */
+void flowbook_rebalance_report(void);
+
+void flowbook_rebalance_free(void);
+
+#endif /* _FLOWBOOK_REBALANCE_H_ */
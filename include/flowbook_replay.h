@@ -0,0 +1,54 @@
+/**
+ * PCAP replay for Flowbook.
+ * Author: Hao Zheng
+ * Date: 2023/4/3
+ *
+ * Preloads a capture into hugepage mbufs and feeds it to the packet loops in
+ * place of rte_eth_rx_burst(), so real traces can be measured without a NIC.
+ * Packets are spread over the RX lcores by their flow hash, one replay queue
+ * per RX lcore, and the mbufs are handed out again on every loop: the
+ * packet loop must not free them.
+ *
+ * Paced replay keeps the inter-packet gaps of the capture, divided by the
+ * speed multiplier. A queue behaves like an RX ring of a given size: packets
+ * that are due but do not fit any more are dropped, oldest first.
+ */
+
+#ifndef _FLOWBOOK_REPLAY_H_
+#define _FLOWBOOK_REPLAY_H_
+
+#include <stdint.h>
+
+#include <rte_common.h>
+#include <rte_mbuf.h>
+
+#define FLOWBOOK_REPLAY_MAX_PKT_LEN     9600    // longer packets are truncated
+
+/**
+ * Load the pcap @path (classic format, Ethernet, us or ns timestamps) into
+ * @nb_queues replay queues, the mbufs of queue q on @queue_socket[q].
+ * Returns 0 on success.
+ */
+int flowbook_replay_load(const char *path, uint16_t nb_queues,
+		const int *queue_socket);
+
+/**
+ * Replay the trace @loops times (0: until stopped), @speed times faster
+ * than captured (0: as fast as the lcores poll), into emulated RX rings of
+ * @ring_size packets. Call once, before the lcores are launched.
+ */
+void flowbook_replay_start(uint32_t loops, double speed, uint32_t ring_size);
+
+/* Up to @nb_pkts packets of queue @q that are due. Single consumer per queue. */
+uint16_t flowbook_replay_rx(uint16_t q, struct rte_mbuf **pkts,
+		uint16_t nb_pkts);
+
+/* All loops of every queue have been delivered. */
+int flowbook_replay_finished(void);
+
+/* Print packets, drops and sustained Mpps per lcore, after the lcores joined. */
+void flowbook_replay_report(void);
+
+void flowbook_replay_free(void);
+
+#endif /* _FLOWBOOK_REPLAY_H_ */
@@ -0,0 +1,73 @@
+/**
+ * Reporting thread pool shared by the flow tables.
+ * Author: Hao Zheng
+ * Date: 2023/4/20
+ *
+ * Up to NUMBER_OF_REPORTING_THREAD control threads (rte_ctrl_thread_create), so
+ * they run on the control cpuset of the EAL and never share a core with
+ * the RX lcores. All tables of the daemon attach to one pool; a thread
+ * wakes up when a table retired an epoch, and every FLOWBOOK_CHECK_PERIOD_MS
+ * anyway for the expired flows, and gives every attached table a turn.
+ */
+
+#ifndef _FLOWBOOK_REPORT_H_
+#define _FLOWBOOK_REPORT_H_
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+#include <pthread.h>
+
+#define NUMBER_OF_REPORTING_THREAD  4
+
+/* Work a table hands to the pool. */
+class flowbook_report_client {
+public:
+    virtual ~flowbook_report_client() = default;
+    /* One turn of reporting thread @worker_id (< NUMBER_OF_REPORTING_THREAD). */
+    virtual void report_work(size_t worker_id) = 0;
+};
+
+class flowbook_report_pool {
+
+public:
+    /* Starts the threads, the EAL must be initialized. Exits if none started. */
+    flowbook_report_pool();
+    /* Joins the threads, after every client detached. */
+    ~flowbook_report_pool();
+
+    flowbook_report_pool(const flowbook_report_pool&) = delete;
+    flowbook_report_pool& operator=(const flowbook_report_pool&) = delete;
+
+    void attach(flowbook_report_client* client);
+    /* Returns once no thread works for @client any more. */
+    void detach(flowbook_report_client* client);
+    /* Give every client a turn now, e.g. after a retired epoch. */
+    void kick();
+    /* Threads that started, their worker ids are 0 .. nb_workers() - 1. */
+    size_t nb_workers() const { return m_nb_workers; }
+
+private:
+    struct worker {
+        flowbook_report_pool* pool;
+        size_t id;
+        pthread_t tid;
+        flowbook_report_client* busy;   // client in report_work(), under m_lock
+    };
+
+    static void* thread_main(void* arg);
+    void run(worker* w);
+
+    std::mutex m_lock;
+    std::condition_variable m_cv;       // kicks and quit
+    std::condition_variable m_idle_cv;  // a thread left a client
+    std::vector<flowbook_report_client*> m_clients;
+    uint64_t m_kicks;
+    bool m_quit;
+    size_t m_nb_workers;                // started threads, fixed after the constructor
+    worker m_workers[NUMBER_OF_REPORTING_THREAD];
+};
+
+#endif // _FLOWBOOK_REPORT_H_
@@ -0,0 +1,158 @@
+/**
+ * Count-Min admission sketch in front of the exact flow table.
+ * Author: Hao Zheng
+ * Date: 2023/3/24
+ *
+ * FLOW_SKETCH_ROWS rows of packet / byte counters with conditional update:
+ * a flow only raises the cells that hold its current minimum, which keeps
+ * the overestimate of mice small. A flow that is not in the table is
+ * counted here until its estimate reaches the admission threshold; what
+ * never gets there is only reported as a per-epoch aggregate.
+ */
+
+#ifndef _FLOWBOOK_SKETCH_H_
+#define _FLOWBOOK_SKETCH_H_
+
+#include <cstdint>
+#include <cstring>
+#include <rte_common.h>
+#include <rte_malloc.h>
+#include <rte_memory.h>
+#include <rte_prefetch.h>
+
+#include "flowbook_hash.h"
+#include "flowbook_mem.h"
+
+#define FLOW_SKETCH_ROWS            4
+#define FLOW_SKETCH_WIDTH_DEFAULT   65536   // cells per row, 2 MB per sketch
+
+/**
+ * Not thread safe: like the timer wheel, owned by the writer of one table
+ * and cleared together with it after an epoch switch.
+*/
+class flow_admission_sketch {
+
+public:
+    flow_admission_sketch() : m_cells(nullptr), m_mask(0)
+    {
+        clear_stats();
+    }
+
+    ~flow_admission_sketch()
+    {
+        rte_free(m_cells);
+    }
+
+    flow_admission_sketch(const flow_admission_sketch&) = delete;
+    flow_admission_sketch& operator=(const flow_admission_sketch&) = delete;
+
+    /* Allocate @width (rounded up to a power of two) cells per row on @socket_id. */
+    void reserve(size_t width, int socket_id = SOCKET_ID_ANY)
+    {
+        width = rte_align64pow2(RTE_MAX(width, (size_t)1));
+        rte_free(m_cells);
+        m_cells = nullptr;
+        m_cells = static_cast<cell*>(
+            flowbook_malloc_socket("flowbook_sketch", sizeof(cell) * FLOW_SKETCH_ROWS * width, socket_id));
+        m_mask = width - 1;
+        clear();
+    }
+
+    /* Zero the counters and the mice statistics. */
+    void clear()
+    {
+        if (m_cells != nullptr)
+            memset(m_cells, 0, sizeof(cell) * FLOW_SKETCH_ROWS * (m_mask + 1));
+        clear_stats();
+    }
+
+    void prefetch(uint32_t hash) const
+    {
+        for (uint32_t r = 0; r < FLOW_SKETCH_ROWS; ++r)
+            rte_prefetch0(&m_cells[index(hash, r)]);
+    }
+
+    /**
+     * Count @pkts / @bytes of the flow with @hash. Returns true once its
+     * estimate reached @pkt_thresh packets or @byte_thresh bytes (0: not
+     * used); otherwise the packets are accounted to the mice.
+    */
+    bool admit(uint32_t hash, uint32_t pkts, uint32_t bytes,
+               uint32_t pkt_thresh, uint32_t byte_thresh)
+    {
+        size_t idx[FLOW_SKETCH_ROWS];
+        uint32_t min_pkts = UINT32_MAX;
+        uint32_t min_bytes = UINT32_MAX;
+
+        for (uint32_t r = 0; r < FLOW_SKETCH_ROWS; ++r) {
+            idx[r] = index(hash, r);
+            min_pkts = RTE_MIN(min_pkts, m_cells[idx[r]].pkts);
+            min_bytes = RTE_MIN(min_bytes, m_cells[idx[r]].bytes);
+        }
+        bool first_seen = (min_pkts == 0);
+        uint32_t est_pkts = sat_add(min_pkts, pkts);
+        uint32_t est_bytes = sat_add(min_bytes, bytes);
+        // Conditional update: no cell grows past the new estimate.
+        for (uint32_t r = 0; r < FLOW_SKETCH_ROWS; ++r) {
+            cell& c = m_cells[idx[r]];
+            c.pkts = RTE_MAX(c.pkts, est_pkts);
+            c.bytes = RTE_MAX(c.bytes, est_bytes);
+        }
+
+        if ((pkt_thresh > 0 && est_pkts >= pkt_thresh) ||
+            (byte_thresh > 0 && est_bytes >= byte_thresh)) {
+            m_nb_admitted++;
+            return true;
+        }
+        m_mice_pkts += pkts;
+        m_mice_bytes += bytes;
+        if (first_seen)
+            m_mice_flows++;
+        return false;
+    }
+
+    /* Flows first seen by the sketch (a lower bound, cells collide). */
+    uint64_t mice_flows() const { return m_mice_flows; }
+    uint64_t mice_pkts() const { return m_mice_pkts; }
+    uint64_t mice_bytes() const { return m_mice_bytes; }
+    uint64_t nb_admitted() const { return m_nb_admitted; }
+
+private:
+    struct cell {
+        uint32_t pkts;
+        uint32_t bytes;
+    };
+
+    static uint32_t sat_add(uint32_t a, uint32_t b)
+    {
+        uint32_t s = a + b;
+        return s < a ? UINT32_MAX : s;
+    }
+
+    // Double hashing: the rows probe mix + r * step, step odd. The raw low
+    // bits of a reused RSS hash chose the shard, so like the flat table the
+    // cells come from the avalanched hash; the step from its upper half.
+    size_t index(uint32_t hash, uint32_t r) const
+    {
+        uint32_t mix = flow_hash_bucket(hash);
+        uint32_t step = ((mix >> 16) | (mix << 16)) | 1u;
+        return r * (m_mask + 1) + ((mix + r * step) & m_mask);
+    }
+
+    void clear_stats()
+    {
+        m_mice_flows = 0;
+        m_mice_pkts = 0;
+        m_mice_bytes = 0;
+        m_nb_admitted = 0;
+    }
+
+    cell* m_cells;
+    size_t m_mask;
+    uint64_t m_mice_flows;
+    uint64_t m_mice_pkts;
+    uint64_t m_mice_bytes;
+    uint64_t m_nb_admitted;
+};
+
+#endif // _FLOWBOOK_SKETCH_H_
@@ -8,77 +8,266 @@
 #define _FLOW_BOOK_TABLE_
 
 #include "flowbook_entry.h"
+#include "flowbook_export.h"
+#include "flowbook_flat_table.h"
+#include "flowbook_report.h"
+#include "flowbook_sketch.h"
+#include "flowbook_time.h"
+#include "flowbook_wheel.h"
 #include <atomic>
 #include <chrono>
+#include <condition_variable>
 #include <fstream>
-#include <thread>
-#include <unordered_map>
-// postgreSQL cxx interfaces.
+#include <mutex>
+#include <vector>
+#include <rte_common.h>
+#include <rte_rcu_qsbr.h>
+#include <rte_ring.h>
+#include <rte_ring_elem.h>
 
-#ifdef ENABLE_DB
-#include <pqxx/pqxx>
-#endif
-
-#define DEFAULT_TABLE_SIZE  500000000   // 500M
+// ~15M flows in 2^18 whole buckets (2 x 1 GB of entries), no rounding up
+// for a power of two number of shards.
+#define DEFAULT_TABLE_SIZE  (FLOW_BUCKET_SLOTS << 18)
+// 2^25 buckets: the bucket index and the 7 bit tag use up the 32 bit flow hash.
+#define MAX_TABLE_SIZE      (FLOW_BUCKET_SLOTS << 25)
 #define DEBUG_TABLE_SIZE    1024      
 
-#define TABLE_SWITCH_COND_TIMER    15  // 10 seconds
+#define TABLE_SWITCH_COND_TIMER    15  // default epoch length in seconds
 #define TABLE_SWITCH_COND_LOAD     0.7        
 
-#define NUMBER_OF_REPORTING_THREAD  4
-#define NUMBER_OF_PARALLEL_TABLE    NUMBER_OF_REPORTING_THREAD
+#define FLOWBOOK_MAX_BULK           64  // keys hashed & prefetched as one group
+
+#define FLOWBOOK_WHEEL_TICK_SHIFT   10      // 1024 windows per aging tick (~10ms)
+#define FLOWBOOK_EXPIRE_RING_SIZE   16384   // expired flows waiting for export
 
-using FlowTable = std::unordered_map<flow_key, flow_attr>;
 using TimePoint = std::chrono::_V2::system_clock::time_point;
 
-class flowbook_table {
+/**
+ * A table shard privately owned by a single RX lcore.
+ * Only the owner writes into it, so the hot path needs no synchronization
+ * and shards never share cache lines with each other.
+ */
+template <typename Key>
+struct flowbook_shard {
+    using FlowTable = flat_flow_table<Key, flow_attr>;
+    FlowTable m_table_a;
+    FlowTable m_table_b;
+    // Aging timers of the flows in m_table_a / m_table_b.
+    flow_timer_wheel m_wheel_a;
+    flow_timer_wheel m_wheel_b;
+    // Admission sketches of the flows not (yet) in m_table_a / m_table_b.
+    flow_admission_sketch m_sketch_a;
+    flow_admission_sketch m_sketch_b;
+    // Expired flows, owner lcore -> reporting thread.
+    struct rte_ring* m_expired = nullptr;
+    int       m_socket = SOCKET_ID_ANY; // NUMA socket of the owner lcore
+    uint64_t  m_nb_drop = 0;    // flows lost because their part of the write table was full
+    uint64_t  m_nb_expired = 0; // flows that left the table by aging
+    uint64_t  m_nb_mice_pkts = 0;   // packets never admitted, all epochs
+} __rte_cache_aligned;
+
+/**
+ * Epoch switched, sharded flow table of one key type (see flow_key).
+ * Instantiated in flowbook_table.cc for flow_key, flow_key_v6 and
+ * flow_key_vlan, each family has its own tables, so IPv4 keeps its 13 byte
+ * compares.
+*/
+template <typename Key>
+class flowbook_table : public flowbook_report_client {
 
 public:
-    flowbook_table(size_t table_size = DEFAULT_TABLE_SIZE);
+    using FlowTable = flat_flow_table<Key, flow_attr>;
+
+    /**
+     * @shard_sockets: NUMA socket of the owner of each shard (nullptr: any),
+     * the memory of a shard is allocated there.
+     * @pool: reporting threads shared with the other tables, which must
+     * outlive this one (nullptr: the table starts its own).
+    */
+    flowbook_table(size_t table_size = DEFAULT_TABLE_SIZE, size_t shard_num = 1,
+                   uint32_t report_period = TABLE_SWITCH_COND_TIMER,
+                   const int* shard_sockets = nullptr,
+                   flowbook_report_pool* pool = nullptr);
     ~flowbook_table();
 
     /**
      * # THREAD SAFE # 
-     * Multiple thread can concurrently call this function.
+     * Each lcore must pass its own shard id. Different shards can be
+     * updated concurrently, a shard must never be shared by two lcores.
+    */
+    void upsert(size_t shard_id, const Key& key, const flow_attr& attr);
+
+    /**
+     * # THREAD SAFE # (same shard rule as upsert)
+     * Upsert a burst of @n flows. All keys are hashed and their buckets
+     * prefetched before the first compare, which hides DRAM latency on
+     * tables much larger than the LLC.
+    */
+    void upsert_bulk(size_t shard_id, const Key* keys, const flow_attr* attrs, uint32_t n);
+
+    /**
+     * Same as above with hashes computed by the caller (e.g. the NIC RSS
+     * hash). A flow must always come with the same hash.
+    */
+    void upsert_bulk(size_t shard_id, const Key* keys, const uint32_t* hashes,
+                     const flow_attr* attrs, uint32_t n);
+
+    /**
+     * Get current active table instance of a shard.
+    */
+    FlowTable* get_curr_read_table(size_t shard_id);
+    FlowTable* get_curr_write_table(size_t shard_id);
+
+    size_t get_shard_num() const { return m_shard_num; }
+
+    /**
+     * Enable flow aging, timeouts in windows (0: off). A flow leaves the
+     * write table once it was idle for @idle_wids, or @active_wids after
+     * its first packet, and is exported right away. Call before the first
+     * upsert.
     */
-    void upsert(flow_key key, flow_attr attr);
+    void set_aging(uint32_t idle_wids, uint32_t active_wids);
 
     /**
-     * Get current active table instance according to the flow key.
+     * Put a sketch of @sketch_width cells per row in front of the write
+     * tables: a new flow is only inserted once it was seen with
+     * @pkt_thresh packets or @byte_thresh bytes (0: unused), its record
+     * starts with the packet that crossed the threshold. All other traffic
+     * is reported per shard and epoch as an aggregate. Call before the
+     * first upsert.
     */
-    FlowTable* get_curr_read_table(const flow_key& key);
-    FlowTable* get_curr_read_table(size_t table_id);
-    FlowTable* get_curr_write_table(const flow_key& key);
-    FlowTable* get_curr_write_table(size_t table_id);
+    void set_admission(uint32_t pkt_thresh, uint32_t byte_thresh,
+                       size_t sketch_width = FLOW_SKETCH_WIDTH_DEFAULT);
+
+    /**
+     * # THREAD SAFE # (same shard rule as upsert)
+     * Run the aging timers of a shard up to @now_wid. Cheap when no tick
+     * passed; call it before quiescent().
+    */
+    void age(size_t shard_id, uint64_t now_wid){
+        if (m_aging.load(std::memory_order_relaxed))
+            age_shard(shard_id, now_wid);
+    }
+
+    /**
+     * Epoch (RCU/QSBR) protocol of a shard owner:
+     *   register_writer() once on the owning lcore before the first upsert,
+     *   quiescent() after every burst, i.e. whenever the lcore holds no
+     *   pointer into the write table any more,
+     *   writer_offline()/writer_online() around blocking work,
+     *   unregister_writer() before leaving.
+     * The reporter flips the epoch and waits until every online writer has
+     * passed a quiescent state, so nobody writes into a retired table.
+     * The writer id is the shard id, unless the shards are handed around
+     * (eventdev): then it is the index of the lcore, below get_shard_num().
+    */
+    void register_writer(size_t shard_id);
+    void unregister_writer(size_t shard_id);
+    void writer_offline(size_t shard_id) { rte_rcu_qsbr_thread_offline(m_qsv, shard_id); }
+    void writer_online(size_t shard_id) { rte_rcu_qsbr_thread_online(m_qsv, shard_id); }
+    void quiescent(size_t shard_id) { rte_rcu_qsbr_quiescent(m_qsv, shard_id); }
 
-    #ifdef ENABLE_DB 
     /**
      * # THREAD UNSAFE # 
      * check table status and report&switch the table, if needed:
-     *     a) table load is exeed a threshold.
+     *     a) table load of any shard is exeed a threshold.
      *     b) timer exceed.
-     * switch table atomically and report the table.
-     * TODO: add multithread support.
+     * switch all shards atomically (epoch boundary), wait for the writers
+     * to leave the old epoch and hand the retired tables to the reporting
+     * threads. Returns right after the hand over; no switch happens while
+     * the previous epoch is still being exported.
+     * A caller that is itself a writer must be offline.
     */
     void check_and_report();
-    #endif
+
+    /* Switch on the next check_and_report() whatever the timer and the load. */
+    void request_switch() { m_switch_requested = true; }
+
+    /* True while the reporting threads still export the retired epoch. */
+    bool is_reporting();
 
 private:
+    /* Insert or merge one flow into the write table of a shard. */
+    void upsert_hashed(size_t shard_id, FlowTable* write_table, const Key& key,
+                       uint32_t hash, const flow_attr& attr);
+
+    /* The timers belonging to a table of a shard. */
+    flow_timer_wheel* wheel_of(size_t shard_id, const FlowTable* table){
+        flowbook_shard<Key>& shard = m_shards[shard_id];
+        return table == &shard.m_table_a ? &shard.m_wheel_a : &shard.m_wheel_b;
+    }
+
+    /* The admission sketch belonging to a table of a shard. */
+    flow_admission_sketch* sketch_of(size_t shard_id, const FlowTable* table){
+        flowbook_shard<Key>& shard = m_shards[shard_id];
+        return table == &shard.m_table_a ? &shard.m_sketch_a : &shard.m_sketch_b;
+    }
+
+    /* Window id at which a flow times out. */
+    uint32_t flow_deadline(const flow_attr& attr) const;
+
+    void age_shard(size_t shard_id, uint64_t now_wid);
+
+    /* Export the flows that expired on the shards of a reporting thread. */
+    void drain_expired(size_t worker_id, std::ofstream& logfile);
+
+    /* Write flows to the log file (and the database), fn visits them as fn(key, attr). */
+    template <typename F>
+    void export_flows(size_t shard_id, size_t worker_id, std::ofstream& logfile,
+                      const char* tag, F&& for_each);
+
+    /* A turn of a reporting thread: expired flows, then the retired epoch. */
+    void report_work(size_t worker_id) override;
+
+    /* Dump one retired shard into the log file (and the database). */
+    void report_shard(size_t shard_id, size_t worker_id, std::ofstream& logfile);
+
+    // Only flipped by the reporter. true: w a r b, false: w b r a.
     std::atomic_bool m_table_flag;
+    // Quiescent state tracking of the writers (thread id = writer id).
+    struct rte_rcu_qsbr* m_qsv;
 
-    // Table Partitiion. Make multiple threads concurrently report the tables.
-    FlowTable m_table_group_a[NUMBER_OF_REPORTING_THREAD];
-    FlowTable m_table_group_b[NUMBER_OF_REPORTING_THREAD];
+    // One private shard per RX lcore. Shards are only merged at report time.
+    flowbook_shard<Key>* m_shards;
+    size_t m_shard_num;
 
     #ifdef ENABLE_DB
     // Database connection pool for data written.
-    pqxx::connection* m_db_connpool[NUMBER_OF_REPORTING_THREAD];
-    #endif 
+    flowbook_exporter* m_exporters[NUMBER_OF_REPORTING_THREAD];
+    #endif
+    // Flows that only made it into the log files, the database export failed.
+    std::atomic<uint64_t> m_nb_export_lost;
 
     TimePoint m_last_report_time;
+    uint32_t m_report_period;       // seconds between two switches, 0: load only
+    bool m_switch_requested;        // only touched by the reporter
+
+    // Flow aging, timeouts in windows.
+    std::atomic<bool> m_aging;      // set once before the RX lcores run, read by the reporters too
+    uint32_t m_idle_wids;
+    uint32_t m_active_wids;
+
+    // Admission control, thresholds of the sketches.
+    bool m_admission;
+    uint32_t m_admit_pkts;
+    uint32_t m_admit_bytes;
+
+    // Reporting threads, shared by the tables. They pull retired shards one
+    // by one from m_report_next_shard, so the export of an epoch runs in parallel.
+    flowbook_report_pool* m_pool;
+    bool m_own_pool;
+    std::mutex m_report_lock;
+    uint64_t m_report_seq;          // incremented for every retired epoch
+    size_t m_report_pending;        // threads still busy with the epoch
+    long m_report_stamp;            // epoch time stamp in the log file names
+    std::atomic<size_t> m_report_next_shard;
+    // Per reporting thread: last epoch exported, log and drain buffer of the expired flows.
+    uint64_t m_seen_seq[NUMBER_OF_REPORTING_THREAD];
+    std::ofstream m_expired_logs[NUMBER_OF_REPORTING_THREAD];
+    std::vector<flow_record<Key>> m_expired_bufs[NUMBER_OF_REPORTING_THREAD];
 
     // Global statistics.
     std::atomic<int> m_total_pkt;
 };
 
-#endif // _FLOW_BOOK_TABLE_
\ No newline at end of file
+#endif // _FLOW_BOOK_TABLE_
@@ -0,0 +1,85 @@
+/**
+ * TSC based clock for Flowbook.
+ * Author: Hao Zheng
+ * Date: 2023/3/12
+ *
+ * All lcores share one base TSC taken at start up, so a window id means the
+ * same time slice on every lcore (the TSC is invariant and synchronized on
+ * the CPUs DPDK supports). Window ids are 32 bit: with 10us windows they
+ * wrap after ~11.9 hours. What leaves the daemon is extended to 64 bit
+ * (flowbook_wid_extend), so it never wraps.
+ */
+
+#ifndef _FLOWBOOK_TIME_H_
+#define _FLOWBOOK_TIME_H_
+
+#include <stdint.h>
+
+#include <rte_common.h>
+#include <rte_cycles.h>
+#include <rte_reciprocal.h>
+
+#define FLOWBOOK_WINDOW_US_DEFAULT      10      // window of the per-flow counters
+#define FLOWBOOK_CHECK_PERIOD_MS        100     // how often the switch condition is polled
+
+struct flowbook_clock {
+	uint64_t base_tsc;          /**< TSC of window 0 */
+	uint64_t tsc_hz;
+	uint64_t window_tsc;        /**< cycles of one window */
+	uint32_t window_us;
+	struct rte_reciprocal_u64 window_div;
+} __rte_cache_aligned;
+
+extern struct flowbook_clock flowbook_clock;
+
+/**
+ * Calibrate the clock and start window 0 now. Call once, before the lcores
+ * are launched. Returns 0 on success.
+ */
+int flowbook_time_init(uint32_t window_us);
+
+static inline uint64_t
+flowbook_ms_to_tsc(uint64_t ms)
+{
+	return flowbook_clock.tsc_hz * ms / MS_PER_S;
+}
+
+/* Window id of @tsc; a multiply and shifts, no division. */
+static inline uint32_t
+flowbook_tsc_to_wid(uint64_t tsc)
+{
+	return (uint32_t)rte_reciprocal_divide_u64(tsc - flowbook_clock.base_tsc,
+			&flowbook_clock.window_div);
+}
+
+static inline uint32_t
+flowbook_wid_now(void)
+{
+	return flowbook_tsc_to_wid(rte_rdtsc());
+}
+
+/* Window id that does not wrap, for long running timers. */
+static inline uint64_t
+flowbook_tsc_to_wid64(uint64_t tsc)
+{
+	return rte_reciprocal_divide_u64(tsc - flowbook_clock.base_tsc,
+			&flowbook_clock.window_div);
+}
+
+/**
+ * 64 bit id of the 32 bit window id @wid, which lies less than 2^31 windows
+ * (~6 hours of 10us windows) before or after the 64 bit window id @ref.
+ */
+static inline uint64_t
+flowbook_wid_extend(uint32_t wid, uint64_t ref)
+{
+	return ref + (int64_t)(int32_t)(wid - (uint32_t)ref);
+}
+
+static inline uint64_t
+flowbook_s_to_wid(uint64_t s)
+{
+	return s * US_PER_S / flowbook_clock.window_us;
+}
+
+#endif /* _FLOWBOOK_TIME_H_ */
@@ -0,0 +1,98 @@
+/**
+ * Sampled per-packet trace for Flowbook.
+ * Author: Hao Zheng
+ * Date: 2023/3/2
+ *
+ * The data path hook FLOWBOOK_TRACE() is only compiled in with -DENABLE_TRACE.
+ * It copies a fixed-size binary record into a per-lcore single-producer /
+ * single-consumer ring once every N packets; the rings are drained and
+ * formatted on the first thread of the reporting pool, a control thread,
+ * so the lcores polling queues only ever enqueue.
+ */
+
+#ifndef _FLOWBOOK_TRACE_H_
+#define _FLOWBOOK_TRACE_H_
+
+#include <stdint.h>
+
+#include <rte_common.h>
+#include <rte_branch_prediction.h>
+#include <rte_cycles.h>
+#include <rte_lcore.h>
+#include <rte_ring.h>
+#include <rte_ring_elem.h>
+
+#include "flowbook_entry.h"
+#include "flowbook_report.h"
+
+#define FLOWBOOK_TRACE_RING_SIZE        4096
+#define FLOWBOOK_TRACE_SAMPLE_DEFAULT   1024   // trace 1 of N packets
+#define FLOWBOOK_TRACE_DRAIN_BURST      64
+
+struct flowbook_trace_rec {
+	uint64_t tsc;
+	flow_key key;
+	uint16_t port_id;
+	uint8_t  queue_id;
+	uint32_t pkt_len;
+	uint32_t hash;
+} __rte_packed;
+
+static_assert(sizeof(struct flowbook_trace_rec) == 32, "trace record size");
+
+struct flowbook_trace_lcore {
+	struct rte_ring *ring;      /**< NULL: lcore does not trace */
+	uint32_t countdown;         /**< packets left until the next sample */
+	uint64_t dropped;           /**< records lost because the ring was full */
+} __rte_cache_aligned;
+
+extern struct flowbook_trace_lcore flowbook_trace_lcores[RTE_MAX_LCORE];
+extern uint32_t flowbook_trace_sample;
+
+/**
+ * Create the trace ring of every enabled lcore, 1 in @sample packets, and
+ * drain them on a thread of @pool. Returns 0 on success.
+ */
+int flowbook_trace_init(uint32_t sample, flowbook_report_pool *pool);
+
+/**
+ * Format and print up to @budget records from all rings (0: everything).
+ * Must be called by a single thread: the pool, or anybody after
+ * flowbook_trace_free() detached from it.
+ */
+unsigned flowbook_trace_drain(unsigned budget);
+
+/* Detach from the pool, print what is left and free the rings. */
+void flowbook_trace_free(void);
+
+static inline void
+flowbook_trace_packet(uint16_t port_id, uint8_t queue_id, const flow_key *key,
+		uint32_t hash, uint32_t pkt_len)
+{
+	struct flowbook_trace_lcore *tl = &flowbook_trace_lcores[rte_lcore_id()];
+	struct flowbook_trace_rec rec;
+
+	if (likely(--tl->countdown != 0))
+		return;
+	tl->countdown = flowbook_trace_sample;
+	if (unlikely(tl->ring == NULL))
+		return;
+
+	rec.tsc = rte_rdtsc();
+	rec.key = *key;
+	rec.port_id = port_id;
+	rec.queue_id = queue_id;
+	rec.pkt_len = pkt_len;
+	rec.hash = hash;
+	if (rte_ring_sp_enqueue_elem(tl->ring, &rec, sizeof(rec)) != 0)
+		tl->dropped++;
+}
+
+#ifdef ENABLE_TRACE
+#define FLOWBOOK_TRACE(port, queue, key, hash, len) \
+	flowbook_trace_packet(port, queue, key, hash, len)
+#else
+#define FLOWBOOK_TRACE(port, queue, key, hash, len) do {} while (0)
+#endif
+
+#endif /* _FLOWBOOK_TRACE_H_ */
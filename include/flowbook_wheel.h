@@ -0,0 +1,153 @@
+/**
+ * Hierarchical timer wheel for flow aging.
+ * Author: Hao Zheng
+ * Date: 2023/3/16
+ *
+ * Three levels of 256 slots, a tick is whatever unit the owner chooses.
+ * Timers are identified by the table slot of their flow, so the wheel needs
+ * no allocation: one link per table slot plus the list heads.
+ * The wheel never knows the real deadline. Every timer that comes due, and
+ * every timer that cascades down a level, is handed to the owner, which
+ * either expires the flow or schedules it again. Packets therefore never
+ * touch the wheel; an active flow is rescheduled once per timeout instead.
+ */
+
+#ifndef _FLOWBOOK_WHEEL_H_
+#define _FLOWBOOK_WHEEL_H_
+
+#include <cstdint>
+#include <cstring>
+#include <rte_malloc.h>
+#include <rte_memory.h>
+
+#include "flowbook_mem.h"
+
+#define FLOW_WHEEL_BITS     8
+#define FLOW_WHEEL_SLOTS    (1u << FLOW_WHEEL_BITS)
+#define FLOW_WHEEL_MASK     (FLOW_WHEEL_SLOTS - 1)
+#define FLOW_WHEEL_LEVELS   3
+#define FLOW_WHEEL_SPAN     (1ULL << (FLOW_WHEEL_BITS * FLOW_WHEEL_LEVELS))
+#define FLOW_WHEEL_NIL      UINT32_MAX
+
+/**
+ * Not thread safe: owned by the writer of one table, cleared together with
+ * the table by whoever owns it after an epoch switch.
+*/
+class flow_timer_wheel {
+
+public:
+    flow_timer_wheel() : m_next(nullptr), m_hash(nullptr), m_now(0), m_size(0)
+    {
+        clear();
+    }
+
+    ~flow_timer_wheel()
+    {
+        rte_free(m_next);
+        rte_free(m_hash);
+    }
+
+    flow_timer_wheel(const flow_timer_wheel&) = delete;
+    flow_timer_wheel& operator=(const flow_timer_wheel&) = delete;
+
+    /**
+     * Room for one timer per slot of a table with @capacity slots, on the
+     * socket of the table owner.
+    */
+    void reserve(size_t capacity, int socket_id = SOCKET_ID_ANY)
+    {
+        rte_free(m_next);
+        rte_free(m_hash);
+        m_next = nullptr;
+        m_hash = nullptr;
+        m_next = static_cast<uint32_t*>(
+            flowbook_malloc_socket("flowbook_wheel", capacity * sizeof(uint32_t), socket_id));
+        m_hash = static_cast<uint32_t*>(
+            flowbook_malloc_socket("flowbook_wheel", capacity * sizeof(uint32_t), socket_id));
+        clear();
+    }
+
+    /* Drop all timers. The clock is kept. */
+    void clear()
+    {
+        for (size_t i = 0; i < FLOW_WHEEL_LEVELS * FLOW_WHEEL_SLOTS; ++i)
+            m_heads[i] = FLOW_WHEEL_NIL;
+        m_size = 0;
+    }
+
+    /**
+     * Arm the timer of table @slot (inserted with @hash) @ticks from now.
+     * A slot must not be armed twice. Far timers are clamped to the span of
+     * the wheel, they are simply handed back early.
+    */
+    void schedule_in(uint32_t slot, uint32_t hash, uint64_t ticks)
+    {
+        uint32_t* head;
+
+        if (ticks == 0)
+            ticks = 1;
+        if (ticks >= FLOW_WHEEL_SPAN)
+            ticks = FLOW_WHEEL_SPAN - 1;
+        uint64_t when = m_now + ticks;
+        if (ticks < FLOW_WHEEL_SLOTS)
+            head = &m_heads[when & FLOW_WHEEL_MASK];
+        else if (ticks < (1u << (2 * FLOW_WHEEL_BITS)))
+            head = &m_heads[FLOW_WHEEL_SLOTS + ((when >> FLOW_WHEEL_BITS) & FLOW_WHEEL_MASK)];
+        else
+            head = &m_heads[2 * FLOW_WHEEL_SLOTS + ((when >> (2 * FLOW_WHEEL_BITS)) & FLOW_WHEEL_MASK)];
+        m_next[slot] = *head;
+        m_hash[slot] = hash;
+        *head = slot;
+        m_size++;
+    }
+
+    /**
+     * Move the clock to @now and hand every timer of the passed slots to
+     * fn(slot, hash). The timer is disarmed when fn is called.
+    */
+    template <typename F>
+    void advance(uint64_t now, F&& fn)
+    {
+        if (m_size == 0) {
+            // Nothing to fire: jump, e.g. over a whole epoch.
+            if (now > m_now)
+                m_now = now;
+            return;
+        }
+        while (m_now < now) {
+            m_now++;
+            if ((m_now & FLOW_WHEEL_MASK) == 0) {
+                if (((m_now >> FLOW_WHEEL_BITS) & FLOW_WHEEL_MASK) == 0)
+                    fire(2 * FLOW_WHEEL_SLOTS + ((m_now >> (2 * FLOW_WHEEL_BITS)) & FLOW_WHEEL_MASK), fn);
+                fire(FLOW_WHEEL_SLOTS + ((m_now >> FLOW_WHEEL_BITS) & FLOW_WHEEL_MASK), fn);
+            }
+            fire(m_now & FLOW_WHEEL_MASK, fn);
+        }
+    }
+
+    uint64_t now() const { return m_now; }
+    size_t size() const { return m_size; }
+
+private:
+    template <typename F>
+    void fire(size_t head, F&& fn)
+    {
+        // Detach first, fn may schedule again.
+        uint32_t slot = m_heads[head];
+        m_heads[head] = FLOW_WHEEL_NIL;
+        while (slot != FLOW_WHEEL_NIL) {
+            uint32_t next = m_next[slot];
+            m_size--;
+            fn(slot, m_hash[slot]);
+            slot = next;
+        }
+    }
+
+    uint32_t m_heads[FLOW_WHEEL_LEVELS * FLOW_WHEEL_SLOTS];
+    uint32_t* m_next;
+    uint32_t* m_hash;
+    uint64_t m_now;
+    size_t m_size;
+};
+
+#endif // _FLOWBOOK_WHEEL_H_
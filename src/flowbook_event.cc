@@ -0,0 +1,380 @@
+#include "flowbook_event.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <inttypes.h>
+
+#include <rte_branch_prediction.h>
+#include <rte_bus_vdev.h>
+#include <rte_cycles.h>
+#include <rte_log.h>
+#include <rte_malloc.h>
+#include <rte_mempool.h>
+#include <rte_service.h>
+
+#include "flowbook_hash.h"
+
+#define RTE_LOGTYPE_FLOWBOOK RTE_LOGTYPE_USER1
+
+#define EV_SW_NAME          "event_sw0"
+#define EV_ENQ_BURST        32
+#define EV_CACHE_SIZE       64
+#define EV_NB_KINDS         FLOWBOOK_EVENT_AGE
+/* partly filled batches are pushed out every that many polls */
+#define EV_FLUSH_POLLS      16
+#define EV_AGE_MS           1
+
+/* staging of one RX lcore, written by it only */
+struct ev_rx {
+	uint8_t port;
+	uint16_t nb_evs;
+	uint32_t nb_polls;
+	uint64_t next_age_tsc;
+	uint64_t nb_sent;
+	uint64_t nb_drop;           /**< no batch left or the device was full */
+	struct rte_event evs[EV_ENQ_BURST];
+	void *open[];               /**< batch being filled, per shard and family */
+} __rte_cache_aligned;
+
+struct ev_worker_stats {
+	uint64_t nb_recv;
+} __rte_cache_aligned;
+
+static uint8_t ev_dev;
+static int ev_started;
+static uint32_t ev_service_id;
+/* no service lcore: the RX lcores run the scheduler in turn */
+static int ev_sched_on_rx;
+static uint64_t ev_age_tsc;
+static uint16_t ev_nb_rx;
+static uint16_t ev_nb_workers;
+static uint16_t ev_nb_shards;
+static struct rte_mempool *ev_pool;
+static struct ev_rx *ev_rxs[RTE_MAX_LCORE];
+static struct ev_worker_stats *ev_worker_stats;
+
+static uint16_t
+ev_batch_len(const struct rte_event *ev)
+{
+	switch (ev->sub_event_type) {
+	case FLOWBOOK_EVENT_V4:
+		return ((const struct flowbook_event_batch<flow_key> *)ev->event_ptr)->n;
+	case FLOWBOOK_EVENT_V6:
+		return ((const struct flowbook_event_batch<flow_key_v6> *)ev->event_ptr)->n;
+	case FLOWBOOK_EVENT_VLAN:
+		return ((const struct flowbook_event_batch<flow_key_vlan> *)ev->event_ptr)->n;
+	default:
+		return 0;
+	}
+}
+
+/* The device needs a scheduler service: map it to a service lcore if any. */
+static int
+ev_sched_setup(void)
+{
+	uint32_t lcores[RTE_MAX_LCORE];
+	int ret;
+
+	if (rte_event_dev_service_id_get(ev_dev, &ev_service_id) != 0)
+		return 0;
+	if (rte_service_lcore_list(lcores, RTE_DIM(lcores)) > 0) {
+		if (rte_service_map_lcore_set(ev_service_id, lcores[0], 1) != 0 ||
+				rte_service_runstate_set(ev_service_id, 1) != 0)
+			return -1;
+		ret = rte_service_lcore_start(lcores[0]);
+		if (ret != 0 && ret != -EALREADY)
+			return -1;
+		RTE_LOG(INFO, FLOWBOOK, "event scheduler on service lcore %u\n",
+			lcores[0]);
+		return 0;
+	}
+	ev_sched_on_rx = 1;
+	rte_service_set_runstate_mapped_check(ev_service_id, 0);
+	RTE_LOG(INFO, FLOWBOOK, "event scheduler on the RX lcores\n");
+	return rte_service_runstate_set(ev_service_id, 1);
+}
+
+static int
+ev_dev_setup(uint16_t nb_rx, uint16_t nb_workers, uint16_t nb_shards,
+		struct rte_event_dev_info *info)
+{
+	struct rte_event_dev_config dev_conf = {};
+	struct rte_event_queue_conf queue_conf;
+	struct rte_event_port_conf port_conf;
+	uint8_t queue = 0;
+	uint16_t p;
+
+	if (rte_event_dev_count() == 0 && rte_vdev_init(EV_SW_NAME, NULL) != 0) {
+		RTE_LOG(ERR, FLOWBOOK, "No event device and cannot create %s\n",
+			EV_SW_NAME);
+		return -1;
+	}
+	ev_dev = 0;
+	rte_event_dev_info_get(ev_dev, info);
+	if (nb_rx + nb_workers > info->max_event_ports ||
+			nb_shards > info->max_event_queue_flows) {
+		RTE_LOG(ERR, FLOWBOOK, "%s: %u ports and %u flows max\n",
+			info->driver_name, info->max_event_ports,
+			info->max_event_queue_flows);
+		return -1;
+	}
+
+	dev_conf.nb_event_queues = 1;
+	dev_conf.nb_event_ports = nb_rx + nb_workers;
+	dev_conf.nb_events_limit = info->max_num_events;
+	dev_conf.nb_event_queue_flows = info->max_event_queue_flows;
+	dev_conf.nb_event_port_dequeue_depth = info->max_event_port_dequeue_depth;
+	dev_conf.nb_event_port_enqueue_depth = info->max_event_port_enqueue_depth;
+	dev_conf.dequeue_timeout_ns = info->min_dequeue_timeout_ns;
+	if (rte_event_dev_configure(ev_dev, &dev_conf) != 0)
+		return -1;
+
+	rte_event_queue_default_conf_get(ev_dev, queue, &queue_conf);
+	queue_conf.schedule_type = RTE_SCHED_TYPE_ATOMIC;
+	queue_conf.event_queue_cfg = 0;
+	queue_conf.priority = RTE_EVENT_DEV_PRIORITY_NORMAL;
+	if (rte_event_queue_setup(ev_dev, queue, &queue_conf) != 0)
+		return -1;
+
+	/* workers on ports 0..nb_workers-1, the RX lcores after them */
+	for (p = 0; p < nb_rx + nb_workers; p++) {
+		rte_event_port_default_conf_get(ev_dev, p, &port_conf);
+		if (rte_event_port_setup(ev_dev, p, &port_conf) != 0)
+			return -1;
+		if (p < nb_workers &&
+				rte_event_port_link(ev_dev, p, &queue, NULL, 1) != 1)
+			return -1;
+	}
+	return ev_sched_setup();
+}
+
+int
+flowbook_event_init(uint16_t nb_rx, const int *rx_socket,
+		uint16_t nb_workers, uint16_t nb_shards, int aging)
+{
+	struct rte_event_dev_info info;
+	size_t elt_size;
+	unsigned nb_batches;
+	uint16_t r;
+
+	ev_nb_rx = nb_rx;
+	ev_nb_workers = nb_workers;
+	ev_nb_shards = nb_shards;
+	if (ev_dev_setup(nb_rx, nb_workers, nb_shards, &info) != 0) {
+		RTE_LOG(ERR, FLOWBOOK, "Cannot set up the event device\n");
+		return -1;
+	}
+
+	/* in flight, open on the RX lcores and the caches */
+	elt_size = RTE_MAX(sizeof(struct flowbook_event_batch<flow_key>),
+			RTE_MAX(sizeof(struct flowbook_event_batch<flow_key_v6>),
+				sizeof(struct flowbook_event_batch<flow_key_vlan>)));
+	nb_batches = info.max_num_events +
+		nb_rx * (nb_shards * EV_NB_KINDS + EV_ENQ_BURST) +
+		(nb_rx + nb_workers) * EV_CACHE_SIZE * 3 / 2;
+	ev_pool = rte_mempool_create("flowbook_ev", nb_batches, elt_size,
+			EV_CACHE_SIZE, 0, NULL, NULL, NULL, NULL,
+			rte_event_dev_socket_id(ev_dev), 0);
+	ev_worker_stats = (struct ev_worker_stats *)rte_zmalloc("flowbook_ev",
+			sizeof(*ev_worker_stats) * nb_workers, RTE_CACHE_LINE_SIZE);
+	if (ev_pool == NULL || ev_worker_stats == NULL)
+		goto nomem;
+	for (r = 0; r < nb_rx; r++) {
+		ev_rxs[r] = (struct ev_rx *)rte_zmalloc_socket("flowbook_ev",
+				sizeof(struct ev_rx) +
+				sizeof(void *) * nb_shards * EV_NB_KINDS,
+				RTE_CACHE_LINE_SIZE, rx_socket[r]);
+		if (ev_rxs[r] == NULL)
+			goto nomem;
+		ev_rxs[r]->port = nb_workers + r;
+	}
+
+	ev_age_tsc = aging ? rte_get_tsc_hz() * EV_AGE_MS / MS_PER_S : 0;
+	if (rte_event_dev_start(ev_dev) != 0) {
+		RTE_LOG(ERR, FLOWBOOK, "Cannot start the event device\n");
+		return -1;
+	}
+	ev_started = 1;
+	RTE_LOG(INFO, FLOWBOOK, "%s: %u RX ports, %u workers, %u atomic shards\n",
+		info.driver_name, nb_rx, nb_workers, nb_shards);
+	return 0;
+nomem:
+	RTE_LOG(ERR, FLOWBOOK, "Cannot allocate the event batches\n");
+	return -1;
+}
+
+/* Enqueue the staged events; what the device refuses is dropped. */
+static void
+ev_enqueue(struct ev_rx *rx)
+{
+	uint16_t i, sent;
+	uint32_t len;
+
+	sent = rte_event_enqueue_new_burst(ev_dev, rx->port, rx->evs, rx->nb_evs);
+	for (i = 0; i < rx->nb_evs; i++) {
+		len = ev_batch_len(&rx->evs[i]);
+		if (i < sent) {
+			rx->nb_sent += len;
+		} else if (rx->evs[i].event_ptr != NULL) {
+			rx->nb_drop += len;
+			rte_mempool_put(ev_pool, rx->evs[i].event_ptr);
+		}
+	}
+	rx->nb_evs = 0;
+}
+
+static inline void
+ev_stage(struct ev_rx *rx, uint16_t shard, uint8_t kind, void *batch)
+{
+	struct rte_event *ev = &rx->evs[rx->nb_evs++];
+
+	ev->event = 0;
+	ev->flow_id = shard;
+	ev->sub_event_type = kind;
+	ev->event_type = RTE_EVENT_TYPE_CPU;
+	ev->op = RTE_EVENT_OP_NEW;
+	ev->sched_type = RTE_SCHED_TYPE_ATOMIC;
+	ev->queue_id = 0;
+	ev->priority = RTE_EVENT_DEV_PRIORITY_NORMAL;
+	ev->event_ptr = batch;
+	if (rx->nb_evs == EV_ENQ_BURST)
+		ev_enqueue(rx);
+}
+
+template <typename Key>
+static inline void
+ev_dispatch(struct ev_rx *rx, uint8_t kind, const struct flowbook_recs<Key> *recs)
+{
+	struct flowbook_event_batch<Key> *b;
+	uint16_t i, shard;
+	void **slot;
+
+	for (i = 0; i < recs->n; i++) {
+		shard = flow_hash_owner(recs->hashes[i], ev_nb_shards);
+		slot = &rx->open[shard * EV_NB_KINDS + kind];
+		b = (struct flowbook_event_batch<Key> *)*slot;
+		if (b == NULL) {
+			if (unlikely(rte_mempool_get(ev_pool, slot) != 0)) {
+				rx->nb_drop++;
+				continue;
+			}
+			b = (struct flowbook_event_batch<Key> *)*slot;
+			b->n = 0;
+		}
+		b->keys[b->n] = recs->keys[i];
+		b->hashes[b->n] = recs->hashes[i];
+		b->attrs[b->n] = recs->attrs[i];
+		if (++b->n == FLOWBOOK_EVENT_BATCH) {
+			*slot = NULL;
+			ev_stage(rx, shard, kind, b);
+		}
+	}
+}
+
+void
+flowbook_event_dispatch(uint16_t rx_id, const struct flowbook_burst *recs)
+{
+	struct ev_rx *rx = ev_rxs[rx_id];
+
+	ev_dispatch(rx, FLOWBOOK_EVENT_V4, &recs->v4);
+	if (recs->v6.n > 0)
+		ev_dispatch(rx, FLOWBOOK_EVENT_V6, &recs->v6);
+	if (recs->vlan.n > 0)
+		ev_dispatch(rx, FLOWBOOK_EVENT_VLAN, &recs->vlan);
+}
+
+void
+flowbook_event_poll(uint16_t rx_id)
+{
+	struct ev_rx *rx = ev_rxs[rx_id];
+	uint64_t now;
+	uint32_t i;
+	uint16_t s;
+
+	if (++rx->nb_polls % EV_FLUSH_POLLS == 0) {
+		for (i = 0; i < (uint32_t)ev_nb_shards * EV_NB_KINDS; i++) {
+			if (rx->open[i] == NULL)
+				continue;
+			ev_stage(rx, i / EV_NB_KINDS, i % EV_NB_KINDS, rx->open[i]);
+			rx->open[i] = NULL;
+		}
+	}
+	/* one RX lcore is enough to drive the aging of all shards */
+	if (ev_age_tsc > 0 && rx_id == 0) {
+		now = rte_rdtsc();
+		if (now >= rx->next_age_tsc) {
+			for (s = 0; s < ev_nb_shards; s++)
+				ev_stage(rx, s, FLOWBOOK_EVENT_AGE, NULL);
+			rx->next_age_tsc = now + ev_age_tsc;
+		}
+	}
+	if (rx->nb_evs > 0)
+		ev_enqueue(rx);
+	if (ev_sched_on_rx)
+		rte_service_run_iter_on_app_lcore(ev_service_id, 1);
+}
+
+uint16_t
+flowbook_event_recv(uint16_t worker, struct rte_event *evs, uint16_t nb_evs)
+{
+	uint16_t i, n;
+
+	n = rte_event_dequeue_burst(ev_dev, worker, evs, nb_evs, 0);
+	for (i = 0; i < n; i++)
+		ev_worker_stats[worker].nb_recv += ev_batch_len(&evs[i]);
+	return n;
+}
+
+void
+flowbook_event_done(const struct rte_event *evs, uint16_t nb_evs)
+{
+	void *batches[FLOWBOOK_EVENT_DEQ_BURST];
+	uint16_t i, n = 0;
+
+	for (i = 0; i < nb_evs; i++) {
+		if (evs[i].event_ptr == NULL)
+			continue;
+		batches[n++] = evs[i].event_ptr;
+		if (n == RTE_DIM(batches)) {
+			rte_mempool_put_bulk(ev_pool, batches, n);
+			n = 0;
+		}
+	}
+	if (n > 0)
+		rte_mempool_put_bulk(ev_pool, batches, n);
+}
+
+void
+flowbook_event_report(void)
+{
+	uint16_t r, w;
+
+	printf("\nEvent pipeline statistics:\n");
+	for (r = 0; r < ev_nb_rx; r++)
+		printf("  rx %u: %" PRIu64 " records sent, %" PRIu64
+			" dropped (no batch or device full)\n", r,
+			ev_rxs[r]->nb_sent, ev_rxs[r]->nb_drop);
+	for (w = 0; w < ev_nb_workers; w++)
+		printf("  worker %u: %" PRIu64 " records received\n", w,
+			ev_worker_stats[w].nb_recv);
+}
+
+void
+flowbook_event_free(void)
+{
+	uint16_t r;
+
+	if (ev_started) {
+		rte_event_dev_stop(ev_dev);
+		rte_event_dev_close(ev_dev);
+		ev_started = 0;
+	}
+	for (r = 0; r < ev_nb_rx; r++) {
+		rte_free(ev_rxs[r]);
+		ev_rxs[r] = NULL;
+	}
+	rte_free(ev_worker_stats);
+	ev_worker_stats = NULL;
+	rte_mempool_free(ev_pool);
+	ev_pool = NULL;
+}
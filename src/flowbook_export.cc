@@ -0,0 +1,314 @@
+#include "flowbook_export.h"
+
+#ifdef ENABLE_DB
+
+#include <cstring>
+#include <iostream>
+#include <rte_byteorder.h>
+
+#include "flowbook_time.h"
+
+const flowbook_export_schema FLOWBOOK_SCHEMA_V4 = {
+    "flow",
+    "srcip BIGINT, dstip BIGINT, srcport INT, dstport INT, protocol INT",
+    "srcip, dstip, srcport, dstport, protocol", 5
+};
+const flowbook_export_schema FLOWBOOK_SCHEMA_V6 = {
+    "flow6",
+    "srcip BYTEA, dstip BYTEA, srcport INT, dstport INT, protocol INT",
+    "srcip, dstip, srcport, dstport, protocol", 5
+};
+const flowbook_export_schema FLOWBOOK_SCHEMA_VLAN = {
+    "flowvlan",
+    "outer_vid INT, inner_vid INT, srcip BIGINT, dstip BIGINT, srcport INT, dstport INT, protocol INT",
+    "outer_vid, inner_vid, srcip, dstip, srcport, dstport, protocol", 7
+};
+
+// Session-local staging tables st_<name>_info / st_<name>_wid; emptied by every commit.
+static std::string staging_sql(const flowbook_export_schema& sc)
+{
+    const std::string name = sc.name;
+    return "CREATE TEMP TABLE IF NOT EXISTS st_" + name + "_info(" + sc.key_defs + ", "
+               "pkt_tot BIGINT, pkt_max INT, byte_tot BIGINT, byte_max INT, "
+               "wid_begin BIGINT, wid_last BIGINT) ON COMMIT DELETE ROWS; "
+           "CREATE TEMP TABLE IF NOT EXISTS st_" + name + "_wid(" + sc.key_defs + ", "
+               "wid BIGINT, pkt_count INT, byte_count INT) ON COMMIT DELETE ROWS;";
+}
+
+// A shard holds every flow once, but a batch of expired flows may not: a flow
+// re-created after it expired can expire again before the batch is drained.
+// The staged rows are summed per key first, an upsert must not hit a row twice.
+// The totals are BIGINT: a few epochs of an elephant flow pass 2^31 bytes.
+static std::string merge_flows_sql(const flowbook_export_schema& sc)
+{
+    const std::string info = std::string("tb_") + sc.name + "_info";
+    const std::string keys = sc.key_cols;
+    return "INSERT INTO " + info + "(" + keys + ", "
+               "pkt_tot, pkt_max, byte_tot, byte_max, wid_begin, wid_last) "
+           "SELECT " + keys + ", "
+               "SUM(pkt_tot)::BIGINT, MAX(pkt_max), SUM(byte_tot)::BIGINT, MAX(byte_max), "
+               "MIN(wid_begin), MAX(wid_last) FROM st_" + sc.name + "_info "
+           "GROUP BY " + keys + " "
+           "ON CONFLICT(" + keys + ") DO UPDATE "
+           "SET pkt_tot=" + info + ".pkt_tot+EXCLUDED.pkt_tot, "
+               "pkt_max=GREATEST(" + info + ".pkt_max, EXCLUDED.pkt_max), "
+               "byte_tot=" + info + ".byte_tot+EXCLUDED.byte_tot, "
+               "byte_max=GREATEST(" + info + ".byte_max, EXCLUDED.byte_max), "
+               "wid_last=GREATEST(" + info + ".wid_last, EXCLUDED.wid_last)";
+}
+
+// Runs after the flow merge, so every staged window finds its fid.
+static std::string merge_windows_sql(const flowbook_export_schema& sc)
+{
+    const std::string counter = std::string("tb_") + sc.name + "_wid_counter";
+    return "INSERT INTO " + counter + "(fid, wid, pkt_count, byte_count) "
+           "SELECT f.fid, s.wid, SUM(s.pkt_count)::INT, SUM(s.byte_count)::INT "
+           "FROM st_" + sc.name + "_wid s JOIN tb_" + sc.name + "_info f "
+               "USING (" + sc.key_cols + ") "
+           "GROUP BY f.fid, s.wid "
+           "ON CONFLICT(fid, wid) DO UPDATE "
+           "SET pkt_count=" + counter + ".pkt_count+EXCLUDED.pkt_count, "
+               "byte_count=" + counter + ".byte_count+EXCLUDED.byte_count";
+}
+
+// Binary COPY framing, see the COPY page of the PostgreSQL manual.
+static const char COPY_SIGNATURE[11] = {'P', 'G', 'C', 'O', 'P', 'Y', '\n', '\377', '\r', '\n', '\0'};
+
+#define FLOW_INFO_FIELDS    6   // after the key
+#define FLOW_WID_FIELDS     3
+
+flowbook_exporter::flowbook_exporter(const flowbook_export_schema& schema, const char* conninfo)
+    : m_failed(false), m_in_copy(false), m_nb_flows(0), m_nb_windows(0), m_ref_wid(0),
+      m_nb_key_fields(schema.nb_key_fields),
+      m_staging_sql(staging_sql(schema)),
+      m_copy_flows_sql(std::string("COPY st_") + schema.name + "_info FROM STDIN (FORMAT binary)"),
+      m_copy_windows_sql(std::string("COPY st_") + schema.name + "_wid FROM STDIN (FORMAT binary)"),
+      m_merge_flows_sql(merge_flows_sql(schema)),
+      m_merge_windows_sql(merge_windows_sql(schema))
+{
+    m_buf.reserve(FLOWBOOK_COPY_CHUNK + 256);
+    m_conn = PQconnectdb(conninfo);
+    if (!is_open()) {
+        std::cerr << "Error: cannot connect to the database: " << PQerrorMessage(m_conn) << std::endl;
+        return;
+    }
+    if (!prepare_session())
+        std::cerr << "Error: cannot create the staging tables" << std::endl;
+}
+
+flowbook_exporter::~flowbook_exporter()
+{
+    if (m_conn != nullptr)
+        PQfinish(m_conn);
+}
+
+bool flowbook_exporter::prepare_session()
+{
+    return exec(m_staging_sql.c_str());
+}
+
+bool flowbook_exporter::exec(const char* sql)
+{
+    PGresult* res = PQexec(m_conn, sql);
+    ExecStatusType st = PQresultStatus(res);
+    PQclear(res);
+    if (st != PGRES_COMMAND_OK) {
+        fail(sql);
+        return false;
+    }
+    return true;
+}
+
+void flowbook_exporter::fail(const char* what)
+{
+    std::cerr << "SQL error: " << PQerrorMessage(m_conn) << std::endl;
+    std::cerr << "Query was: " << what << std::endl;
+    m_failed = true;
+}
+
+bool flowbook_exporter::begin()
+{
+    m_failed = false;
+    m_nb_flows = 0;
+    m_nb_windows = 0;
+    m_ref_wid = flowbook_tsc_to_wid64(rte_rdtsc());
+    if (PQstatus(m_conn) != CONNECTION_OK) {
+        // The server went away since the last export, try once to come back.
+        PQreset(m_conn);
+        if (PQstatus(m_conn) != CONNECTION_OK || !prepare_session()) {
+            m_failed = true;
+            return false;
+        }
+    }
+    return exec("BEGIN");
+}
+
+bool flowbook_exporter::copy_start(copy_target target)
+{
+    const char* sql = (target == FLOWS) ? m_copy_flows_sql.c_str() : m_copy_windows_sql.c_str();
+    if (m_failed)
+        return false;
+
+    PGresult* res = PQexec(m_conn, sql);
+    ExecStatusType st = PQresultStatus(res);
+    PQclear(res);
+    if (st != PGRES_COPY_IN) {
+        fail(sql);
+        return false;
+    }
+    m_in_copy = true;
+
+    // Header: signature, flags, header extension length.
+    m_buf.clear();
+    m_buf.insert(m_buf.end(), COPY_SIGNATURE, COPY_SIGNATURE + sizeof(COPY_SIGNATURE));
+    put_be32(0);
+    put_be32(0);
+    return true;
+}
+
+void flowbook_exporter::put_tuple_header(int16_t nb_fields)
+{
+    uint16_t v = rte_cpu_to_be_16((uint16_t)nb_fields);
+    m_buf.insert(m_buf.end(), (const char*)&v, (const char*)&v + sizeof(v));
+}
+
+void flowbook_exporter::put_be32(uint32_t v)
+{
+    uint32_t be = rte_cpu_to_be_32(v);
+    m_buf.insert(m_buf.end(), (const char*)&be, (const char*)&be + sizeof(be));
+}
+
+// Every column is NOT NULL data, so a field is its length followed by the value.
+void flowbook_exporter::put_int4(uint32_t v)
+{
+    put_be32(sizeof(v));
+    put_be32(v);
+}
+
+void flowbook_exporter::put_int8(uint64_t v)
+{
+    uint64_t be = rte_cpu_to_be_64(v);
+    put_be32(sizeof(be));
+    m_buf.insert(m_buf.end(), (const char*)&be, (const char*)&be + sizeof(be));
+}
+
+void flowbook_exporter::put_bytea(const void* data, uint32_t len)
+{
+    put_be32(len);
+    m_buf.insert(m_buf.end(), (const char*)data, (const char*)data + len);
+}
+
+void flowbook_exporter::put_key(const flow_key& key)
+{
+    put_int8(key._srcip);
+    put_int8(key._dstip);
+    put_int4(key._srcport);
+    put_int4(key._dstport);
+    put_int4(key._protocol);
+}
+
+void flowbook_exporter::put_key(const flow_key_v6& key)
+{
+    put_bytea(key._srcip, sizeof(key._srcip));
+    put_bytea(key._dstip, sizeof(key._dstip));
+    put_int4(key._srcport);
+    put_int4(key._dstport);
+    put_int4(key._protocol);
+}
+
+void flowbook_exporter::put_key(const flow_key_vlan& key)
+{
+    put_int4(key._outer_vid);
+    put_int4(key._inner_vid);
+    put_key(key._v4);
+}
+
+template <typename Key>
+void flowbook_exporter::put_flow(const Key& key, const flow_attr& attr)
+{
+    put_tuple_header(m_nb_key_fields + FLOW_INFO_FIELDS);
+    put_key(key);
+    put_int8(attr._packet_tot);
+    put_int4(attr._packet_max);
+    put_int8(attr._byte_tot);
+    put_int4(attr._byte_max);
+    put_int8(flowbook_wid_extend(attr._start_wid, m_ref_wid));
+    put_int8(flowbook_wid_extend(attr._max_wid, m_ref_wid));
+    m_nb_flows++;
+    if (m_buf.size() >= FLOWBOOK_COPY_CHUNK)
+        flush();
+}
+
+template <typename Key>
+void flowbook_exporter::put_windows(const Key& key, const flow_attr& attr)
+{
+    // The counter ring ends at _max_wid and holds _ctr_num windows.
+    uint64_t max_wid = flowbook_wid_extend(attr._max_wid, m_ref_wid);
+    for (uint32_t k = 0; k < attr._ctr_num && k <= max_wid; ++k) {
+        unsigned slot = (attr._ctr_head + FLOW_ATTR_MAX_CTRS - k) % FLOW_ATTR_MAX_CTRS;
+        if (attr._pktctrs[slot] == 0)
+            continue;
+        put_tuple_header(m_nb_key_fields + FLOW_WID_FIELDS);
+        put_key(key);
+        put_int8(max_wid - k);
+        put_int4(attr._pktctrs[slot]);
+        put_int4(attr._bytectrs[slot]);
+        m_nb_windows++;
+    }
+    if (m_buf.size() >= FLOWBOOK_COPY_CHUNK)
+        flush();
+}
+
+template void flowbook_exporter::put_flow(const flow_key&, const flow_attr&);
+template void flowbook_exporter::put_flow(const flow_key_v6&, const flow_attr&);
+template void flowbook_exporter::put_flow(const flow_key_vlan&, const flow_attr&);
+template void flowbook_exporter::put_windows(const flow_key&, const flow_attr&);
+template void flowbook_exporter::put_windows(const flow_key_v6&, const flow_attr&);
+template void flowbook_exporter::put_windows(const flow_key_vlan&, const flow_attr&);
+
+bool flowbook_exporter::flush()
+{
+    if (!m_failed && !m_buf.empty() &&
+        PQputCopyData(m_conn, m_buf.data(), (int)m_buf.size()) != 1)
+        fail("COPY data");
+    m_buf.clear();
+    return !m_failed;
+}
+
+bool flowbook_exporter::copy_end()
+{
+    if (!m_in_copy)
+        return false;
+    put_tuple_header(-1);   // trailer
+    flush();
+    m_in_copy = false;
+
+    if (PQputCopyEnd(m_conn, m_failed ? "export aborted" : nullptr) != 1) {
+        fail("COPY end");
+        return false;
+    }
+    PGresult* res;
+    while ((res = PQgetResult(m_conn)) != nullptr) {
+        if (PQresultStatus(res) != PGRES_COMMAND_OK && !m_failed)
+            fail("COPY end");
+        PQclear(res);
+    }
+    return !m_failed;
+}
+
+bool flowbook_exporter::commit()
+{
+    if (m_in_copy)
+        copy_end();
+    if (!m_failed && exec(m_merge_flows_sql.c_str()) && exec(m_merge_windows_sql.c_str()) && exec("COMMIT"))
+        return true;
+
+    // Keep the session usable for the next epoch.
+    if (PQstatus(m_conn) == CONNECTION_OK) {
+        PGresult* res = PQexec(m_conn, "ROLLBACK");
+        PQclear(res);
+    }
+    return false;
+}
+
+#endif // ENABLE_DB
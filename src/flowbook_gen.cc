@@ -0,0 +1,413 @@
+#include "flowbook_gen.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <math.h>
+#include <netinet/in.h>
+
+#include <rte_byteorder.h>
+#include <rte_cycles.h>
+#include <rte_ether.h>
+#include <rte_ip.h>
+#include <rte_log.h>
+#include <rte_malloc.h>
+#include <rte_memcpy.h>
+#include <rte_mempool.h>
+#include <rte_random.h>
+#include <rte_tcp.h>
+#include <rte_udp.h>
+
+#include "flowbook_hash.h"
+
+#define RTE_LOGTYPE_FLOWBOOK RTE_LOGTYPE_USER1
+
+#define GEN_BURST           32
+#define GEN_CACHE_SIZE      256
+/* partly filled RX lcore buffers are pushed out every that many bursts */
+#define GEN_FLUSH_BURSTS    8
+/* zipf ranks are drawn once at start up and cycled through */
+#define GEN_ZIPF_SEQ        (1u << 22)
+#define GEN_HDR_LEN         (sizeof(struct rte_ether_hdr) + \
+				sizeof(struct rte_ipv4_hdr) + sizeof(struct rte_tcp_hdr))
+#define GEN_SRC_BASE        RTE_IPV4(10, 0, 0, 0)
+#define GEN_DST_ADDR        RTE_IPV4(192, 168, 0, 1)
+
+struct gen_buf {
+	uint16_t n;
+	struct rte_mbuf *pkts[GEN_BURST];
+};
+
+struct gen_stats {
+	uint64_t nb_gen;
+	uint64_t nb_drop;           /**< the ring of the RX lcore was full */
+	uint64_t nb_nombuf;         /**< bursts skipped, all mbufs in flight */
+	uint64_t start_tsc;
+	uint64_t end_tsc;
+};
+
+struct rte_ring *flowbook_gen_rings[RTE_MAX_LCORE];
+
+static struct flowbook_gen_conf gen_conf;
+static uint16_t gen_nb_rx;
+static unsigned gen_lcore;
+static struct rte_mempool *gen_pool;
+static struct gen_buf *gen_bufs;
+static uint32_t *gen_zipf_seq;
+/* headers of a TCP and of a UDP packet, patched per flow */
+static uint8_t gen_tmpl[2][GEN_HDR_LEN];
+static struct gen_stats gen_stats;
+
+int
+flowbook_gen_parse(const char *spec, struct flowbook_gen_conf *conf)
+{
+	char *buf, *tok, *save = NULL, *val, *end;
+	double d;
+	int ret = 0;
+
+	conf->dist = FLOWBOOK_GEN_UNIFORM;
+	conf->nb_flows = FLOWBOOK_GEN_FLOWS_DEFAULT;
+	conf->skew = 1.0;
+	conf->proto = IPPROTO_UDP;
+	conf->pkt_len = FLOWBOOK_GEN_PKT_LEN_MIN;
+	conf->rate_mpps = 0;
+	conf->nb_pkts = 0;
+
+	buf = strdup(spec);
+	if (buf == NULL)
+		return -1;
+	for (tok = strtok_r(buf, ",", &save); tok != NULL && ret == 0;
+			tok = strtok_r(NULL, ",", &save)) {
+		val = strchr(tok, '=');
+		if (val == NULL || val[1] == '\0') {
+			ret = -1;
+			break;
+		}
+		*val++ = '\0';
+		end = NULL;
+		if (strcmp(tok, "dist") == 0) {
+			if (strcmp(val, "uniform") == 0)
+				conf->dist = FLOWBOOK_GEN_UNIFORM;
+			else if (strcmp(val, "zipf") == 0)
+				conf->dist = FLOWBOOK_GEN_ZIPF;
+			else if (strcmp(val, "syn") == 0)
+				conf->dist = FLOWBOOK_GEN_SYN;
+			else
+				ret = -1;
+		} else if (strcmp(tok, "proto") == 0) {
+			if (strcmp(val, "tcp") == 0)
+				conf->proto = IPPROTO_TCP;
+			else if (strcmp(val, "udp") == 0)
+				conf->proto = IPPROTO_UDP;
+			else if (strcmp(val, "mix") == 0)
+				conf->proto = 0;
+			else
+				ret = -1;
+		} else if (strcmp(tok, "flows") == 0 || strcmp(tok, "len") == 0 ||
+				strcmp(tok, "pkts") == 0) {
+			unsigned long long v = strtoull(val, &end, 10);
+			if (*end != '\0')
+				ret = -1;
+			else if (tok[0] == 'f' && v > 0 && v <= UINT32_MAX)
+				conf->nb_flows = v;
+			else if (tok[0] == 'l' && v >= FLOWBOOK_GEN_PKT_LEN_MIN &&
+					v <= FLOWBOOK_GEN_PKT_LEN_MAX)
+				conf->pkt_len = v;
+			else if (tok[0] == 'p')
+				conf->nb_pkts = v;
+			else
+				ret = -1;
+		} else if (strcmp(tok, "skew") == 0 || strcmp(tok, "rate") == 0) {
+			d = strtod(val, &end);
+			if (*end != '\0' || !(d >= 0) || (tok[0] == 's' && d == 0))
+				ret = -1;
+			else if (tok[0] == 's')
+				conf->skew = d;
+			else
+				conf->rate_mpps = d;
+		} else {
+			ret = -1;
+		}
+	}
+	free(buf);
+	/* a SYN flood is TCP */
+	if (conf->dist == FLOWBOOK_GEN_SYN)
+		conf->proto = IPPROTO_TCP;
+	return ret;
+}
+
+static void
+gen_build_tmpl(uint8_t *hdr, uint8_t proto, uint16_t pkt_len, uint8_t tcp_flags)
+{
+	struct rte_ether_hdr *eth = (struct rte_ether_hdr *)hdr;
+	struct rte_ipv4_hdr *ip = (struct rte_ipv4_hdr *)(eth + 1);
+	struct rte_tcp_hdr *tcp = (struct rte_tcp_hdr *)(ip + 1);
+	struct rte_udp_hdr *udp = (struct rte_udp_hdr *)(ip + 1);
+	uint16_t ip_len = pkt_len - sizeof(struct rte_ether_hdr);
+
+	memset(hdr, 0, GEN_HDR_LEN);
+	/* locally administered addresses */
+	eth->dst_addr.addr_bytes[0] = 0x02;
+	eth->dst_addr.addr_bytes[5] = 0x01;
+	eth->src_addr.addr_bytes[0] = 0x02;
+	eth->src_addr.addr_bytes[5] = 0x02;
+	eth->ether_type = rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4);
+
+	ip->version_ihl = RTE_IPV4_VHL_DEF;
+	ip->total_length = rte_cpu_to_be_16(ip_len);
+	ip->time_to_live = 64;
+	ip->next_proto_id = proto;
+	ip->dst_addr = rte_cpu_to_be_32(GEN_DST_ADDR);
+
+	if (proto == IPPROTO_TCP) {
+		tcp->dst_port = rte_cpu_to_be_16(80);
+		tcp->data_off = (sizeof(struct rte_tcp_hdr) / 4) << 4;
+		tcp->tcp_flags = tcp_flags;
+		tcp->rx_win = rte_cpu_to_be_16(65535);
+	} else {
+		udp->dst_port = rte_cpu_to_be_16(53);
+		udp->dgram_len = rte_cpu_to_be_16(ip_len - sizeof(struct rte_ipv4_hdr));
+	}
+}
+
+/* Draw GEN_ZIPF_SEQ ranks with P(r) ~ 1 / (r + 1)^skew, by inversion of the cdf. */
+static int
+gen_build_zipf(uint32_t nb_flows, double skew, int socket_id)
+{
+	double *cdf, sum = 0, u;
+	uint32_t r, i, lo, hi, mid;
+
+	cdf = (double *)malloc(sizeof(*cdf) * nb_flows);
+	gen_zipf_seq = (uint32_t *)rte_malloc_socket("flowbook_gen",
+			sizeof(*gen_zipf_seq) * GEN_ZIPF_SEQ, RTE_CACHE_LINE_SIZE,
+			socket_id);
+	if (cdf == NULL || gen_zipf_seq == NULL) {
+		free(cdf);
+		return -1;
+	}
+	for (r = 0; r < nb_flows; r++) {
+		sum += 1.0 / pow((double)r + 1, skew);
+		cdf[r] = sum;
+	}
+	for (i = 0; i < GEN_ZIPF_SEQ; i++) {
+		u = (double)(rte_rand() >> 11) * 0x1.0p-53 * sum;
+		lo = 0;
+		hi = nb_flows - 1;
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			if (cdf[mid] < u)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		gen_zipf_seq[i] = lo;
+	}
+	free(cdf);
+	return 0;
+}
+
+int
+flowbook_gen_init(const struct flowbook_gen_conf *conf, uint16_t nb_rx,
+		const int *rx_socket, unsigned lcore_id, uint32_t ring_size)
+{
+	int socket_id = rte_lcore_to_socket_id(lcore_id);
+	char name[RTE_RING_NAMESIZE];
+	unsigned nb_mbufs;
+	uint16_t s;
+
+	gen_conf = *conf;
+	gen_nb_rx = nb_rx;
+	gen_lcore = lcore_id;
+	ring_size = rte_align32pow2(RTE_MAX(ring_size, (uint32_t)GEN_BURST));
+
+	for (s = 0; s < nb_rx; s++) {
+		snprintf(name, sizeof(name), "flowbook_gen_%u", s);
+		flowbook_gen_rings[s] = rte_ring_create(name, ring_size,
+				rx_socket[s], RING_F_SP_ENQ | RING_F_SC_DEQ);
+		if (flowbook_gen_rings[s] == NULL) {
+			RTE_LOG(ERR, FLOWBOOK, "Cannot create generator ring %s\n", name);
+			return -1;
+		}
+	}
+	/* full rings, full staging buffers, one burst per RX lcore and the caches */
+	nb_mbufs = nb_rx * (ring_size + 2 * GEN_BURST + GEN_CACHE_SIZE * 3 / 2) +
+		GEN_BURST + GEN_CACHE_SIZE * 3 / 2;
+	gen_pool = rte_pktmbuf_pool_create("flowbook_gen", nb_mbufs,
+			GEN_CACHE_SIZE, 0, RTE_MBUF_DEFAULT_BUF_SIZE, socket_id);
+	gen_bufs = (struct gen_buf *)rte_zmalloc_socket("flowbook_gen",
+			sizeof(*gen_bufs) * nb_rx, RTE_CACHE_LINE_SIZE, socket_id);
+	if (gen_pool == NULL || gen_bufs == NULL) {
+		RTE_LOG(ERR, FLOWBOOK, "Cannot allocate %u generator mbufs\n",
+			nb_mbufs);
+		return -1;
+	}
+	if (conf->dist == FLOWBOOK_GEN_ZIPF &&
+			gen_build_zipf(conf->nb_flows, conf->skew, socket_id) != 0) {
+		RTE_LOG(ERR, FLOWBOOK, "Cannot allocate the zipf table of %u flows\n",
+			conf->nb_flows);
+		return -1;
+	}
+	gen_build_tmpl(gen_tmpl[0], IPPROTO_UDP, conf->pkt_len, 0);
+	gen_build_tmpl(gen_tmpl[1], IPPROTO_TCP, conf->pkt_len,
+			conf->dist == FLOWBOOK_GEN_SYN ? RTE_TCP_SYN_FLAG : RTE_TCP_ACK_FLAG);
+	memset(&gen_stats, 0, sizeof(gen_stats));
+	return 0;
+}
+
+/* Headers of a packet of @flow into @m, returns the RX lcore of the flow. */
+static inline uint16_t
+gen_fill(struct rte_mbuf *m, uint32_t flow)
+{
+	int tcp = gen_conf.proto == 0 ? (flow & 1) : gen_conf.proto == IPPROTO_TCP;
+	uint8_t *hdr = rte_pktmbuf_mtod(m, uint8_t *);
+	struct rte_ipv4_hdr *ip = (struct rte_ipv4_hdr *)(hdr + sizeof(struct rte_ether_hdr));
+	struct rte_udp_hdr *l4 = (struct rte_udp_hdr *)(ip + 1);
+
+	rte_memcpy(hdr, gen_tmpl[tcp], GEN_HDR_LEN);
+	ip->src_addr = rte_cpu_to_be_32(GEN_SRC_BASE + (flow & 0xffffff));
+	ip->hdr_checksum = rte_ipv4_cksum(ip);
+	/* source port sits at the same offset in TCP and UDP */
+	l4->src_port = rte_cpu_to_be_16(1024 + (flow >> 24));
+	m->data_len = gen_conf.pkt_len;
+	m->pkt_len = gen_conf.pkt_len;
+	/* any stable function of the flow does, the RX lcore hashes again */
+	return flow_hash_crc(&flow, sizeof(flow)) % gen_nb_rx;
+}
+
+static inline void
+gen_flush(uint16_t s)
+{
+	struct gen_buf *b = &gen_bufs[s];
+	unsigned sent;
+
+	if (b->n == 0)
+		return;
+	sent = rte_ring_sp_enqueue_burst(flowbook_gen_rings[s],
+			(void * const *)b->pkts, b->n, NULL);
+	if (unlikely(sent < b->n)) {
+		rte_pktmbuf_free_bulk(&b->pkts[sent], b->n - sent);
+		gen_stats.nb_drop += b->n - sent;
+	}
+	b->n = 0;
+}
+
+static void
+gen_flush_all(void)
+{
+	uint16_t s;
+
+	for (s = 0; s < gen_nb_rx; s++)
+		gen_flush(s);
+}
+
+void
+flowbook_gen_loop(volatile bool *quit)
+{
+	struct rte_mbuf *pkts[GEN_BURST];
+	uint64_t hz = rte_get_tsc_hz();
+	uint64_t burst_tsc = 0, next_tsc, now;
+	uint32_t flow, syn_flow = 0, zipf_pos = 0;
+	unsigned i, n, bursts = 0;
+	struct gen_buf *b;
+	uint16_t s;
+
+	RTE_LOG(INFO, FLOWBOOK, "entering generator loop on lcore %u\n",
+		rte_lcore_id());
+	if (gen_conf.rate_mpps > 0)
+		burst_tsc = (uint64_t)(GEN_BURST * hz / (gen_conf.rate_mpps * 1e6));
+	gen_stats.start_tsc = next_tsc = rte_rdtsc();
+
+	while (!*quit) {
+		n = GEN_BURST;
+		if (gen_conf.nb_pkts > 0) {
+			if (gen_stats.nb_gen >= gen_conf.nb_pkts)
+				break;
+			n = RTE_MIN((uint64_t)n, gen_conf.nb_pkts - gen_stats.nb_gen);
+		}
+		if (burst_tsc > 0) {
+			now = rte_rdtsc();
+			if ((int64_t)(now - next_tsc) < 0) {
+				gen_flush_all();
+				continue;
+			}
+			next_tsc += burst_tsc;
+			/* more than a millisecond late: no catch-up burst */
+			if ((int64_t)(now - next_tsc) > (int64_t)(hz / 1000))
+				next_tsc = now;
+		}
+		if (unlikely(rte_pktmbuf_alloc_bulk(gen_pool, pkts, n) != 0)) {
+			gen_stats.nb_nombuf++;
+			gen_flush_all();
+			continue;
+		}
+		for (i = 0; i < n; i++) {
+			switch (gen_conf.dist) {
+			case FLOWBOOK_GEN_ZIPF:
+				flow = gen_zipf_seq[zipf_pos++ & (GEN_ZIPF_SEQ - 1)];
+				break;
+			case FLOWBOOK_GEN_SYN:
+				flow = syn_flow++;
+				break;
+			default:
+				flow = (uint32_t)rte_rand_max(gen_conf.nb_flows);
+				break;
+			}
+			s = gen_fill(pkts[i], flow);
+			b = &gen_bufs[s];
+			b->pkts[b->n++] = pkts[i];
+			if (b->n == GEN_BURST)
+				gen_flush(s);
+		}
+		gen_stats.nb_gen += n;
+		if (++bursts % GEN_FLUSH_BURSTS == 0)
+			gen_flush_all();
+	}
+	gen_flush_all();
+	gen_stats.end_tsc = rte_rdtsc();
+
+	if (*quit)
+		return;
+	/* packet budget spent: stop once the RX lcores are through */
+	for (s = 0; s < gen_nb_rx && !*quit; ) {
+		if (rte_ring_empty(flowbook_gen_rings[s]))
+			s++;
+		else
+			rte_pause();
+	}
+	*quit = true;
+}
+
+void
+flowbook_gen_report(void)
+{
+	double secs = (gen_stats.end_tsc - gen_stats.start_tsc) /
+		(double)rte_get_tsc_hz();
+
+	printf("\nGenerator (lcore %u): %" PRIu64 " pkts, %" PRIu64
+		" dropped (rings full), %" PRIu64 " mbuf shortages, %.3f Mpps over %.3f s\n",
+		gen_lcore, gen_stats.nb_gen, gen_stats.nb_drop, gen_stats.nb_nombuf,
+		secs > 0 ? gen_stats.nb_gen / secs / 1e6 : 0.0, secs);
+}
+
+void
+flowbook_gen_free(void)
+{
+	struct rte_mbuf *m;
+	uint16_t s;
+
+	for (s = 0; s < gen_nb_rx; s++) {
+		if (flowbook_gen_rings[s] == NULL)
+			continue;
+		while (rte_ring_sc_dequeue(flowbook_gen_rings[s], (void **)&m) == 0)
+			rte_pktmbuf_free(m);
+		rte_ring_free(flowbook_gen_rings[s]);
+		flowbook_gen_rings[s] = NULL;
+	}
+	rte_free(gen_zipf_seq);
+	rte_free(gen_bufs);
+	rte_mempool_free(gen_pool);
+	gen_zipf_seq = NULL;
+	gen_bufs = NULL;
+	gen_pool = NULL;
+}
@@ -0,0 +1,506 @@
+#include "flowbook_parse.h"
+
+#include <netinet/in.h>
+#include <rte_byteorder.h>
+#include <rte_ether.h>
+#include <rte_ip.h>
+#include <rte_ip6.h>
+#include <rte_prefetch.h>
+#include <rte_tcp.h>
+#include <rte_udp.h>
+#include <rte_vect.h>
+
+#include "flowbook_hdr.h"
+#include "flowbook_trace.h"
+
+/*
+ * Five-tuple of an option-less IPv4 packet. Bytes 8..23 of the header are
+ * ttl, proto, csum, src, dst and the two L4 ports; one shuffle puts them
+ * into flow_key order with the ports swapped to host order.
+ * Only the first fragment carries the L4 header, the others get port 0.
+ */
+static inline void
+flowbook_extract_v4(const struct rte_ipv4_hdr *ipv4_hdr, flow_key *key)
+{
+	uint8_t proto = ipv4_hdr->next_proto_id;
+	int has_ports = (proto == IPPROTO_TCP || proto == IPPROTO_UDP) &&
+		!(ipv4_hdr->fragment_offset & rte_cpu_to_be_16(RTE_IPV4_HDR_OFFSET_MASK));
+#if defined(__SSSE3__)
+	const __m128i shuf = _mm_setr_epi8(4, 5, 6, 7, 8, 9, 10, 11,
+			13, 12, 15, 14, 1, -1, -1, -1);
+	const __m128i no_ports = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1,
+			0, 0, 0, 0, -1, 0, 0, 0);
+	__m128i v;
+
+	v = _mm_loadu_si128((const __m128i *)((const uint8_t *)ipv4_hdr + 8));
+	v = _mm_shuffle_epi8(v, shuf);
+	if (!has_ports)
+		v = _mm_and_si128(v, no_ports);
+	memcpy(key, &v, sizeof(*key));
+#else
+	/* TCP and UDP both start with the two ports */
+	const struct rte_udp_hdr *l4 = (const struct rte_udp_hdr *)(ipv4_hdr + 1);
+
+	key->_srcip = ipv4_hdr->src_addr;
+	key->_dstip = ipv4_hdr->dst_addr;
+	key->_protocol = proto;
+	if (has_ports) {
+		key->_srcport = rte_be_to_cpu_16(l4->src_port);
+		key->_dstport = rte_be_to_cpu_16(l4->dst_port);
+	} else {
+		key->_srcport = 0;
+		key->_dstport = 0;
+	}
+#endif
+}
+
+/*
+ * Generic IPv4: @len bytes of header and payload are in the mbuf.
+ * Returns 1 if @key was filled.
+ */
+static inline int
+flowbook_parse_v4(const uint8_t *l3, uint32_t len, flow_key *key)
+{
+	const struct rte_ipv4_hdr *ipv4_hdr = (const struct rte_ipv4_hdr *)l3;
+	const struct rte_udp_hdr *l4;
+	uint32_t hdr_len;
+
+	*key = {};	/* hashed and compared as raw bytes */
+	if (len < sizeof(struct rte_ipv4_hdr))
+		return 0;
+	hdr_len = rte_ipv4_hdr_len(ipv4_hdr);
+	if (hdr_len < sizeof(struct rte_ipv4_hdr) || hdr_len > len)
+		return 0;
+	key->_srcip = ipv4_hdr->src_addr;
+	key->_dstip = ipv4_hdr->dst_addr;
+	key->_protocol = ipv4_hdr->next_proto_id;
+	if (ipv4_hdr->fragment_offset & rte_cpu_to_be_16(RTE_IPV4_HDR_OFFSET_MASK))
+		return 1;
+	/* the L4 header starts after the options */
+	if ((key->_protocol == IPPROTO_TCP || key->_protocol == IPPROTO_UDP) &&
+			hdr_len + 2 * sizeof(uint16_t) <= len) {
+		l4 = (const struct rte_udp_hdr *)(l3 + hdr_len);
+		key->_srcport = rte_be_to_cpu_16(l4->src_port);
+		key->_dstport = rte_be_to_cpu_16(l4->dst_port);
+	}
+	return 1;
+}
+
+/*
+ * Generic IPv6. Hop-by-hop, routing, destination options and fragment
+ * headers are skipped, at most FLOWBOOK_IPV6_MAX_EXT of them; the flow is
+ * keyed on the first other next header. Returns 1 if @key was filled.
+ */
+static inline int
+flowbook_parse_v6(const uint8_t *l3, uint32_t len, flow_key_v6 *key)
+{
+	const struct rte_ipv6_hdr *ipv6_hdr = (const struct rte_ipv6_hdr *)l3;
+	const struct rte_ipv6_fragment_ext *frag;
+	const struct rte_udp_hdr *l4;
+	uint32_t off = sizeof(struct rte_ipv6_hdr);
+	uint8_t proto;
+	int i;
+
+	*key = {};
+	if (len < sizeof(struct rte_ipv6_hdr))
+		return 0;
+	memcpy(key->_srcip, ipv6_hdr->src_addr, sizeof(key->_srcip));
+	memcpy(key->_dstip, ipv6_hdr->dst_addr, sizeof(key->_dstip));
+	proto = ipv6_hdr->proto;
+
+	for (i = 0; i < FLOWBOOK_IPV6_MAX_EXT; i++) {
+		if (off + 8 > len)
+			break;
+		if (proto == IPPROTO_HOPOPTS || proto == IPPROTO_ROUTING ||
+				proto == IPPROTO_DSTOPTS) {
+			/* next header, length in 8 byte units not counting the first */
+			proto = l3[off];
+			off += ((uint32_t)l3[off + 1] + 1) * 8;
+		} else if (proto == IPPROTO_FRAGMENT) {
+			frag = (const struct rte_ipv6_fragment_ext *)(l3 + off);
+			proto = frag->next_header;
+			off += sizeof(struct rte_ipv6_fragment_ext);
+			if (rte_be_to_cpu_16(frag->frag_data) & RTE_IPV6_EHDR_FO_MASK) {
+				key->_protocol = proto;
+				return 1;
+			}
+		} else {
+			break;
+		}
+	}
+	key->_protocol = proto;
+	if ((proto == IPPROTO_TCP || proto == IPPROTO_UDP) &&
+			off + 2 * sizeof(uint16_t) <= len) {
+		l4 = (const struct rte_udp_hdr *)(l3 + off);
+		key->_srcport = rte_be_to_cpu_16(l4->src_port);
+		key->_dstport = rte_be_to_cpu_16(l4->dst_port);
+	}
+	return 1;
+}
+
+/* A report of a programmable switch, see flowbook_hdr.h. */
+static inline int
+flowbook_is_pdu(const flow_key *key)
+{
+	return key->_protocol == IPPROTO_UDP &&
+		key->_dstport == FLOW_BOOK_PDU_UDP_PORT;
+}
+
+enum flowbook_family {
+	FLOWBOOK_FAMILY_NONE,
+	FLOWBOOK_FAMILY_V4,
+	FLOWBOOK_FAMILY_V6,
+	FLOWBOOK_FAMILY_VLAN,
+};
+
+/*
+ * Parse with the classification done by the NIC (ptype_hw ports): the L2
+ * length, VLAN and QinQ included, and the L3 family come from @ptype; the
+ * IHL is only read when the NIC reports possible IP options. Returns the
+ * family, or -1 if the PMD could not classify the packet, which is then left
+ * to the software parser.
+ */
+static inline int
+flowbook_parse_ptype(struct rte_mbuf *m, uint32_t ptype,
+		struct flowbook_burst *out)
+{
+	const uint8_t *data = rte_pktmbuf_mtod(m, const uint8_t *);
+	const struct rte_ipv4_hdr *ipv4_hdr;
+	const struct rte_vlan_hdr *vlan_hdr;
+	uint32_t len = rte_pktmbuf_data_len(m);
+	uint32_t off = sizeof(struct rte_ether_hdr);
+	flow_key_vlan *vkey = NULL;
+	flow_key *key;
+	int nb_vlan;
+
+	switch (ptype & RTE_PTYPE_L2_MASK) {
+	case RTE_PTYPE_L2_ETHER:
+		nb_vlan = 0;
+		break;
+	case RTE_PTYPE_L2_ETHER_VLAN:
+		nb_vlan = 1;
+		break;
+	case RTE_PTYPE_L2_ETHER_QINQ:
+		nb_vlan = 2;
+		break;
+	default:
+		return -1;
+	}
+	if ((ptype & RTE_PTYPE_L3_MASK) == 0)
+		return -1;
+	if (!RTE_ETH_IS_IPV4_HDR(ptype) && !RTE_ETH_IS_IPV6_HDR(ptype))
+		return FLOWBOOK_FAMILY_NONE;
+	if (off + nb_vlan * sizeof(struct rte_vlan_hdr) > len)
+		return FLOWBOOK_FAMILY_NONE;
+
+	if (nb_vlan > 0 && RTE_ETH_IS_IPV4_HDR(ptype)) {
+		vkey = &out->vlan.keys[out->vlan.n];
+		vlan_hdr = (const struct rte_vlan_hdr *)(data + off);
+		vkey->_outer_vid = rte_be_to_cpu_16(vlan_hdr[0].vlan_tci) & 0xfff;
+		vkey->_inner_vid = nb_vlan > 1 ?
+			rte_be_to_cpu_16(vlan_hdr[1].vlan_tci) & 0xfff : 0;
+	}
+	off += nb_vlan * sizeof(struct rte_vlan_hdr);
+
+	/* like the software parser, tagged IPv6 is keyed without the tags */
+	if (RTE_ETH_IS_IPV6_HDR(ptype))
+		return flowbook_parse_v6(data + off, len - off,
+				&out->v6.keys[out->v6.n]) ?
+			FLOWBOOK_FAMILY_V6 : FLOWBOOK_FAMILY_NONE;
+
+	key = vkey != NULL ? &vkey->_v4 : &out->v4.keys[out->v4.n];
+	ipv4_hdr = (const struct rte_ipv4_hdr *)(data + off);
+	if ((ptype & RTE_PTYPE_L3_MASK) == RTE_PTYPE_L3_IPV4 ||
+			ipv4_hdr->version_ihl == RTE_IPV4_VHL_DEF)
+		flowbook_extract_v4(ipv4_hdr, key);
+	else if (!flowbook_parse_v4(data + off, len - off, key))
+		return FLOWBOOK_FAMILY_NONE;
+	return vkey != NULL ? FLOWBOOK_FAMILY_VLAN : FLOWBOOK_FAMILY_V4;
+}
+
+/*
+ * Parse @m into the next free record of its family in @out. The record is
+ * only taken if the caller bumps the count of the returned family.
+ */
+static inline enum flowbook_family
+flowbook_parse_one(struct rte_mbuf *m, int ptype_hw, struct flowbook_burst *out)
+{
+	struct rte_ether_hdr *eth_hdr = rte_pktmbuf_mtod(m, struct rte_ether_hdr *);
+	struct rte_ipv4_hdr *ipv4_hdr = (struct rte_ipv4_hdr *)(eth_hdr + 1);
+	const struct rte_vlan_hdr *vlan_hdr;
+	const uint8_t *data = (const uint8_t *)eth_hdr;
+	uint32_t len = rte_pktmbuf_data_len(m);
+	uint32_t off = sizeof(struct rte_ether_hdr);
+	uint16_t vid[2] = {0, 0};
+	uint16_t ether_type;
+	int nb_vlan = 0;
+	int family;
+
+	if (ptype_hw) {
+		family = flowbook_parse_ptype(m, m->packet_type, out);
+		if (family >= 0)
+			return (enum flowbook_family)family;
+	}
+	/* fast path: untagged Ethernet, IPv4 without options */
+	if (eth_hdr->ether_type == rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4) &&
+			ipv4_hdr->version_ihl == RTE_IPV4_VHL_DEF) {
+		flowbook_extract_v4(ipv4_hdr, &out->v4.keys[out->v4.n]);
+		return FLOWBOOK_FAMILY_V4;
+	}
+
+	if (len < off)
+		return FLOWBOOK_FAMILY_NONE;
+	// Note that the field is big ending (be).
+	ether_type = eth_hdr->ether_type;
+	while ((ether_type == rte_cpu_to_be_16(RTE_ETHER_TYPE_VLAN) ||
+			ether_type == rte_cpu_to_be_16(RTE_ETHER_TYPE_QINQ)) &&
+			nb_vlan < 2 && off + sizeof(struct rte_vlan_hdr) <= len) {
+		vlan_hdr = (const struct rte_vlan_hdr *)(data + off);
+		vid[nb_vlan++] = rte_be_to_cpu_16(vlan_hdr->vlan_tci) & 0xfff;
+		ether_type = vlan_hdr->eth_proto;
+		off += sizeof(struct rte_vlan_hdr);
+	}
+
+	if (ether_type == rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4)) {
+		if (nb_vlan == 0)
+			return flowbook_parse_v4(data + off, len - off,
+					&out->v4.keys[out->v4.n]) ?
+				FLOWBOOK_FAMILY_V4 : FLOWBOOK_FAMILY_NONE;
+		flow_key_vlan *key = &out->vlan.keys[out->vlan.n];
+		if (!flowbook_parse_v4(data + off, len - off, &key->_v4))
+			return FLOWBOOK_FAMILY_NONE;
+		key->_outer_vid = vid[0];
+		key->_inner_vid = vid[1];
+		return FLOWBOOK_FAMILY_VLAN;
+	}
+	if (ether_type == rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV6))
+		return flowbook_parse_v6(data + off, len - off,
+				&out->v6.keys[out->v6.n]) ?
+			FLOWBOOK_FAMILY_V6 : FLOWBOOK_FAMILY_NONE;
+	return FLOWBOOK_FAMILY_NONE;
+}
+
+/* Pass 2 of one family: attributes and hashes, no header access. */
+template <typename Key>
+static inline void
+flowbook_finish_recs(struct flowbook_recs<Key> *recs, struct rte_mbuf **pkts,
+		uint32_t wid, int rss_hash)
+{
+	struct rte_mbuf *m;
+	uint16_t i;
+
+	for (i = 0; i < recs->n; i++) {
+		m = pkts[i];
+		recs->attrs[i].init_packet(wid, m->pkt_len);
+		if (rss_hash && (m->ol_flags & RTE_MBUF_F_RX_RSS_HASH))
+			recs->hashes[i] = m->hash.rss;
+		else
+			recs->hashes[i] = recs->keys[i].hash();
+	}
+}
+
+uint16_t
+flowbook_parse_burst(struct rte_mbuf **pkts, uint16_t nb_rx,
+		uint16_t portid, uint16_t queueid, uint32_t wid,
+		int ptype_hw, int rss_hash, int pdu, struct flowbook_burst *out)
+{
+	struct rte_mbuf *v4_pkts[FLOWBOOK_PARSE_MAX_BURST];
+	struct rte_mbuf *v6_pkts[FLOWBOOK_PARSE_MAX_BURST];
+	struct rte_mbuf *vlan_pkts[FLOWBOOK_PARSE_MAX_BURST];
+	struct rte_mbuf *m;
+	uint16_t i, j;
+
+	out->v4.n = 0;
+	out->v6.n = 0;
+	out->vlan.n = 0;
+	out->nb_pdu_pkts = 0;
+	out->pdu_wid = wid;
+
+	for (j = 0; j < FLOWBOOK_PREFETCH_OFFSET && j < nb_rx; j++)
+		rte_prefetch0(rte_pktmbuf_mtod(pkts[j], void *));
+
+	/* pass 1: headers of packet j, while j + OFFSET is on its way */
+	for (j = 0; j < nb_rx; j++) {
+		if (j + FLOWBOOK_PREFETCH_OFFSET < nb_rx)
+			rte_prefetch0(rte_pktmbuf_mtod(
+				pkts[j + FLOWBOOK_PREFETCH_OFFSET], void *));
+		m = pkts[j];
+		switch (flowbook_parse_one(m, ptype_hw, out)) {
+		case FLOWBOOK_FAMILY_V4:
+			if (unlikely(pdu && flowbook_is_pdu(&out->v4.keys[out->v4.n])))
+				out->pdu_pkts[out->nb_pdu_pkts++] = m;
+			else
+				v4_pkts[out->v4.n++] = m;
+			break;
+		case FLOWBOOK_FAMILY_V6:
+			v6_pkts[out->v6.n++] = m;
+			break;
+		case FLOWBOOK_FAMILY_VLAN:
+			vlan_pkts[out->vlan.n++] = m;
+			break;
+		default:
+			break;
+		}
+	}
+
+	/* pass 2: independent hashes and attributes, no header access */
+	flowbook_finish_recs(&out->v4, v4_pkts, wid, rss_hash && !pdu);
+	flowbook_finish_recs(&out->v6, v6_pkts, wid, rss_hash);
+	flowbook_finish_recs(&out->vlan, vlan_pkts, wid, rss_hash);
+
+	/* sampled binary trace of the IPv4 flows, formatted later by the report lcore */
+	for (i = 0; i < out->v4.n; i++)
+		FLOWBOOK_TRACE(portid, queueid, &out->v4.keys[i],
+				out->v4.hashes[i], v4_pkts[i]->pkt_len);
+	return out->v4.n + out->v6.n + out->vlan.n;
+}
+
+/*
+ * One switch report into a flow record. The five-tuple, the scalar
+ * attributes and eight byte counters are each converted with one 16 byte
+ * load and one byte shuffle. Only the newest FLOW_ATTR_MAX_CTRS windows fit
+ * into the ring, the totals still cover all of them.
+ */
+static inline void
+flowbook_decode_pdu(const struct flowbook_pdu *pdu, flow_key *key,
+		flow_attr *attr)
+{
+	uint32_t last = RTE_MIN((uint32_t)pdu->max_wid_index,
+			(uint32_t)FLOW_BOOK_PDU_MAX_CTRS - 1);
+	uint32_t num = RTE_MIN(last + 1, (uint32_t)FLOW_ATTR_MAX_CTRS);
+	uint32_t first = last + 1 - num;
+	uint16_t packet_max, packet_tot;
+	uint32_t byte_tot, byte_max, start_wid;
+	uint32_t k;
+
+	*attr = flow_attr();
+#if defined(__SSSE3__)
+	/* the key is laid out like flow_key, only the ports need a swap */
+	const __m128i key_shuf = _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+			9, 8, 11, 10, 12, -1, -1, -1);
+	/* packet_max, packet_tot, byte_tot, byte_max, start_wid */
+	const __m128i attr_shuf = _mm_setr_epi8(1, 0, 3, 2, 7, 6, 5, 4,
+			11, 10, 9, 8, 15, 14, 13, 12);
+	uint8_t scalars[16];
+	__m128i v;
+
+	v = _mm_loadu_si128((const __m128i *)pdu);
+	v = _mm_shuffle_epi8(v, key_shuf);
+	memcpy(key, &v, sizeof(*key));
+	v = _mm_loadu_si128((const __m128i *)&pdu->packet_max);
+	v = _mm_shuffle_epi8(v, attr_shuf);
+	_mm_storeu_si128((__m128i *)scalars, v);
+	memcpy(&packet_max, scalars, 2);
+	memcpy(&packet_tot, scalars + 2, 2);
+	memcpy(&byte_tot, scalars + 4, 4);
+	memcpy(&byte_max, scalars + 8, 4);
+	memcpy(&start_wid, scalars + 12, 4);
+#else
+	key->_srcip = pdu->flowkey_srcip;
+	key->_dstip = pdu->flowkey_dstip;
+	key->_srcport = rte_be_to_cpu_16(pdu->flowkey_srcport);
+	key->_dstport = rte_be_to_cpu_16(pdu->flowkey_dstport);
+	key->_protocol = pdu->flowkey_protocol;
+	packet_max = rte_be_to_cpu_16(pdu->packet_max);
+	packet_tot = rte_be_to_cpu_16(pdu->packet_tot);
+	byte_tot = rte_be_to_cpu_32(pdu->byte_tot);
+	byte_max = rte_be_to_cpu_32(pdu->byte_max);
+	start_wid = rte_be_to_cpu_32(pdu->start_wid);
+#endif
+
+	/* windows first .. last land in ring slots 0 .. num - 1 */
+	attr->_start_wid = start_wid;
+	attr->_max_wid = start_wid + last;
+	attr->_packet_tot = packet_tot;
+	attr->_byte_tot = byte_tot;
+	attr->_packet_max = packet_max;
+	attr->_byte_max = byte_max;
+	attr->_ctr_num = (uint8_t)num;
+	attr->_ctr_head = (uint8_t)(num - 1);
+	memcpy(attr->_pktctrs, &pdu->pktctrs[first], num);
+#if defined(__SSSE3__) && FLOW_ATTR_MAX_CTRS == 8
+	/* first + 8 <= FLOW_BOOK_PDU_MAX_CTRS, the load stays in the pdu */
+	const __m128i ctr_shuf = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6,
+			9, 8, 11, 10, 13, 12, 15, 14);
+	v = _mm_loadu_si128((const __m128i *)&pdu->bytectrs[first]);
+	v = _mm_shuffle_epi8(v, ctr_shuf);
+	_mm_storeu_si128((__m128i *)attr->_bytectrs, v);
+	/* slots past _ctr_num must stay zero */
+	for (k = num; k < FLOW_ATTR_MAX_CTRS; k++)
+		attr->_bytectrs[k] = 0;
+#else
+	for (k = 0; k < num; k++)
+		attr->_bytectrs[k] = rte_be_to_cpu_16(pdu->bytectrs[first + k]);
+#endif
+}
+
+/*
+ * Host window minus switch window of every switch (np_id), learnt from its
+ * first report, whose newest window is taken as the host window it arrived
+ * in. Bit 32 marks a learnt offset. Shared by the RX lcores, the first one
+ * to see a switch sets it for all; clock drift is not followed.
+ */
+static uint64_t pdu_wid_offset[UINT8_MAX + 1];
+
+static inline uint32_t
+flowbook_pdu_wid_offset(uint8_t np_id, uint32_t last_wid, uint32_t host_wid)
+{
+	uint64_t cur = __atomic_load_n(&pdu_wid_offset[np_id], __ATOMIC_RELAXED);
+	uint64_t mine;
+
+	if (likely(cur != 0))
+		return (uint32_t)cur;
+	mine = (1ULL << 32) | (uint32_t)(host_wid - last_wid);
+	/* on failure cur holds the offset of the lcore that won */
+	if (!__atomic_compare_exchange_n(&pdu_wid_offset[np_id], &cur, mine, 0,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		return (uint32_t)cur;
+	return (uint32_t)mine;
+}
+
+int
+flowbook_decode_pdus(struct rte_mbuf *m, uint32_t wid, uint16_t *next,
+		struct flowbook_recs<flow_key> *out)
+{
+	const uint8_t *data = rte_pktmbuf_mtod(m, const uint8_t *);
+	const struct rte_ipv4_hdr *ipv4_hdr =
+		(const struct rte_ipv4_hdr *)(data + sizeof(struct rte_ether_hdr));
+	const struct flowbook_header *hdr;
+	const struct flowbook_pdu *pdus;
+	uint32_t len = rte_pktmbuf_data_len(m);
+	uint32_t off, nb, i, line, shift;
+	flow_attr *attr;
+
+	/* flowbook_parse_burst() only sets aside untagged IPv4 */
+	off = sizeof(struct rte_ether_hdr) + rte_ipv4_hdr_len(ipv4_hdr) +
+		sizeof(struct rte_udp_hdr);
+	if (len < off + sizeof(struct flowbook_header))
+		return 0;
+	hdr = (const struct flowbook_header *)(data + off);
+	pdus = (const struct flowbook_pdu *)(hdr + 1);
+	off += sizeof(struct flowbook_header);
+	nb = RTE_MIN((uint32_t)hdr->pdu_num,
+			(len - off) / (uint32_t)sizeof(struct flowbook_pdu));
+
+	for (i = *next; i < nb; i++) {
+		if (out->n == FLOWBOOK_PARSE_MAX_BURST) {
+			*next = (uint16_t)i;
+			return 1;
+		}
+		/* a pdu covers some six cache lines, fetch the next while decoding */
+		if (i + 1 < nb)
+			for (line = 0; line < sizeof(struct flowbook_pdu);
+					line += RTE_CACHE_LINE_SIZE)
+				rte_prefetch0((const uint8_t *)&pdus[i + 1] + line);
+		attr = &out->attrs[out->n];
+		flowbook_decode_pdu(&pdus[i], &out->keys[out->n], attr);
+		/* switch windows onto the host clock of the other records */
+		shift = flowbook_pdu_wid_offset(hdr->np_id, attr->_max_wid, wid);
+		attr->_start_wid += shift;
+		attr->_max_wid += shift;
+		out->hashes[out->n] = out->keys[out->n].hash();
+		out->n++;
+	}
+	*next = (uint16_t)nb;
+	return 0;
+}
@@ -0,0 +1,255 @@
+#include "flowbook_pipeline.h"
+
+#include <stdio.h>
+#include <inttypes.h>
+
+#include <rte_branch_prediction.h>
+#include <rte_log.h>
+#include <rte_malloc.h>
+#include <rte_ring.h>
+#include <rte_ring_elem.h>
+
+#include "flowbook_hash.h"
+
+#define RTE_LOGTYPE_FLOWBOOK RTE_LOGTYPE_USER1
+
+/* records staged per worker and family before an enqueue */
+#define PIPE_BURST  32
+
+/* a flow record on its way to a worker, natural alignment keeps it a multiple of 4 */
+template <typename Key>
+struct pipe_rec {
+	Key key;
+	uint32_t hash;
+	flow_attr attr;
+};
+
+static_assert(sizeof(pipe_rec<flow_key>) % 4 == 0, "ring element size");
+static_assert(sizeof(pipe_rec<flow_key_v6>) % 4 == 0, "ring element size");
+static_assert(sizeof(pipe_rec<flow_key_vlan>) % 4 == 0, "ring element size");
+
+template <typename Key>
+struct pipe_lane {
+	struct rte_ring *ring;
+	uint16_t n;
+	struct pipe_rec<Key> recs[PIPE_BURST];
+};
+
+/* from one RX lcore to one worker, written by the RX lcore only */
+struct flowbook_pipe {
+	struct pipe_lane<flow_key> v4;
+	struct pipe_lane<flow_key_v6> v6;
+	struct pipe_lane<flow_key_vlan> vlan;
+	uint64_t nb_sent;
+	uint64_t nb_drop;
+} __rte_cache_aligned;
+
+struct pipe_worker_stats {
+	uint64_t nb_recv;
+} __rte_cache_aligned;
+
+/* one row of pipes per RX lcore, on its socket */
+static struct flowbook_pipe *pipe_rows[RTE_MAX_LCORE];
+static struct pipe_worker_stats *worker_stats;
+static uint16_t pipe_nb_rx;
+static uint16_t pipe_nb_workers;
+
+static inline struct flowbook_pipe *
+pipe_of(uint16_t rx_id, uint16_t worker)
+{
+	return &pipe_rows[rx_id][worker];
+}
+
+template <typename Key>
+static struct rte_ring *
+pipe_ring_create(const char *family, uint16_t rx_id, uint16_t worker,
+		uint32_t ring_size, int socket_id)
+{
+	char name[RTE_RING_NAMESIZE];
+
+	snprintf(name, sizeof(name), "fb_pipe%s_%u_%u", family, rx_id, worker);
+	return rte_ring_create_elem(name, sizeof(struct pipe_rec<Key>),
+			ring_size, socket_id, RING_F_SP_ENQ | RING_F_SC_DEQ);
+}
+
+int
+flowbook_pipeline_init(uint16_t nb_rx, const int *rx_socket,
+		uint16_t nb_workers, const int *worker_socket, uint32_t ring_size)
+{
+	struct flowbook_pipe *p;
+	uint16_t r, w;
+
+	pipe_nb_rx = nb_rx;
+	pipe_nb_workers = nb_workers;
+	ring_size = rte_align32pow2(RTE_MAX(ring_size, (uint32_t)PIPE_BURST));
+	worker_stats = (struct pipe_worker_stats *)rte_zmalloc("flowbook_pipe",
+			sizeof(*worker_stats) * nb_workers, RTE_CACHE_LINE_SIZE);
+	if (worker_stats == NULL)
+		goto nomem;
+	for (r = 0; r < nb_rx; r++) {
+		pipe_rows[r] = (struct flowbook_pipe *)rte_zmalloc_socket(
+				"flowbook_pipe", sizeof(struct flowbook_pipe) * nb_workers,
+				RTE_CACHE_LINE_SIZE, rx_socket[r]);
+		if (pipe_rows[r] == NULL)
+			goto nomem;
+		for (w = 0; w < nb_workers; w++) {
+			p = pipe_of(r, w);
+			p->v4.ring = pipe_ring_create<flow_key>("4", r, w,
+					ring_size, worker_socket[w]);
+			p->v6.ring = pipe_ring_create<flow_key_v6>("6", r, w,
+					ring_size, worker_socket[w]);
+			p->vlan.ring = pipe_ring_create<flow_key_vlan>("v", r, w,
+					ring_size, worker_socket[w]);
+			if (p->v4.ring == NULL || p->v6.ring == NULL ||
+					p->vlan.ring == NULL) {
+				RTE_LOG(ERR, FLOWBOOK,
+					"Cannot create the rings from RX %u to worker %u\n",
+					r, w);
+				return -1;
+			}
+		}
+	}
+	return 0;
+nomem:
+	RTE_LOG(ERR, FLOWBOOK, "Cannot allocate the pipeline\n");
+	return -1;
+}
+
+template <typename Key>
+static inline void
+pipe_lane_flush(struct flowbook_pipe *p, struct pipe_lane<Key> *lane)
+{
+	unsigned sent;
+
+	if (lane->n == 0)
+		return;
+	sent = rte_ring_sp_enqueue_burst_elem(lane->ring, lane->recs,
+			sizeof(lane->recs[0]), lane->n, NULL);
+	p->nb_sent += sent;
+	p->nb_drop += lane->n - sent;
+	lane->n = 0;
+}
+
+template <typename Key>
+static inline void
+pipe_dispatch(uint16_t rx_id, struct pipe_lane<Key> flowbook_pipe::*lane,
+		const struct flowbook_recs<Key> *recs)
+{
+	struct flowbook_pipe *p;
+	struct pipe_lane<Key> *l;
+	struct pipe_rec<Key> *rec;
+	uint16_t i;
+
+	for (i = 0; i < recs->n; i++) {
+		p = pipe_of(rx_id, flow_hash_owner(recs->hashes[i], pipe_nb_workers));
+		l = &(p->*lane);
+		rec = &l->recs[l->n++];
+		rec->key = recs->keys[i];
+		rec->hash = recs->hashes[i];
+		rec->attr = recs->attrs[i];
+		if (l->n == PIPE_BURST)
+			pipe_lane_flush(p, l);
+	}
+}
+
+void
+flowbook_pipeline_dispatch(uint16_t rx_id, const struct flowbook_burst *recs)
+{
+	pipe_dispatch(rx_id, &flowbook_pipe::v4, &recs->v4);
+	if (recs->v6.n > 0)
+		pipe_dispatch(rx_id, &flowbook_pipe::v6, &recs->v6);
+	if (recs->vlan.n > 0)
+		pipe_dispatch(rx_id, &flowbook_pipe::vlan, &recs->vlan);
+}
+
+void
+flowbook_pipeline_flush(uint16_t rx_id)
+{
+	struct flowbook_pipe *p;
+	uint16_t w;
+
+	for (w = 0; w < pipe_nb_workers; w++) {
+		p = pipe_of(rx_id, w);
+		pipe_lane_flush(p, &p->v4);
+		pipe_lane_flush(p, &p->v6);
+		pipe_lane_flush(p, &p->vlan);
+	}
+}
+
+template <typename Key>
+static inline uint16_t
+pipe_lane_recv(struct rte_ring *ring, struct flowbook_recs<Key> *out)
+{
+	struct pipe_rec<Key> recs[FLOWBOOK_PARSE_MAX_BURST];
+	unsigned i, n;
+
+	n = rte_ring_sc_dequeue_burst_elem(ring, recs, sizeof(recs[0]),
+			FLOWBOOK_PARSE_MAX_BURST, NULL);
+	for (i = 0; i < n; i++) {
+		out->keys[i] = recs[i].key;
+		out->hashes[i] = recs[i].hash;
+		out->attrs[i] = recs[i].attr;
+	}
+	out->n = n;
+	return n;
+}
+
+uint16_t
+flowbook_pipeline_recv(uint16_t worker, uint16_t rx_id,
+		struct flowbook_burst *out)
+{
+	struct flowbook_pipe *p = pipe_of(rx_id, worker);
+	uint16_t n;
+
+	n = pipe_lane_recv(p->v4.ring, &out->v4);
+	n += pipe_lane_recv(p->v6.ring, &out->v6);
+	n += pipe_lane_recv(p->vlan.ring, &out->vlan);
+	out->nb_pdu_pkts = 0;
+	worker_stats[worker].nb_recv += n;
+	return n;
+}
+
+void
+flowbook_pipeline_report(void)
+{
+	struct flowbook_pipe *p;
+	uint64_t sent, drop;
+	uint16_t r, w;
+
+	printf("\nPipeline statistics:\n");
+	for (r = 0; r < pipe_nb_rx; r++) {
+		sent = drop = 0;
+		for (w = 0; w < pipe_nb_workers; w++) {
+			p = pipe_of(r, w);
+			sent += p->nb_sent;
+			drop += p->nb_drop;
+		}
+		printf("  rx %u: %" PRIu64 " records sent, %" PRIu64
+			" dropped (rings full)\n", r, sent, drop);
+	}
+	for (w = 0; w < pipe_nb_workers; w++)
+		printf("  worker %u: %" PRIu64 " records received\n", w,
+			worker_stats[w].nb_recv);
+}
+
+void
+flowbook_pipeline_free(void)
+{
+	struct flowbook_pipe *p;
+	uint16_t r, w;
+
+	for (r = 0; r < pipe_nb_rx; r++) {
+		if (pipe_rows[r] == NULL)
+			continue;
+		for (w = 0; w < pipe_nb_workers; w++) {
+			p = pipe_of(r, w);
+			rte_ring_free(p->v4.ring);
+			rte_ring_free(p->v6.ring);
+			rte_ring_free(p->vlan.ring);
+		}
+		rte_free(pipe_rows[r]);
+		pipe_rows[r] = NULL;
+	}
+	rte_free(worker_stats);
+	worker_stats = NULL;
+}
@@ -0,0 +1,369 @@
+#include "flowbook_rebalance.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <rte_cycles.h>
+#include <rte_log.h>
+#include <rte_malloc.h>
+
+#define RTE_LOGTYPE_FLOWBOOK RTE_LOGTYPE_USER1
+
+#define REB_MAX_QUEUES      128     /* MAX_RX_QUEUE_PER_PORT of main.cc */
+#define REB_RETA_MAX        RTE_ETH_RSS_RETA_SIZE_512
+#define REB_NO_RX           UINT16_MAX
+
+struct reb_port {
+	uint16_t reta_size;
+	uint16_t reta[REB_RETA_MAX];            /**< queue of each bucket */
+	uint16_t queue_rx[REB_MAX_QUEUES];      /**< RX lcore of each queue */
+	uint32_t prev[REB_RETA_MAX];            /**< bucket counters at the last sample */
+	uint32_t load[REB_RETA_MAX];            /**< packets of the last period */
+};
+
+struct reb_move {
+	uint16_t port;
+	uint16_t bucket;
+	uint16_t queue;             /**< new queue of the bucket */
+	uint16_t from;              /**< RX lcores */
+	uint16_t to;
+};
+
+struct flowbook_reb_lcore flowbook_reb_lcores[RTE_MAX_LCORE];
+uint16_t flowbook_reb_mask[RTE_MAX_ETHPORTS];
+
+static struct reb_port *reb_ports[RTE_MAX_ETHPORTS];
+static uint16_t reb_nb_rx;
+static uint64_t reb_period_tsc;
+static uint64_t reb_next_tsc;
+/* busy share and packets of every RX lcore over the last period */
+static uint64_t reb_prev_busy[RTE_MAX_LCORE];
+static uint64_t reb_prev_loop[RTE_MAX_LCORE];
+static double reb_busy[RTE_MAX_LCORE];
+static uint64_t reb_rx_load[RTE_MAX_LCORE];
+static struct reb_move reb_moves[FLOWBOOK_REB_MAX_MOVES];
+static uint16_t reb_nb_moves;
+static uint64_t reb_nb_rounds;
+static uint64_t reb_nb_moved;
+/* applied moves waiting for their switch */
+static int reb_switch_pending;
+static uint64_t reb_drain_tsc;
+static uint64_t reb_min_switch_tsc;
+static uint64_t reb_next_switch_tsc;
+static uint8_t reb_drain_wait[RTE_MAX_LCORE];   /**< lost buckets at the apply */
+static uint64_t reb_drain_mark[RTE_MAX_LCORE];  /**< its drained polls then */
+
+void
+flowbook_rebalance_add_queue(uint16_t portid, uint16_t queueid, uint16_t rx_id)
+{
+	struct reb_port *port = reb_ports[portid];
+	uint16_t q;
+
+	if (port == NULL) {
+		port = (struct reb_port *)rte_zmalloc("flowbook_reb",
+				sizeof(*port), RTE_CACHE_LINE_SIZE);
+		if (port == NULL)
+			return;
+		for (q = 0; q < REB_MAX_QUEUES; q++)
+			port->queue_rx[q] = REB_NO_RX;
+		reb_ports[portid] = port;
+	}
+	if (queueid < REB_MAX_QUEUES)
+		port->queue_rx[queueid] = rx_id;
+}
+
+/* Read the RETA of @portid and give its RX lcores bucket counters. */
+static int
+reb_port_start(uint16_t portid, struct reb_port *port, const int *rx_socket)
+{
+	struct rte_eth_rss_reta_entry64 conf[REB_RETA_MAX / RTE_ETH_RETA_GROUP_SIZE];
+	struct rte_eth_dev_info dev_info;
+	uint16_t b, q, r;
+
+	if (rte_eth_dev_info_get(portid, &dev_info) != 0 ||
+			dev_info.reta_size == 0 || dev_info.reta_size > REB_RETA_MAX ||
+			!rte_is_power_of_2(dev_info.reta_size)) {
+		RTE_LOG(WARNING, FLOWBOOK, "Port %u: no usable RETA, not rebalanced\n",
+			portid);
+		return -1;
+	}
+	port->reta_size = dev_info.reta_size;
+	memset(conf, 0, sizeof(conf));
+	for (b = 0; b < port->reta_size; b++)
+		conf[b / RTE_ETH_RETA_GROUP_SIZE].mask |=
+			1ULL << (b % RTE_ETH_RETA_GROUP_SIZE);
+	if (rte_eth_dev_rss_reta_query(portid, conf, port->reta_size) != 0) {
+		RTE_LOG(WARNING, FLOWBOOK, "Port %u: cannot read the RETA, not rebalanced\n",
+			portid);
+		return -1;
+	}
+	for (b = 0; b < port->reta_size; b++)
+		port->reta[b] = conf[b / RTE_ETH_RETA_GROUP_SIZE].reta[
+			b % RTE_ETH_RETA_GROUP_SIZE];
+
+	for (q = 0; q < REB_MAX_QUEUES; q++) {
+		r = port->queue_rx[q];
+		if (r == REB_NO_RX || flowbook_reb_lcores[r].buckets[portid] != NULL)
+			continue;
+		flowbook_reb_lcores[r].buckets[portid] = (uint32_t *)rte_zmalloc_socket(
+				"flowbook_reb", sizeof(uint32_t) * port->reta_size,
+				RTE_CACHE_LINE_SIZE, rx_socket[r]);
+		if (flowbook_reb_lcores[r].buckets[portid] == NULL)
+			return -1;
+	}
+	flowbook_reb_mask[portid] = port->reta_size - 1;
+	RTE_LOG(INFO, FLOWBOOK, "Port %u: rebalancing %u RETA buckets\n", portid,
+		port->reta_size);
+	return 0;
+}
+
+int
+flowbook_rebalance_start(uint32_t period_ms, uint16_t nb_rx,
+		const int *rx_socket)
+{
+	uint16_t portid, nb_ports = 0;
+
+	reb_nb_rx = nb_rx;
+	for (portid = 0; portid < RTE_MAX_ETHPORTS; portid++) {
+		if (reb_ports[portid] == NULL)
+			continue;
+		if (reb_port_start(portid, reb_ports[portid], rx_socket) != 0) {
+			rte_free(reb_ports[portid]);
+			reb_ports[portid] = NULL;
+			continue;
+		}
+		nb_ports++;
+	}
+	if (nb_ports == 0) {
+		RTE_LOG(ERR, FLOWBOOK, "No port to rebalance\n");
+		return -1;
+	}
+	reb_period_tsc = rte_get_tsc_hz() * period_ms / MS_PER_S;
+	reb_next_tsc = rte_rdtsc() + reb_period_tsc;
+	reb_min_switch_tsc = rte_get_tsc_hz() * FLOWBOOK_REB_MIN_SWITCH_MS / MS_PER_S;
+	return 0;
+}
+
+/* Busy share and packets per RX lcore and per bucket since the last sample. */
+static void
+reb_sample(void)
+{
+	struct flowbook_reb_lcore *l;
+	struct reb_port *port;
+	uint64_t busy, loop;
+	uint32_t sum;
+	uint16_t portid, b, r, owner;
+
+	for (r = 0; r < reb_nb_rx; r++) {
+		l = &flowbook_reb_lcores[r];
+		busy = l->busy_tsc - reb_prev_busy[r];
+		loop = l->loop_tsc - reb_prev_loop[r];
+		reb_prev_busy[r] = l->busy_tsc;
+		reb_prev_loop[r] = l->loop_tsc;
+		reb_busy[r] = loop > 0 ? (double)busy / loop : 0;
+		reb_rx_load[r] = 0;
+	}
+	for (portid = 0; portid < RTE_MAX_ETHPORTS; portid++) {
+		port = reb_ports[portid];
+		if (port == NULL)
+			continue;
+		for (b = 0; b < port->reta_size; b++) {
+			sum = 0;
+			for (r = 0; r < reb_nb_rx; r++)
+				if (flowbook_reb_lcores[r].buckets[portid] != NULL)
+					sum += flowbook_reb_lcores[r].buckets[portid][b];
+			port->load[b] = sum - port->prev[b];
+			port->prev[b] = sum;
+			owner = port->queue_rx[port->reta[b]];
+			if (owner != REB_NO_RX)
+				reb_rx_load[owner] += port->load[b];
+		}
+	}
+}
+
+/*
+ * Move the busiest buckets of @hot on @portid that fit into half the packet
+ * gap to the least busy RX lcore of the port. A bucket bigger than that (an
+ * elephant) stays: moving it would only move the saturation.
+ */
+static void
+reb_plan_port(uint16_t portid, uint16_t hot)
+{
+	struct reb_port *port = reb_ports[portid];
+	struct reb_move *m;
+	uint16_t q, r, b, cold = REB_NO_RX, cold_queue = 0;
+	uint64_t gap;
+	int best;
+
+	for (q = 0; q < REB_MAX_QUEUES; q++) {
+		r = port->queue_rx[q];
+		if (r == REB_NO_RX || r == hot)
+			continue;
+		if (cold == REB_NO_RX || reb_busy[r] < reb_busy[cold]) {
+			cold = r;
+			cold_queue = q;
+		}
+	}
+	if (cold == REB_NO_RX || reb_busy[cold] >= FLOWBOOK_REB_BUSY_HIGH ||
+			reb_rx_load[hot] <= reb_rx_load[cold])
+		return;
+	gap = (reb_rx_load[hot] - reb_rx_load[cold]) / 2;
+
+	while (reb_nb_moves < FLOWBOOK_REB_MAX_MOVES) {
+		best = -1;
+		for (b = 0; b < port->reta_size; b++) {
+			if (port->queue_rx[port->reta[b]] != hot ||
+					port->load[b] == 0 || port->load[b] > gap)
+				continue;
+			if (best < 0 || port->load[b] > port->load[best])
+				best = b;
+		}
+		if (best < 0)
+			break;
+		m = &reb_moves[reb_nb_moves++];
+		m->port = portid;
+		m->bucket = best;
+		m->queue = cold_queue;
+		m->from = hot;
+		m->to = cold;
+		gap -= port->load[best];
+		reb_rx_load[hot] -= port->load[best];
+		reb_rx_load[cold] += port->load[best];
+		port->load[best] = 0;   /* planned, not a candidate any more */
+	}
+}
+
+int
+flowbook_rebalance_plan(void)
+{
+	uint64_t now = rte_rdtsc();
+	uint16_t portid, r, hot = 0;
+
+	if (now < reb_next_tsc)
+		return reb_nb_moves > 0;
+	reb_next_tsc = now + reb_period_tsc;
+	reb_sample();
+	/* a plan that could not be applied within a period is stale */
+	reb_nb_moves = 0;
+	if (reb_switch_pending || now < reb_next_switch_tsc)
+		return 0;
+	for (r = 1; r < reb_nb_rx; r++)
+		if (reb_busy[r] > reb_busy[hot])
+			hot = r;
+	if (reb_nb_rx == 0 || reb_busy[hot] < FLOWBOOK_REB_BUSY_HIGH)
+		return 0;
+	for (portid = 0; portid < RTE_MAX_ETHPORTS; portid++)
+		if (reb_ports[portid] != NULL &&
+				flowbook_reb_lcores[hot].buckets[portid] != NULL)
+			reb_plan_port(portid, hot);
+	return reb_nb_moves > 0;
+}
+
+void
+flowbook_rebalance_apply(void)
+{
+	struct rte_eth_rss_reta_entry64 conf[REB_RETA_MAX / RTE_ETH_RETA_GROUP_SIZE];
+	struct reb_port *port;
+	struct reb_move *m = NULL;
+	uint16_t portid, i, nb, r;
+	int ret;
+
+	for (portid = 0; portid < RTE_MAX_ETHPORTS; portid++) {
+		port = reb_ports[portid];
+		if (port == NULL)
+			continue;
+		memset(conf, 0, sizeof(conf));
+		nb = 0;
+		for (i = 0; i < reb_nb_moves; i++) {
+			if (reb_moves[i].port != portid)
+				continue;
+			m = &reb_moves[i];
+			conf[m->bucket / RTE_ETH_RETA_GROUP_SIZE].mask |=
+				1ULL << (m->bucket % RTE_ETH_RETA_GROUP_SIZE);
+			conf[m->bucket / RTE_ETH_RETA_GROUP_SIZE].reta[
+				m->bucket % RTE_ETH_RETA_GROUP_SIZE] = m->queue;
+			nb++;
+		}
+		if (nb == 0)
+			continue;
+		ret = rte_eth_dev_rss_reta_update(portid, conf, port->reta_size);
+		if (ret != 0) {
+			RTE_LOG(ERR, FLOWBOOK, "Port %u: RETA update failed: err=%d\n",
+				portid, ret);
+			continue;
+		}
+		for (i = 0; i < reb_nb_moves; i++)
+			if (reb_moves[i].port == portid)
+				port->reta[reb_moves[i].bucket] = reb_moves[i].queue;
+		reb_nb_moved += nb;
+		for (i = 0; i < reb_nb_moves; i++) {
+			r = reb_moves[i].from;
+			if (reb_moves[i].port == portid && !reb_drain_wait[r]) {
+				reb_drain_wait[r] = 1;
+				reb_drain_mark[r] = flowbook_reb_lcores[r].drained;
+			}
+		}
+		reb_switch_pending = 1;
+		RTE_LOG(INFO, FLOWBOOK,
+			"Port %u: %u RETA buckets from rx %u (busy %.0f%%) to rx %u (%.0f%%)\n",
+			portid, nb, m->from, reb_busy[m->from] * 100, m->to,
+			reb_busy[m->to] * 100);
+	}
+	reb_nb_moves = 0;
+	reb_nb_rounds++;
+	reb_drain_tsc = rte_rdtsc() + rte_get_tsc_hz() * FLOWBOOK_REB_DRAIN_MS / MS_PER_S;
+}
+
+int
+flowbook_rebalance_switch_due(void)
+{
+	uint64_t now = rte_rdtsc();
+	uint16_t r;
+
+	if (!reb_switch_pending)
+		return 0;
+	/*
+	 * A poll that started after the RETA write and left every queue empty
+	 * took the last packets the old queues got for the moved buckets.
+	 */
+	if (now < reb_drain_tsc)
+		for (r = 0; r < reb_nb_rx; r++)
+			if (reb_drain_wait[r] &&
+					flowbook_reb_lcores[r].drained - reb_drain_mark[r] < 2)
+				return 0;
+	memset(reb_drain_wait, 0, sizeof(reb_drain_wait));
+	reb_switch_pending = 0;
+	reb_next_switch_tsc = now + reb_min_switch_tsc;
+	return 1;
+}
+
+void
+flowbook_rebalance_report(void)
+{
+	const struct flowbook_reb_lcore *l;
+	uint16_t r;
+
+	printf("\nRETA rebalancing: %" PRIu64 " rounds, %" PRIu64 " buckets moved\n",
+		reb_nb_rounds, reb_nb_moved);
+	for (r = 0; r < reb_nb_rx; r++) {
+		l = &flowbook_reb_lcores[r];
+		printf("  rx %u: busy %.1f%%\n", r, l->loop_tsc > 0 ?
+			100.0 * l->busy_tsc / l->loop_tsc : 0.0);
+	}
+}
+
+void
+flowbook_rebalance_free(void)
+{
+	uint16_t portid, r;
+
+	for (portid = 0; portid < RTE_MAX_ETHPORTS; portid++) {
+		for (r = 0; r < reb_nb_rx; r++) {
+			rte_free(flowbook_reb_lcores[r].buckets[portid]);
+			flowbook_reb_lcores[r].buckets[portid] = NULL;
+		}
+		rte_free(reb_ports[portid]);
+		reb_ports[portid] = NULL;
+	}
+}
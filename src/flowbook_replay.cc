@@ -0,0 +1,435 @@
+#include "flowbook_replay.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <rte_byteorder.h>
+#include <rte_cycles.h>
+#include <rte_lcore.h>
+#include <rte_log.h>
+#include <rte_malloc.h>
+#include <rte_mempool.h>
+
+#include "flowbook_hash.h"
+#include "flowbook_parse.h"
+
+#define RTE_LOGTYPE_FLOWBOOK RTE_LOGTYPE_USER1
+
+#define PCAP_MAGIC_US           0xa1b2c3d4
+#define PCAP_MAGIC_NS           0xa1b23c4d
+#define PCAP_LINKTYPE_ETHERNET  1
+/* larger records mean a corrupt file rather than a jumbo frame */
+#define PCAP_MAX_RECORD         (256 * 1024)
+/* mbufs of the parse pass, one is in use at a time */
+#define REPLAY_STAGING_MBUFS    64
+
+struct pcap_file_hdr {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t  thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t network;
+};
+
+struct pcap_rec_hdr {
+	uint32_t ts_sec;
+	uint32_t ts_frac;       /**< us or ns, see the magic */
+	uint32_t incl_len;
+	uint32_t orig_len;
+};
+
+struct pcap_reader {
+	FILE *f;
+	int swapped;            /**< written on a host of the other endianness */
+	int nsec;
+};
+
+struct flowbook_replay_queue {
+	struct rte_mempool *pool;
+	struct rte_mbuf **pkts;         /**< in capture order */
+	uint64_t *ts;                   /**< ns after the first packet, TSC after start */
+	uint32_t nb_pkts;
+	uint32_t next;                  /**< next packet to deliver */
+	uint32_t due;                   /**< packets of this loop whose time has come */
+	uint32_t loop;
+	uint64_t base_tsc;              /**< TSC of the current loop, 0: not started */
+	unsigned lcore_id;
+	int done;
+	uint64_t nb_rx;
+	uint64_t nb_drop;
+	uint64_t first_tsc;
+	uint64_t last_tsc;
+} __rte_cache_aligned;
+
+static struct flowbook_replay_queue *replay_queues;
+static uint16_t replay_nb_queues;
+static uint32_t replay_loops;
+static double replay_speed;
+static uint32_t replay_ring_size;
+static uint64_t replay_span_ns;     /**< one loop of the trace */
+static uint64_t replay_period_tsc;
+static uint32_t replay_nb_done;
+
+static int
+pcap_open(struct pcap_reader *pr, const char *path)
+{
+	struct pcap_file_hdr hdr;
+
+	pr->f = fopen(path, "rb");
+	if (pr->f == NULL) {
+		RTE_LOG(ERR, FLOWBOOK, "Cannot open %s\n", path);
+		return -1;
+	}
+	if (fread(&hdr, sizeof(hdr), 1, pr->f) != 1)
+		goto bad;
+	pr->swapped = 0;
+	switch (hdr.magic) {
+	case PCAP_MAGIC_US:
+	case PCAP_MAGIC_NS:
+		break;
+	case RTE_STATIC_BSWAP32(PCAP_MAGIC_US):
+	case RTE_STATIC_BSWAP32(PCAP_MAGIC_NS):
+		pr->swapped = 1;
+		hdr.magic = rte_bswap32(hdr.magic);
+		hdr.network = rte_bswap32(hdr.network);
+		break;
+	default:
+		/* pcapng included: convert it with `editcap -F pcap` */
+		goto bad;
+	}
+	pr->nsec = (hdr.magic == PCAP_MAGIC_NS);
+	if ((hdr.network & 0xffff) != PCAP_LINKTYPE_ETHERNET) {
+		RTE_LOG(ERR, FLOWBOOK, "%s: link type %u is not Ethernet\n",
+			path, hdr.network & 0xffff);
+		fclose(pr->f);
+		return -1;
+	}
+	return 0;
+bad:
+	RTE_LOG(ERR, FLOWBOOK, "%s is not a pcap file\n", path);
+	fclose(pr->f);
+	return -1;
+}
+
+/* Header of the next record and its time in ns. Returns 0, 1 at the end, -1 on error. */
+static int
+pcap_next(struct pcap_reader *pr, struct pcap_rec_hdr *rec, uint64_t *ts_ns)
+{
+	size_t n = fread(rec, 1, sizeof(*rec), pr->f);
+
+	if (n == 0)
+		return 1;
+	if (n != sizeof(*rec))
+		return -1;
+	if (pr->swapped) {
+		rec->ts_sec = rte_bswap32(rec->ts_sec);
+		rec->ts_frac = rte_bswap32(rec->ts_frac);
+		rec->incl_len = rte_bswap32(rec->incl_len);
+		rec->orig_len = rte_bswap32(rec->orig_len);
+	}
+	if (rec->incl_len > PCAP_MAX_RECORD)
+		return -1;
+	*ts_ns = (uint64_t)rec->ts_sec * NS_PER_S +
+		(pr->nsec ? rec->ts_frac : (uint64_t)rec->ts_frac * 1000);
+	return 0;
+}
+
+/*
+ * Copy the packet of @rec into @m, truncated to its data room, and skip
+ * the rest of the record. Returns 0 on success.
+ */
+static int
+pcap_read_pkt(struct pcap_reader *pr, const struct pcap_rec_hdr *rec,
+		struct rte_mbuf *m)
+{
+	uint32_t len = RTE_MIN(rec->incl_len, (uint32_t)rte_pktmbuf_tailroom(m));
+	char *data = rte_pktmbuf_append(m, len);
+
+	if (data == NULL || fread(data, 1, len, pr->f) != len)
+		return -1;
+	if (len < rec->incl_len &&
+			fseek(pr->f, rec->incl_len - len, SEEK_CUR) != 0)
+		return -1;
+	return 0;
+}
+
+/* Replay queue of a packet: its flow hash, so a flow stays on one lcore. */
+static uint16_t
+replay_queue_of(struct rte_mbuf *m, struct flowbook_burst *burst)
+{
+	uint32_t hash;
+
+	flowbook_parse_burst(&m, 1, 0, 0, 0, 0, 0, 1, burst);
+	if (burst->v4.n > 0)
+		hash = burst->v4.hashes[0];
+	else if (burst->v6.n > 0)
+		hash = burst->v6.hashes[0];
+	else if (burst->vlan.n > 0)
+		hash = burst->vlan.hashes[0];
+	else
+		return 0;	/* switch reports and packets without a flow */
+	return flow_hash_owner(hash, replay_nb_queues);
+}
+
+int
+flowbook_replay_load(const char *path, uint16_t nb_queues,
+		const int *queue_socket)
+{
+	static struct flowbook_burst burst;
+	struct flowbook_replay_queue *rq;
+	struct rte_mempool *staging = NULL;
+	struct pcap_reader pr;
+	struct pcap_rec_hdr rec;
+	struct rte_mbuf *m;
+	char name[RTE_MEMPOOL_NAMESIZE];
+	uint64_t *ts = NULL, ts_ns, first_ns = 0, prev_ns = 0;
+	uint16_t *queue_of = NULL, q;
+	uint32_t nb_pkts = 0, max_len = 0, i;
+	uint16_t data_room;
+	int ret = -1;
+
+	if (nb_queues == 0 || pcap_open(&pr, path) != 0)
+		return -1;
+	replay_nb_queues = nb_queues;
+
+	/* pass 1: size of the trace */
+	while ((ret = pcap_next(&pr, &rec, &ts_ns)) == 0) {
+		max_len = RTE_MAX(max_len, rec.incl_len);
+		nb_pkts++;
+		if (fseek(pr.f, rec.incl_len, SEEK_CUR) != 0)
+			break;
+	}
+	if (ret != 1 || nb_pkts == 0) {
+		RTE_LOG(ERR, FLOWBOOK, "%s: truncated or empty capture\n", path);
+		ret = -1;
+		goto out;
+	}
+	ret = -1;
+	data_room = RTE_PKTMBUF_HEADROOM +
+		RTE_MIN(max_len, (uint32_t)FLOWBOOK_REPLAY_MAX_PKT_LEN);
+
+	ts = (uint64_t *)malloc(sizeof(*ts) * nb_pkts);
+	queue_of = (uint16_t *)malloc(sizeof(*queue_of) * nb_pkts);
+	replay_queues = (struct flowbook_replay_queue *)rte_zmalloc("flowbook_replay",
+			sizeof(*replay_queues) * nb_queues, RTE_CACHE_LINE_SIZE);
+	staging = rte_pktmbuf_pool_create("flowbook_replay_stg",
+			REPLAY_STAGING_MBUFS, 0, 0, data_room, rte_socket_id());
+	if (ts == NULL || queue_of == NULL || replay_queues == NULL ||
+			staging == NULL) {
+		RTE_LOG(ERR, FLOWBOOK, "Cannot allocate the replay of %u packets\n",
+			nb_pkts);
+		goto out;
+	}
+
+	/* pass 2: time and queue of every packet */
+	fseek(pr.f, sizeof(struct pcap_file_hdr), SEEK_SET);
+	m = rte_pktmbuf_alloc(staging);
+	for (i = 0; i < nb_pkts; i++) {
+		if (m == NULL || pcap_next(&pr, &rec, &ts_ns) != 0 ||
+				pcap_read_pkt(&pr, &rec, m) != 0)
+			goto read_error;
+		if (i == 0)
+			first_ns = ts_ns;
+		/* captures are not always sorted, never go back in time */
+		ts[i] = prev_ns = RTE_MAX(ts_ns - RTE_MIN(ts_ns, first_ns), prev_ns);
+		queue_of[i] = q = replay_queue_of(m, &burst);
+		replay_queues[q].nb_pkts++;
+		rte_pktmbuf_reset(m);
+	}
+	rte_pktmbuf_free(m);
+	/* the last packet takes one average gap before the next loop starts */
+	replay_span_ns = prev_ns + (nb_pkts > 1 ? prev_ns / (nb_pkts - 1) : 0);
+
+	for (q = 0; q < nb_queues; q++) {
+		rq = &replay_queues[q];
+		if (rq->nb_pkts == 0)
+			continue;
+		snprintf(name, sizeof(name), "flowbook_replay_%u", q);
+		rq->pool = rte_pktmbuf_pool_create(name, rq->nb_pkts, 0, 0,
+				data_room, queue_socket[q]);
+		rq->pkts = (struct rte_mbuf **)rte_malloc_socket("flowbook_replay",
+				sizeof(*rq->pkts) * rq->nb_pkts, RTE_CACHE_LINE_SIZE,
+				queue_socket[q]);
+		rq->ts = (uint64_t *)rte_malloc_socket("flowbook_replay",
+				sizeof(*rq->ts) * rq->nb_pkts, RTE_CACHE_LINE_SIZE,
+				queue_socket[q]);
+		if (rq->pool == NULL || rq->pkts == NULL || rq->ts == NULL) {
+			RTE_LOG(ERR, FLOWBOOK,
+				"Cannot allocate %u replay mbufs on socket %d\n",
+				rq->nb_pkts, queue_socket[q]);
+			goto out;
+		}
+		/* refilled by pass 3 */
+		rq->nb_pkts = 0;
+	}
+
+	/* pass 3: packets into the mbufs of their queue */
+	fseek(pr.f, sizeof(struct pcap_file_hdr), SEEK_SET);
+	for (i = 0; i < nb_pkts; i++) {
+		rq = &replay_queues[queue_of[i]];
+		m = rte_pktmbuf_alloc(rq->pool);
+		if (m == NULL || pcap_next(&pr, &rec, &ts_ns) != 0 ||
+				pcap_read_pkt(&pr, &rec, m) != 0)
+			goto read_error;
+		rq->pkts[rq->nb_pkts] = m;
+		rq->ts[rq->nb_pkts++] = ts[i];
+	}
+
+	RTE_LOG(INFO, FLOWBOOK, "replay: %u packets over %.3f s from %s\n",
+		nb_pkts, (double)replay_span_ns / NS_PER_S, path);
+	for (q = 0; q < nb_queues; q++)
+		RTE_LOG(INFO, FLOWBOOK, " -- queue %u: %u packets\n", q,
+			replay_queues[q].nb_pkts);
+	ret = 0;
+	goto out;
+
+read_error:
+	rte_pktmbuf_free(m);
+	RTE_LOG(ERR, FLOWBOOK, "%s: read error at packet %u\n", path, i);
+out:
+	rte_mempool_free(staging);
+	free(queue_of);
+	free(ts);
+	fclose(pr.f);
+	return ret;
+}
+
+void
+flowbook_replay_start(uint32_t loops, double speed, uint32_t ring_size)
+{
+	struct flowbook_replay_queue *rq;
+	uint64_t hz = rte_get_tsc_hz();
+	uint16_t q;
+	uint32_t i;
+
+	replay_loops = loops;
+	replay_speed = speed;
+	replay_ring_size = RTE_MAX(ring_size, 1u);
+	if (speed > 0)
+		replay_period_tsc = (uint64_t)((double)replay_span_ns * hz /
+				NS_PER_S / speed);
+	for (q = 0; q < replay_nb_queues; q++) {
+		rq = &replay_queues[q];
+		if (speed > 0)
+			for (i = 0; i < rq->nb_pkts; i++)
+				rq->ts[i] = (uint64_t)((double)rq->ts[i] * hz /
+						NS_PER_S / speed);
+		if (rq->nb_pkts == 0) {
+			rq->done = 1;
+			replay_nb_done++;
+		}
+	}
+}
+
+uint16_t
+flowbook_replay_rx(uint16_t q, struct rte_mbuf **pkts, uint16_t nb_pkts)
+{
+	struct flowbook_replay_queue *rq = &replay_queues[q];
+	uint64_t now;
+	uint32_t n;
+
+	if (unlikely(rq->done))
+		return 0;
+	now = rte_rdtsc();
+	if (unlikely(rq->base_tsc == 0)) {
+		/* the clock of a queue starts with its first poll */
+		rq->base_tsc = now;
+		rq->lcore_id = rte_lcore_id();
+	}
+
+	if (replay_speed > 0) {
+		while (rq->due < rq->nb_pkts &&
+				rq->base_tsc + rq->ts[rq->due] <= now)
+			rq->due++;
+		/* the ring overflowed while we were busy */
+		if (rq->due - rq->next > replay_ring_size) {
+			n = rq->due - rq->next - replay_ring_size;
+			rq->nb_drop += n;
+			rq->next += n;
+		}
+		n = RTE_MIN((uint32_t)nb_pkts, rq->due - rq->next);
+	} else {
+		n = RTE_MIN((uint32_t)nb_pkts, rq->nb_pkts - rq->next);
+	}
+
+	if (n > 0) {
+		memcpy(pkts, &rq->pkts[rq->next], sizeof(*pkts) * n);
+		rq->next += n;
+		rq->nb_rx += n;
+		if (unlikely(rq->first_tsc == 0))
+			rq->first_tsc = now;
+		rq->last_tsc = now;
+	}
+
+	if (rq->next == rq->nb_pkts) {
+		if (replay_loops != 0 && ++rq->loop == replay_loops) {
+			rq->done = 1;
+			__atomic_add_fetch(&replay_nb_done, 1, __ATOMIC_RELEASE);
+		} else {
+			rq->next = rq->due = 0;
+			rq->base_tsc += replay_period_tsc;
+		}
+	}
+	return n;
+}
+
+int
+flowbook_replay_finished(void)
+{
+	return __atomic_load_n(&replay_nb_done, __ATOMIC_ACQUIRE) ==
+		replay_nb_queues;
+}
+
+void
+flowbook_replay_report(void)
+{
+	struct flowbook_replay_queue *rq;
+	double hz = rte_get_tsc_hz(), secs, max_secs = 0;
+	uint64_t tot_rx = 0, tot_drop = 0;
+	uint16_t q;
+
+	printf("\nReplay statistics (%s):\n", replay_speed > 0 ?
+		"paced" : "unpaced");
+	for (q = 0; q < replay_nb_queues; q++) {
+		rq = &replay_queues[q];
+		if (rq->nb_rx == 0) {
+			printf("  queue %u: no packets\n", q);
+			continue;
+		}
+		secs = (rq->last_tsc - rq->first_tsc) / hz;
+		printf("  lcore %u (queue %u): %" PRIu64 " pkts, %" PRIu64
+			" dropped, %u loops, %.3f Mpps over %.3f s\n",
+			rq->lcore_id, q, rq->nb_rx, rq->nb_drop, rq->loop,
+			secs > 0 ? rq->nb_rx / secs / 1e6 : 0.0, secs);
+		tot_rx += rq->nb_rx;
+		tot_drop += rq->nb_drop;
+		max_secs = RTE_MAX(max_secs, secs);
+	}
+	printf("  total: %" PRIu64 " pkts, %" PRIu64 " dropped, %.3f Mpps\n",
+		tot_rx, tot_drop, max_secs > 0 ? tot_rx / max_secs / 1e6 : 0.0);
+}
+
+void
+flowbook_replay_free(void)
+{
+	struct flowbook_replay_queue *rq;
+	uint16_t q;
+
+	if (replay_queues == NULL)
+		return;
+	for (q = 0; q < replay_nb_queues; q++) {
+		rq = &replay_queues[q];
+		if (rq->pkts != NULL)
+			rte_pktmbuf_free_bulk(rq->pkts, rq->nb_pkts);
+		rte_mempool_free(rq->pool);
+		rte_free(rq->pkts);
+		rte_free(rq->ts);
+	}
+	rte_free(replay_queues);
+	replay_queues = NULL;
+	replay_nb_done = 0;
+}
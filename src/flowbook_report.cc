@@ -0,0 +1,102 @@
+#include "flowbook_report.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <rte_lcore.h>
+
+#include "flowbook_time.h"
+
+flowbook_report_pool::flowbook_report_pool()
+    : m_kicks(0), m_quit(false), m_nb_workers(0)
+{
+    for(size_t i=0; i<NUMBER_OF_REPORTING_THREAD; ++i){
+        // The started threads get the ids 0..m_nb_workers-1, a failed slot is reused.
+        worker* w = &m_workers[m_nb_workers];
+        char name[16];
+        w->pool = this;
+        w->id = m_nb_workers;
+        w->busy = nullptr;
+        snprintf(name, sizeof(name), "flowbook-rep-%zu", w->id);
+        // A control thread: pinned to the cpus the EAL left to the control plane.
+        if (rte_ctrl_thread_create(&w->tid, name, nullptr, thread_main, w) == 0)
+            m_nb_workers++;
+        else
+            std::cerr << "Error: cannot start reporting thread " << i << std::endl;
+    }
+    if (m_nb_workers == 0) {
+        std::cerr << "Error: no reporting thread, the tables could never be exported" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+flowbook_report_pool::~flowbook_report_pool()
+{
+    {
+        std::lock_guard<std::mutex> lk(m_lock);
+        m_quit = true;
+    }
+    m_cv.notify_all();
+    for(size_t i=0; i<m_nb_workers; ++i)
+        pthread_join(m_workers[i].tid, nullptr);
+}
+
+void flowbook_report_pool::attach(flowbook_report_client* client)
+{
+    std::lock_guard<std::mutex> lk(m_lock);
+    m_clients.push_back(client);
+}
+
+void flowbook_report_pool::detach(flowbook_report_client* client)
+{
+    std::unique_lock<std::mutex> lk(m_lock);
+    m_clients.erase(std::remove(m_clients.begin(), m_clients.end(), client), m_clients.end());
+    m_idle_cv.wait(lk, [&]{
+        for(size_t i=0; i<m_nb_workers; ++i)
+            if (m_workers[i].busy == client)
+                return false;
+        return true;
+    });
+}
+
+void flowbook_report_pool::kick()
+{
+    {
+        std::lock_guard<std::mutex> lk(m_lock);
+        m_kicks++;
+    }
+    m_cv.notify_all();
+}
+
+void* flowbook_report_pool::thread_main(void* arg)
+{
+    worker* w = static_cast<worker*>(arg);
+    w->pool->run(w);
+    return nullptr;
+}
+
+void flowbook_report_pool::run(worker* w)
+{
+    uint64_t seen_kicks = 0;
+    std::unique_lock<std::mutex> lk(m_lock);
+    while (!m_quit) {
+        // Wake up now and then to export the expired flows.
+        m_cv.wait_for(lk, std::chrono::milliseconds(FLOWBOOK_CHECK_PERIOD_MS),
+                      [&]{ return m_quit || m_kicks != seen_kicks; });
+        if (m_quit)
+            break;
+        seen_kicks = m_kicks;
+        // Clients may detach meanwhile, the index is rechecked under the lock.
+        for(size_t i=0; i<m_clients.size() && !m_quit; ++i){
+            flowbook_report_client* client = m_clients[i];
+            w->busy = client;
+            lk.unlock();
+            client->report_work(w->id);
+            lk.lock();
+            w->busy = nullptr;
+            m_idle_cv.notify_all();
+        }
+    }
+}
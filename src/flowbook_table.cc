@@ -2,107 +2,284 @@
 #define _FLOWTOOK_TABLE_H_
 
 #include "flowbook_table.h"
+#include <iostream>
+#include <type_traits>
+#include <vector>
+#include <rte_malloc.h>
 
-flowbook_table::flowbook_table(size_t table_size){
-    for(size_t i=0; i<NUMBER_OF_PARALLEL_TABLE; ++i)
+template <typename Key>
+flowbook_table<Key>::flowbook_table(size_t table_size, size_t shard_num, uint32_t report_period,
+                                    const int* shard_sockets, flowbook_report_pool* pool){
+    m_shard_num = shard_num > 0 ? shard_num : 1;
+    m_shards = new flowbook_shard<Key>[m_shard_num];
+    for(size_t i=0; i<m_shard_num; ++i)
     {
-        m_table_group_a[i].reserve(table_size / NUMBER_OF_PARALLEL_TABLE);
-        m_table_group_b[i].reserve(table_size / NUMBER_OF_PARALLEL_TABLE);
+        m_shards[i].m_socket = shard_sockets != nullptr ? shard_sockets[i] : SOCKET_ID_ANY;
+        m_shards[i].m_table_a.reserve(table_size / m_shard_num, m_shards[i].m_socket);
+        m_shards[i].m_table_b.reserve(table_size / m_shard_num, m_shards[i].m_socket);
     }
     // The thread is safe here.
     std::atomic_init(&m_table_flag, true); // true: w a r b, flase: w b r a.
+    size_t qsv_size = rte_rcu_qsbr_get_memsize(m_shard_num);
+    m_qsv = (struct rte_rcu_qsbr*)rte_zmalloc("flowbook_qsbr", qsv_size, RTE_CACHE_LINE_SIZE);
+    if (m_qsv == nullptr || rte_rcu_qsbr_init(m_qsv, m_shard_num) != 0){
+        std::cerr << "Error: cannot init the table epoch QSBR variable" << std::endl;
+        exit(EXIT_FAILURE);
+    }
     std::atomic_init(&m_total_pkt,  0);
+    std::atomic_init(&m_nb_export_lost, (uint64_t)0);
     m_last_report_time = std::chrono::high_resolution_clock::now();
+    m_report_period = report_period;
+    m_switch_requested = false;
+    std::atomic_init(&m_aging, false);
+    m_idle_wids = 0;
+    m_active_wids = 0;
+    m_admission = false;
+    m_admit_pkts = 0;
+    m_admit_bytes = 0;
 
     #ifdef ENABLE_DB
-    // Init database connection.
-    try{
-        for(size_t i=0; i<NUMBER_OF_PARALLEL_TABLE; ++i){
-            m_db_connpool[i] = new pqxx::connection("dbname = dcbook_hw_test user = postgres password = postgres  \
-                                            hostaddr = 127.0.0.1 port = 5432");
-            if(m_db_connpool[i]->is_open()){
-                std::cout <<"THREAD ID: "<< i<< ", opened database " << m_db_connpool[i]->dbname() << " successfully!"<< std::endl;
-            }else{
-                std::cerr <<"THREAD ID: "<< i<< ", opened database " << m_db_connpool[i]->dbname() << " failed !"<< std::endl; 
-            }
+    // One database session per reporting thread, on the tables of our key family.
+    for(size_t i=0; i<NUMBER_OF_REPORTING_THREAD; ++i){
+        m_exporters[i] = new flowbook_exporter(flowbook_schema_of<Key>());
+        if(m_exporters[i]->is_open()){
+            std::cout <<"THREAD ID: "<< i<< ", opened database successfully!"<< std::endl;
+        }else{
+            std::cerr <<"THREAD ID: "<< i<< ", opened database failed !"<< std::endl;
         }
     }
-    catch (std::exception const &e){
-        std::cerr << "Error: " << e.what() << std::endl;
-        exit(0);
-    }
     #endif
+
+    // Join the reporting threads, they get a turn whenever an epoch is retired.
+    m_report_seq = 0;
+    m_report_pending = 0;
+    m_report_stamp = 0;
+    std::atomic_init(&m_report_next_shard, (size_t)0);
+    for(size_t i=0; i<NUMBER_OF_REPORTING_THREAD; ++i){
+        m_seen_seq[i] = 0;
+    }
+    m_own_pool = (pool == nullptr);
+    m_pool = m_own_pool ? new flowbook_report_pool() : pool;
+    m_pool->attach(this);
 }
 
 
 /**
  * # THREAD SAFE # 
- * Multiple thread can concurrently call this function.
+ * Each lcore must pass its own shard id.
+*/
+template <typename Key>
+void flowbook_table<Key>::upsert(size_t shard_id, const Key& key, const flow_attr& attr){  
+    FlowTable* write_table = get_curr_write_table(shard_id);    
+    upsert_hashed(shard_id, write_table, key, key.hash(), attr);
+}
+
+/**
+ * # THREAD SAFE # 
+ * Three passes over the burst: hash + prefetch bucket, prefetch the tag
+ * matched entry, then compare and update.
 */
-void flowbook_table::upsert(flow_key key, flow_attr attr){  
-    FlowTable* write_table = get_curr_write_table(key);    
-    // Assuming write_table is a std::unordered_map with the same key type as 'key' and value type as 'flow_attr'
-    auto it = write_table->find(key);
-
-    if (it == write_table->end()) {
-        // Key does not exist, insert new element
-        write_table->insert({key, attr});
+template <typename Key>
+void flowbook_table<Key>::upsert_bulk(size_t shard_id, const Key* keys, const flow_attr* attrs, uint32_t n){
+    uint32_t hashes[FLOWBOOK_MAX_BULK];
+
+    while (n > 0) {
+        uint32_t nb = RTE_MIN(n, (uint32_t)FLOWBOOK_MAX_BULK);
+        for (uint32_t i = 0; i < nb; ++i)
+            hashes[i] = keys[i].hash();
+        upsert_bulk(shard_id, keys, hashes, attrs, nb);
+        keys  += nb;
+        attrs += nb;
+        n     -= nb;
+    }
+}
+
+template <typename Key>
+void flowbook_table<Key>::upsert_bulk(size_t shard_id, const Key* keys, const uint32_t* hashes,
+                                 const flow_attr* attrs, uint32_t n){
+    FlowTable* write_table = get_curr_write_table(shard_id);
+    flow_admission_sketch* sketch = m_admission ? sketch_of(shard_id, write_table) : nullptr;
+
+    while (n > 0) {
+        uint32_t nb = RTE_MIN(n, (uint32_t)FLOWBOOK_MAX_BULK);
+        for (uint32_t i = 0; i < nb; ++i)
+            write_table->prefetch_bucket(hashes[i]);
+        for (uint32_t i = 0; i < nb; ++i)
+            write_table->prefetch_entry(hashes[i]);
+        if (sketch != nullptr) {
+            // Needed on every miss, which is the common case of mice.
+            for (uint32_t i = 0; i < nb; ++i)
+                sketch->prefetch(hashes[i]);
+        }
+        for (uint32_t i = 0; i < nb; ++i)
+            upsert_hashed(shard_id, write_table, keys[i], hashes[i], attrs[i]);
+        keys   += nb;
+        hashes += nb;
+        attrs  += nb;
+        n      -= nb;
+    }
+}
+
+template <typename Key>
+void flowbook_table<Key>::upsert_hashed(size_t shard_id, FlowTable* write_table, const Key& key,
+                                   uint32_t hash, const flow_attr& attr){
+    flow_attr* in_mem = write_table->find(key, hash);
+
+    if (in_mem == nullptr) {
+        // Key does not exist, insert new element once it is no mouse
+        if (m_admission &&
+            !sketch_of(shard_id, write_table)->admit(hash, attr._packet_tot, attr._byte_tot,
+                                                     m_admit_pkts, m_admit_bytes))
+            return;
+        in_mem = write_table->insert(key, hash);
+        if (unlikely(in_mem == nullptr)) {
+            m_shards[shard_id].m_nb_drop++;
+            return;
+        }
+        *in_mem = attr;
+        if (m_aging.load(std::memory_order_relaxed)) {
+            // First guess of the deadline, checked again when it fires.
+            uint32_t wait = flow_deadline(attr) - attr._max_wid;
+            wheel_of(shard_id, write_table)->schedule_in(write_table->slot_of(in_mem), hash,
+                                                         wait >> FLOWBOOK_WHEEL_TICK_SHIFT);
+        }
     } else {
-        // Key exists, update the element
-        flow_attr& in_mem_attr = it->second;
-        in_mem_attr._byte_max = std::max(in_mem_attr._byte_max, attr._byte_max);
-        in_mem_attr._packet_max = std::max(in_mem_attr._packet_max, attr._packet_max);
-        in_mem_attr._byte_tot += attr._byte_tot;
-        in_mem_attr._packet_tot += attr._packet_tot;
-        in_mem_attr._max_wid = attr._max_wid;
-        // Handle any other attributes that need to be updated
+        // Key exists, account the record to its window(s)
+        in_mem->merge(attr);
     }
 }
 
+template <typename Key>
+void flowbook_table<Key>::set_aging(uint32_t idle_wids, uint32_t active_wids){
+    if (idle_wids == 0 && active_wids == 0)
+        return;
+    for(size_t i=0; i<m_shard_num; ++i){
+        flowbook_shard<Key>& shard = m_shards[i];
+        char name[RTE_RING_NAMESIZE];
+        shard.m_wheel_a.reserve(shard.m_table_a.capacity(), shard.m_socket);
+        shard.m_wheel_b.reserve(shard.m_table_b.capacity(), shard.m_socket);
+        snprintf(name, sizeof(name), "%s_exp_%zu", Key::LOG_PREFIX, i);
+        shard.m_expired = rte_ring_create_elem(name, sizeof(flow_record<Key>), FLOWBOOK_EXPIRE_RING_SIZE,
+                                               shard.m_socket, RING_F_SP_ENQ | RING_F_SC_DEQ);
+        if (shard.m_expired == nullptr){
+            std::cerr << "Error: cannot create the expired flow ring of shard " << i << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    m_idle_wids = idle_wids;
+    m_active_wids = active_wids;
+    // The reporting threads already run: they see the rings and wheels once
+    // they see m_aging. The RX lcores are launched after us.
+    m_aging.store(true, std::memory_order_release);
+}
+
+template <typename Key>
+void flowbook_table<Key>::set_admission(uint32_t pkt_thresh, uint32_t byte_thresh, size_t sketch_width){
+    if (pkt_thresh <= 1 && byte_thresh == 0)
+        return;     // every flow would be admitted with its first packet
+    for(size_t i=0; i<m_shard_num; ++i){
+        m_shards[i].m_sketch_a.reserve(sketch_width, m_shards[i].m_socket);
+        m_shards[i].m_sketch_b.reserve(sketch_width, m_shards[i].m_socket);
+    }
+    m_admit_pkts = pkt_thresh;
+    m_admit_bytes = byte_thresh;
+    m_admission = true;
+}
+
+template <typename Key>
+uint32_t flowbook_table<Key>::flow_deadline(const flow_attr& attr) const{
+    // Window ids wrap around, compare them as distances.
+    uint32_t deadline = attr._max_wid + (m_idle_wids > 0 ? m_idle_wids : (uint32_t)INT32_MAX);
+    if (m_active_wids > 0) {
+        uint32_t active_end = attr._start_wid + m_active_wids;
+        if ((int32_t)(active_end - deadline) < 0)
+            deadline = active_end;
+    }
+    return deadline;
+}
+
 /**
- * Get current active table instance according to the flow key.
+ * # THREAD SAFE # (shard owner only)
+ * Fire the due timers of the write table. A flow that saw packets since
+ * its timer was set is only rescheduled; a timed out flow is handed to the
+ * reporting threads and removed. If they fall behind, the flow stays and
+ * is retried on the next tick.
 */
-FlowTable* flowbook_table::get_curr_read_table(const flow_key& key){
-    // true: w a r b, flase: w b r a.
-    FlowTable* active_table_group = m_table_flag.load() == true? m_table_group_b : m_table_group_a;
-    size_t idx = key.hash() % NUMBER_OF_PARALLEL_TABLE;
-    return active_table_group + idx;
+template <typename Key>
+void flowbook_table<Key>::age_shard(size_t shard_id, uint64_t now_wid){
+    FlowTable* table = get_curr_write_table(shard_id);
+    flow_timer_wheel* wheel = wheel_of(shard_id, table);
+    flowbook_shard<Key>& shard = m_shards[shard_id];
+    uint64_t tick = now_wid >> FLOWBOOK_WHEEL_TICK_SHIFT;
+    uint32_t now = (uint32_t)now_wid;
+
+    if (tick <= wheel->now())
+        return;
+    wheel->advance(tick, [&](uint32_t slot, uint32_t hash){
+        typename FlowTable::entry* e = table->entry_at(slot);
+        int32_t left = (int32_t)(flow_deadline(e->attr) - now);
+        if (left > 0) {
+            wheel->schedule_in(slot, hash, ((uint32_t)left >> FLOWBOOK_WHEEL_TICK_SHIFT) + 1);
+            return;
+        }
+        flow_record<Key> rec = {e->key, e->attr};
+        if (rte_ring_sp_enqueue_elem(shard.m_expired, &rec, sizeof(rec)) != 0) {
+            wheel->schedule_in(slot, hash, 1);
+            return;
+        }
+        table->erase(slot, hash);
+        shard.m_nb_expired++;
+    });
 }
-FlowTable* flowbook_table::get_curr_read_table(size_t table_id){
-    if(table_id >= NUMBER_OF_PARALLEL_TABLE)
-        return nullptr;
-    // true: w a r b, flase: w b r a.
-    FlowTable* active_table_group = m_table_flag.load() == true? m_table_group_b : m_table_group_a;
-    return active_table_group + table_id;
+
+template <typename Key>
+void flowbook_table<Key>::register_writer(size_t shard_id){
+    rte_rcu_qsbr_thread_register(m_qsv, shard_id);
+    rte_rcu_qsbr_thread_online(m_qsv, shard_id);
 }
-FlowTable* flowbook_table::get_curr_write_table(const flow_key& key){
+
+template <typename Key>
+void flowbook_table<Key>::unregister_writer(size_t shard_id){
+    rte_rcu_qsbr_thread_offline(m_qsv, shard_id);
+    rte_rcu_qsbr_thread_unregister(m_qsv, shard_id);
+}
+
+/**
+ * Get current active table instance of a shard.
+*/
+template <typename Key>
+typename flowbook_table<Key>::FlowTable* flowbook_table<Key>::get_curr_read_table(size_t shard_id){
+    if(shard_id >= m_shard_num)
+        return nullptr;
     // true: w a r b, flase: w b r a.
-    FlowTable* active_table_group = m_table_flag.load() == true? m_table_group_a : m_table_group_b;
-    size_t idx = key.hash() % NUMBER_OF_PARALLEL_TABLE;
-    // printf("hash %lu, idx %lu\n", key.hash(), idx);
-    return active_table_group + idx;
+    flowbook_shard<Key>& shard = m_shards[shard_id];
+    return m_table_flag.load(std::memory_order_acquire) == true? &shard.m_table_b : &shard.m_table_a;
 }
-FlowTable* flowbook_table::get_curr_write_table(size_t table_id){
-    if(table_id >= NUMBER_OF_PARALLEL_TABLE)
+template <typename Key>
+typename flowbook_table<Key>::FlowTable* flowbook_table<Key>::get_curr_write_table(size_t shard_id){
+    if(shard_id >= m_shard_num)
         return nullptr;
     // true: w a r b, flase: w b r a.
-    FlowTable* active_table_group = m_table_flag.load() == true? m_table_group_a : m_table_group_b;
-    return active_table_group + table_id;
+    flowbook_shard<Key>& shard = m_shards[shard_id];
+    return m_table_flag.load(std::memory_order_acquire) == true? &shard.m_table_a : &shard.m_table_b;
 }
 
 
-#ifdef ENABLE_DB
-void flowbook_table::check_and_report(){
+template <typename Key>
+void flowbook_table<Key>::check_and_report(){
 
     bool need_report_flag = false;
 
     // Check time and table status.
     uint32_t diff_time = std::chrono::duration_cast<std::chrono::seconds>(
         std::chrono::high_resolution_clock::now() - m_last_report_time).count();
-    if(diff_time >= TABLE_SWITCH_COND_TIMER){
+    if(m_report_period > 0 && diff_time >= m_report_period){
         need_report_flag = true;
     }
-    for(size_t i=0; i<NUMBER_OF_PARALLEL_TABLE; ++i)
+    if(m_switch_requested){
+        need_report_flag = true;
+    }
+    for(size_t i=0; i<m_shard_num; ++i)
     {
         if (need_report_flag == true)
             break;
@@ -113,129 +290,220 @@ void flowbook_table::check_and_report(){
             need_report_flag = true;
         }
     }
+    if( need_report_flag && is_reporting() )
+    {
+        // The reporting threads still own the other side: keep writing.
+        need_report_flag = false;
+    }
     if( need_report_flag )
     {
-        /* Switch table with CAS. */ 
-        bool old_value = m_table_flag.load();
-        while (!m_table_flag.compare_exchange_weak(old_value, !old_value)) {}
+        /* Switch all shards at once: this is the epoch boundary. */ 
+        m_table_flag.store(!m_table_flag.load(std::memory_order_relaxed), std::memory_order_release);
+        /* Wait until every writer went through a quiescent state, i.e. finished
+         * the burst it may have started on the old tables. */
+        uint64_t token = rte_rcu_qsbr_start(m_qsv);
+        rte_rcu_qsbr_check(m_qsv, token, true);
 
         /* Reporting statistics */
         TimePoint report_time  = std::chrono::high_resolution_clock::now();
 
-        std::ofstream logfile;
-        char log_file_name[64];
-        sprintf(log_file_name, "log/flow_status_%ld.log", std::chrono::duration_cast<std::chrono::seconds>(
-                                                report_time.time_since_epoch()).count());
-        logfile.open(log_file_name);
-
-            /*  Lauch multiple threads to report the table. */
-        for(size_t i=0; i<NUMBER_OF_REPORTING_THREAD; i++){
-            std::thread threadObj(
-                [&]{
-                    {// Still need to lock table because there may some residual writing threads try to update this table.
-                    // The residual writing threads pre update this table will also be considered.
-                        FlowTable* read_table = get_curr_read_table(i);
-                        auto lt = read_table->lock_table();
-                        try{
-                            // Insert to pgsql table HERE.
-                            pqxx::work txn{*m_db_connpool[i]};
-                            for (auto &it : lt) {
-                                logfile << "THREAD: "<<i << ": " << it.first.to_string() << it.second.to_string() << std::endl;
-                                // Prepare sqls here.
-                                char upsert_flow_info_sql[1024];
-                                char quert_flow_id_sql[256];
-                                sprintf(upsert_flow_info_sql, 
-                                    "INSERT INTO tb_flow_info(srcip, dstip, srcport, dstport, protocol,"                     
-                                                                "pkt_tot, pkt_max, byte_tot, byte_max, wid_begin, wid_last) "
-                                    "VALUES (%u, %u, %hu, %hu, %hhu, %u, %u, %u, %u, %u, %u) "
-                                    "ON CONFLICT(srcip, dstip, srcport, dstport, protocol) DO UPDATE " 
-                                    "SET pkt_tot=tb_flow_info.pkt_tot+%u, "
-                                        "pkt_max=CASE WHEN %u > tb_flow_info.pkt_max "
-                                                "THEN %u "
-                                                "ELSE tb_flow_info.pkt_max "
-                                                "END, "
-                                        "byte_tot=tb_flow_info.byte_tot+%u, "
-                                        "byte_max=CASE WHEN %u > tb_flow_info.byte_max "
-                                                "THEN %u "
-                                                "ELSE tb_flow_info.byte_max "
-                                                "END, "
-                                        "wid_last=%u; ",
-                                    it.first._srcip, it.first._dstip, it.first._srcport, it.first._dstport, it.first._protocol,
-                                    it.second._packet_tot, it.second._packet_max, it.second._byte_tot, it.second._byte_max, it.second._start_wid, it.second._max_wid,
-                                    it.second._packet_tot, 
-                                    it.second._packet_max, it.second._packet_max, 
-                                    it.second._byte_tot, 
-                                    it.second._byte_max, it.second._byte_max, 
-                                    it.second._max_wid
-                                ); // END construct SQL 1.
-                                sprintf(quert_flow_id_sql,
-                                    "SELECT fid FROM tb_flow_info "
-                                    "WHERE srcip=%u AND dstip=%u AND srcport=%hu AND dstport=%hu AND protocol=%hhu; ",
-                                    it.first._srcip, it.first._dstip, it.first._srcport, it.first._dstport, it.first._protocol
-                                ); // END construct SQL 2.
-                                txn.exec0(upsert_flow_info_sql);
-                                pqxx::result r = txn.exec(quert_flow_id_sql);
-                                if(r.empty()){
-                                    std::cerr << "Cannot find flow with SQL: "<< quert_flow_id_sql << std::endl;
-                                    continue;
-                                }
-                                uint32_t fid = r.at(0)["fid"].as<uint32_t>();
-                                // DEBUG INFO
-                                std::cout << "Get fid= "<< fid << std::endl;
-                                for(uint32_t wid=0; wid<=it.second._max_wid; ++wid){
-                                    char upsert_flow_wid_cnt_sql[256];
-                                    sprintf(upsert_flow_wid_cnt_sql,
-                                        "INSERT INTO tb_flow_wid_counter(fid, wid, pkt_count, byte_count) "
-                                        "VALUES (%u, %u, %hhu, %hu) "
-                                        "ON CONFLICT(fid, wid) DO UPDATE " 
-                                        "SET pkt_count=tb_flow_wid_counter.pkt_count+%u, "
-                                            "byte_count=tb_flow_wid_counter.byte_count+%u; ",
-                                        fid, wid, 1, 1,
-                                        1, 1 // TODO: Set right packet count.
-                                    ); // END construct SQL 3.
-                                    txn.exec0(upsert_flow_wid_cnt_sql);
-                                }
-                                std::cout << "THREAD: "<<i << ": " << it.first.to_string() << it.second.to_string() << std::endl;
-                            }
-                            // Not really needed, since we made no changes, but good habit to be
-                            // explicit about when the transaction is done.
-                            txn.commit(); 
-                        }
-                        catch (pqxx::sql_error const &e){
-                                std::cerr << "SQL error: " << e.what() << std::endl;
-                                std::cerr << "Query was: " << e.query() << std::endl;
-                                // TODO: try to reconnect.
-                            }
-                        catch (std::exception const &e){
-                            std::cerr << "Error: " << e.what() << std::endl;
-                            // TODO: try to reconnect.
-                        }
-                        lt.clear();
-                    }// The residual writing threads post update this table is no problem.
-                }
-            );
-            threadObj.join(); 
+        /* Wake up the reporting threads, they export the retired epoch in parallel. */
+        {
+            std::lock_guard<std::mutex> lk(m_report_lock);
+            m_report_stamp = std::chrono::duration_cast<std::chrono::seconds>(
+                                                report_time.time_since_epoch()).count();
+            m_report_next_shard.store(0);
+            m_report_pending = m_pool->nb_workers();
+            m_report_seq++;
         }
+        m_pool->kick();
         m_last_report_time = report_time;
-        logfile.close();
+        m_switch_requested = false;
         // TODO: Print reporting statistics log here.
     }
 }
-#endif
 
+template <typename Key>
+bool flowbook_table<Key>::is_reporting(){
+    std::lock_guard<std::mutex> lk(m_report_lock);
+    return m_report_pending > 0;
+}
+
+template <typename Key>
+void flowbook_table<Key>::report_work(size_t worker_id){
+    if (m_aging.load(std::memory_order_acquire)) {
+        std::ofstream& expired_log = m_expired_logs[worker_id];
+        if (!expired_log.is_open()) {
+            char log_file_name[64];
+            sprintf(log_file_name, "log/%s_expired_%zu.log", Key::LOG_PREFIX, worker_id);
+            expired_log.open(log_file_name, std::ios::app);
+        }
+        drain_expired(worker_id, expired_log);
+    }
+
+    long stamp;
+    {
+        std::lock_guard<std::mutex> lk(m_report_lock);
+        if (m_report_seq == m_seen_seq[worker_id])
+            return;
+        m_seen_seq[worker_id] = m_report_seq;
+        stamp = m_report_stamp;
+    }
 
-flowbook_table::~flowbook_table(){
+    // One log file per reporting thread and epoch, no shared stream.
     std::ofstream logfile;
-    logfile.open("log/flow_status_global.log");
+    char log_file_name[64];
+    sprintf(log_file_name, "log/%s_%ld_%zu.log", Key::LOG_PREFIX, stamp, worker_id);
+    logfile.open(log_file_name);
+    size_t shard_id;
+    while ((shard_id = m_report_next_shard.fetch_add(1)) < m_shard_num) {
+        report_shard(shard_id, worker_id, logfile);
+    }
+    logfile.close();
+
+    std::lock_guard<std::mutex> lk(m_report_lock);
+    m_report_pending--;
+}
+
+template <typename Key>
+template <typename F>
+void flowbook_table<Key>::export_flows(size_t shard_id, size_t worker_id, std::ofstream& logfile,
+                                  const char* tag, F&& for_each){
+    #ifdef ENABLE_DB
+    {
+        // Stream the flows with two binary COPYs, then merge on the server.
+        // The log gets every flow once, however many attempts it takes.
+        flowbook_exporter* exporter = m_exporters[worker_id];
+        auto log_flow = [&](const Key& key, const flow_attr& attr){
+            logfile << tag << ": "<<shard_id << ": " << key.to_string() << attr.to_string() << std::endl;
+        };
+        bool logged = false;
+        for (int attempt = 1; ; ++attempt) {
+            exporter->begin();
+            if (exporter->copy_start(flowbook_exporter::FLOWS)) {
+                for_each([&](const Key& key, const flow_attr& attr){
+                    if (!logged)
+                        log_flow(key, attr);
+                    exporter->put_flow(key, attr);
+                });
+                exporter->copy_end();
+            } else if (!logged) {
+                for_each(log_flow);
+            }
+            logged = true;
+            if (exporter->copy_start(flowbook_exporter::WINDOWS)) {
+                for_each([&](const Key& key, const flow_attr& attr){
+                    exporter->put_windows(key, attr);
+                });
+                exporter->copy_end();
+            }
+            if (exporter->commit()) {
+                logfile << tag << ": "<< shard_id << ": exported " << exporter->nb_flows() << " flows, "
+                        << exporter->nb_windows() << " windows" << std::endl;
+                return;
+            }
+            if (attempt == FLOWBOOK_EXPORT_ATTEMPTS)
+                break;
+            std::cerr << tag << ": "<< shard_id << ": database export failed, retrying" << std::endl;
+        }
+        // The table is recycled after us, the log file is all that is left.
+        uint64_t nb_lost = 0;
+        for_each([&](const Key&, const flow_attr&){ nb_lost++; });
+        m_nb_export_lost += nb_lost;
+        logfile << tag << ": "<< shard_id << ": not exported, " << nb_lost << " flows" << std::endl;
+        std::cerr << tag << ": "<< shard_id << ": database export failed, "
+                  << nb_lost << " flows only in the log" << std::endl;
+        return;
+    }
+    #endif
+    for_each([&](const Key& key, const flow_attr& attr){
+        logfile << tag << ": "<<shard_id << ": " << key.to_string() << attr.to_string() << std::endl;
+    });
+}
+
+/**
+ * Export the flows handed over by the owners of shards worker_id, worker_id + N, ...
+ * (N: the started threads of the pool).
+ * Each expired ring has this thread as its only consumer.
+*/
+template <typename Key>
+void flowbook_table<Key>::drain_expired(size_t worker_id, std::ofstream& logfile){
+    std::vector<flow_record<Key>>& recs = m_expired_bufs[worker_id];
+    if (recs.empty())
+        recs.resize(FLOWBOOK_EXPIRE_RING_SIZE);
+
+    for(size_t shard_id=worker_id; shard_id<m_shard_num; shard_id+=m_pool->nb_workers()){
+        struct rte_ring* ring = m_shards[shard_id].m_expired;
+        unsigned n = rte_ring_sc_dequeue_burst_elem(ring, recs.data(), sizeof(flow_record<Key>),
+                                                    recs.size(), nullptr);
+        if (n == 0)
+            continue;
+        export_flows(shard_id, worker_id, logfile, "EXPIRED", [&](auto&& fn){
+            for(unsigned i=0; i<n; ++i)
+                fn(recs[i].key, recs[i].attr);
+        });
+    }
+}
+
+/**
+ * Report the retired table of one shard and recycle it.
+ * The owner has left this epoch (see check_and_report), the table is ours.
+*/
+template <typename Key>
+void flowbook_table<Key>::report_shard(size_t shard_id, size_t worker_id, std::ofstream& logfile){
+    FlowTable* read_table = get_curr_read_table(shard_id);
+    export_flows(shard_id, worker_id, logfile, "SHARD", [&](auto&& fn){
+        read_table->for_each(fn);
+    });
+    if (m_admission) {
+        flow_admission_sketch* sketch = sketch_of(shard_id, read_table);
+        logfile << "SHARD: " << shard_id << ": mice flows=" << sketch->mice_flows()
+                << ", pkts=" << sketch->mice_pkts() << ", bytes=" << sketch->mice_bytes()
+                << ", admitted=" << sketch->nb_admitted() << std::endl;
+        m_shards[shard_id].m_nb_mice_pkts += sketch->mice_pkts();
+        sketch->clear();
+    }
+    read_table->clear();
+    wheel_of(shard_id, read_table)->clear();
+}
+
+
+template <typename Key>
+flowbook_table<Key>::~flowbook_table(){
+    // No reporting thread is inside this table once detach() returns.
+    m_pool->detach(this);
+    if (m_own_pool)
+        delete m_pool;
+
+    std::ofstream logfile;
+    char log_file_name[64];
+    sprintf(log_file_name, "log/%s_global.log", Key::LOG_PREFIX);
+    logfile.open(log_file_name);
     logfile << "Total Received & Processed Packets: " << m_total_pkt.load() << std::endl;
+    logfile << "Flows Not Exported (Database Failed): " << m_nb_export_lost.load() << std::endl;
+    for(size_t i=0; i<m_shard_num; ++i){
+        logfile << "Shard " << i << " Dropped Flows (Table Full): " << m_shards[i].m_nb_drop << std::endl;
+        logfile << "Shard " << i << " Expired Flows: " << m_shards[i].m_nb_expired << std::endl;
+        logfile << "Shard " << i << " Mice Packets (Not Admitted): " << m_shards[i].m_nb_mice_pkts << std::endl;
+        rte_ring_free(m_shards[i].m_expired);
+    }
     logfile.close();
+    delete[] m_shards;
+    rte_free(m_qsv);
 
     #ifdef ENABLE_DB
     // release database connection
-    for(size_t i=0; i<NUMBER_OF_PARALLEL_TABLE; ++i){
-        m_db_connpool[i]->disconnect();
-        std::cout <<"THREAD ID: "<< i<< ", disconect database " << m_db_connpool[i]->dbname() << "successfully!"<< std::endl;
+    for(size_t i=0; i<NUMBER_OF_REPORTING_THREAD; ++i){
+        if (m_exporters[i] == nullptr)
+            continue;
+        delete m_exporters[i];
+        std::cout <<"THREAD ID: "<< i<< ", disconect database successfully!"<< std::endl;
     }
     #endif
 }
-#endif
\ No newline at end of file
+
+template class flowbook_table<flow_key>;
+template class flowbook_table<flow_key_v6>;
+template class flowbook_table<flow_key_vlan>;
+
+#endif
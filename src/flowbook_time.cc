@@ -0,0 +1,28 @@
+#include "flowbook_time.h"
+
+#include <inttypes.h>
+#include <rte_log.h>
+
+#define RTE_LOGTYPE_FLOWBOOK RTE_LOGTYPE_USER1
+
+struct flowbook_clock flowbook_clock;
+
+int
+flowbook_time_init(uint32_t window_us)
+{
+	flowbook_clock.tsc_hz = rte_get_tsc_hz();
+	if (flowbook_clock.tsc_hz == 0 || window_us == 0)
+		return -1;
+
+	flowbook_clock.window_us = window_us;
+	flowbook_clock.window_tsc = flowbook_clock.tsc_hz * window_us / US_PER_S;
+	if (flowbook_clock.window_tsc == 0)
+		return -1;
+	flowbook_clock.window_div =
+		rte_reciprocal_value_u64(flowbook_clock.window_tsc);
+	flowbook_clock.base_tsc = rte_rdtsc();
+
+	RTE_LOG(INFO, FLOWBOOK, "TSC %" PRIu64 " Hz, window %u us = %" PRIu64 " cycles\n",
+		flowbook_clock.tsc_hz, window_us, flowbook_clock.window_tsc);
+	return 0;
+}
@@ -0,0 +1,105 @@
+#include "flowbook_trace.h"
+
+#include <inttypes.h>
+#include <rte_log.h>
+
+#define RTE_LOGTYPE_FLOWBOOK RTE_LOGTYPE_USER1
+
+struct flowbook_trace_lcore flowbook_trace_lcores[RTE_MAX_LCORE];
+uint32_t flowbook_trace_sample = FLOWBOOK_TRACE_SAMPLE_DEFAULT;
+
+/* Drains the rings on the first reporting thread, the only consumer. */
+class flowbook_trace_client : public flowbook_report_client {
+public:
+	void report_work(size_t worker_id) override
+	{
+		if (worker_id == 0)
+			flowbook_trace_drain(0);
+	}
+};
+
+static flowbook_trace_client trace_client;
+static flowbook_report_pool *trace_pool;
+
+int
+flowbook_trace_init(uint32_t sample, flowbook_report_pool *pool)
+{
+	unsigned lcore_id;
+	char name[RTE_RING_NAMESIZE];
+
+	flowbook_trace_sample = sample > 0 ? sample : 1;
+	for (lcore_id = 0; lcore_id < RTE_MAX_LCORE; lcore_id++) {
+		struct flowbook_trace_lcore *tl = &flowbook_trace_lcores[lcore_id];
+
+		tl->countdown = flowbook_trace_sample;
+		tl->dropped = 0;
+		if (rte_lcore_is_enabled(lcore_id) == 0)
+			continue;
+		snprintf(name, sizeof(name), "flowbook_trace_%u", lcore_id);
+		tl->ring = rte_ring_create_elem(name,
+				sizeof(struct flowbook_trace_rec),
+				FLOWBOOK_TRACE_RING_SIZE,
+				rte_lcore_to_socket_id(lcore_id),
+				RING_F_SP_ENQ | RING_F_SC_DEQ);
+		if (tl->ring == NULL) {
+			RTE_LOG(ERR, FLOWBOOK, "Cannot create trace ring on lcore %u\n",
+				lcore_id);
+			return -1;
+		}
+	}
+	trace_pool = pool;
+	trace_pool->attach(&trace_client);
+	return 0;
+}
+
+unsigned
+flowbook_trace_drain(unsigned budget)
+{
+	struct flowbook_trace_rec recs[FLOWBOOK_TRACE_DRAIN_BURST];
+	unsigned lcore_id, i, n, total = 0;
+
+	for (lcore_id = 0; lcore_id < RTE_MAX_LCORE; lcore_id++) {
+		struct flowbook_trace_lcore *tl = &flowbook_trace_lcores[lcore_id];
+
+		if (tl->ring == NULL)
+			continue;
+		do {
+			n = rte_ring_sc_dequeue_burst_elem(tl->ring, recs,
+					sizeof(recs[0]), RTE_DIM(recs), NULL);
+			for (i = 0; i < n; i++) {
+				flow_key key = recs[i].key;
+				RTE_LOG(INFO, FLOWBOOK,
+					"[lcore %u: Port %u: Queue %u] tsc=%" PRIu64
+					" len=%u hash=%08x %s\n",
+					lcore_id, recs[i].port_id, recs[i].queue_id,
+					(uint64_t)recs[i].tsc, (unsigned)recs[i].pkt_len,
+					(unsigned)recs[i].hash, key.to_string().c_str());
+			}
+			total += n;
+		} while (n == RTE_DIM(recs) && (budget == 0 || total < budget));
+	}
+	return total;
+}
+
+void
+flowbook_trace_free(void)
+{
+	unsigned lcore_id;
+
+	if (trace_pool != NULL) {
+		trace_pool->detach(&trace_client);
+		trace_pool = NULL;
+	}
+	flowbook_trace_drain(0);
+	for (lcore_id = 0; lcore_id < RTE_MAX_LCORE; lcore_id++) {
+		struct flowbook_trace_lcore *tl = &flowbook_trace_lcores[lcore_id];
+
+		if (tl->ring == NULL)
+			continue;
+		if (tl->dropped > 0)
+			RTE_LOG(INFO, FLOWBOOK, "lcore %u lost %" PRIu64 " trace records\n",
+				lcore_id, tl->dropped);
+		rte_ring_free(tl->ring);
+		tl->ring = NULL;
+	}
+}
@@ -47,7 +47,15 @@
 
 #include "flowbook_hdr.h"
 // #include "flowbook_utils.h"
+#include "flowbook_event.h"
+#include "flowbook_gen.h"
+#include "flowbook_parse.h"
+#include "flowbook_pipeline.h"
+#include "flowbook_rebalance.h"
+#include "flowbook_replay.h"
 #include "flowbook_table.h"
+#include "flowbook_time.h"
+#include "flowbook_trace.h"
 
 #define RTE_LOGTYPE_FLOWBOOK RTE_LOGTYPE_USER1
 
@@ -57,22 +65,16 @@
 #define MAX_LCORE_PARAMS 1024
 
 #define MAX_PKT_BURST     32
+static_assert(MAX_PKT_BURST <= FLOWBOOK_PARSE_MAX_BURST, "burst too large for the parser");
+
+/* the IPv6 and VLAN tables get 1/N of the IPv4 table size */
+#define FLOWBOOK_AUX_TABLE_DIV 8
 
 #define MEMPOOL_CACHE_SIZE 256
 #define MAX_RX_QUEUE_PER_LCORE 16
 
 #define NB_SOCKETS        8
 
-/* Hash parameters. */
-#ifdef RTE_ARCH_64
-/* default to 4 million hash entries (approx) */
-#define L3FWD_HASH_ENTRIES		(1024*1024*4)
-#else
-/* 32-bit has less address-space for hugepage memory, limit to 1M entries */
-#define L3FWD_HASH_ENTRIES		(1024*1024*1)
-#endif
-#define HASH_ENTRY_NUMBER_DEFAULT	16
-
 /*
  * Configurable number of RX/TX ring descriptors
  * In orther words, rx/tx queue size.
@@ -90,6 +92,15 @@ static int promiscuous_on;
  */
 static int numa_on = 1; /**< NUMA is enabled by default. */
 static int per_port_pool = false; /**< Use separate buffer pools per port. */
+/**
+ * Reuse the NIC RSS hash as flow hash. Only set when every enabled port
+ * delivers it, so one lcore never mixes RSS and software hashes.
+ */
+static int rss_hash_on;
+/* decode switch reports, the IPv4 flows then take the software hash */
+static int pdu_on;
+/* per port: the PMD classifies L2/L3/L4 into m->packet_type */
+static uint8_t ptype_hw[RTE_MAX_ETHPORTS];
 
 volatile bool force_quit;
 
@@ -106,7 +117,57 @@ struct flowbook_port_statistics port_statistics[RTE_MAX_ETHPORTS];
 /* mask of enabled ports */
 uint32_t enabled_port_mask;
 
-uint32_t table_entry_number = 1024;
+uint32_t table_entry_number = DEFAULT_TABLE_SIZE;
+
+#ifdef ENABLE_TRACE
+/* trace one of every trace_sample packets */
+static uint32_t trace_sample = FLOWBOOK_TRACE_SAMPLE_DEFAULT;
+#endif
+
+/* number of flow table shards, one per RX lcore or per pipeline worker */
+static uint16_t nb_shards;
+/* NUMA socket of the lcore owning each shard, where its tables live */
+static int shard_socket[RTE_MAX_LCORE];
+
+/* lcores polling queues, and their sockets */
+static uint16_t nb_rx_lcores;
+static int rx_socket[RTE_MAX_LCORE];
+
+/* pipeline mode: the workers own the shards, the RX lcores only parse */
+static uint16_t nb_workers;
+static unsigned worker_lcores[RTE_MAX_LCORE];
+/* pipeline over an event device instead of the SPSC rings */
+static bool use_eventdev;
+
+/* milliseconds between two RETA rebalancing rounds, 0: off */
+static uint32_t rebalance_ms;
+
+/* seconds of one table epoch and microseconds of one counter window */
+static uint32_t report_period = TABLE_SWITCH_COND_TIMER;
+static uint32_t window_us = FLOWBOOK_WINDOW_US_DEFAULT;
+static int report_period_set;
+
+/* flow aging timeouts in seconds, 0: off */
+static uint32_t idle_timeout;
+static uint32_t active_timeout;
+
+/* admission thresholds of the flow tables, 0: admit every flow */
+static uint32_t admit_pkts;
+static uint32_t admit_bytes;
+static uint32_t sketch_width = FLOW_SKETCH_WIDTH_DEFAULT;
+
+/* lcore that switches the table epochs, the main lcore by default */
+static unsigned report_lcore = RTE_MAX_LCORE;
+
+/* pcap replayed in place of the ports, NULL: receive from the ports */
+static const char *replay_file;
+static uint32_t replay_loops = 1;	/**< 0: until stopped */
+static double replay_speed = 1.0;	/**< 0: unpaced */
+
+/* synthetic traffic in place of the ports, NULL: off */
+static const char *gen_spec;
+static struct flowbook_gen_conf gen_conf;
+static unsigned gen_lcore = RTE_MAX_LCORE;	/**< default: first free lcore */
 
 struct lcore_rx_queue {
 	uint16_t port_id;
@@ -116,6 +177,10 @@ struct lcore_rx_queue {
 /* Lcore conf */
 struct lcore_conf {
 	uint16_t n_rx_queue;
+	uint16_t shard_id;	/**< private flow table shard of this lcore */
+	uint16_t rx_id;		/**< index among the lcores polling queues */
+	uint8_t worker;		/**< pipeline worker: owns a shard, polls no queue */
+	uint16_t worker_id;	/**< index among the workers, its table writer id */
 	struct lcore_rx_queue rx_queue_list[MAX_RX_QUEUE_PER_LCORE];
 	uint16_t n_tx_port;
 	uint16_t tx_port_id[RTE_MAX_ETHPORTS];
@@ -158,7 +223,7 @@ static struct rte_eth_conf port_conf = {
 	.rx_adv_conf = {
 		.rss_conf = {
 			.rss_key = NULL,
-			.rss_hf = RTE_ETH_RSS_TCP,
+			.rss_hf = RTE_ETH_RSS_TCP | RTE_ETH_RSS_UDP,
 		},
 	},
 };
@@ -238,6 +303,7 @@ init_lcore_rx_queues(void)
 {
 	uint16_t i, nb_rx_queue;
 	uint8_t lcore;
+	unsigned lcore_id;
 
 	for (i = 0; i < nb_lcore_params; ++i) {
 		lcore = lcore_params[i].lcore_id;
@@ -254,6 +320,46 @@ init_lcore_rx_queues(void)
 			lcore_conf[lcore].n_rx_queue++;
 		}
 	}
+	/* every lcore polling at least one queue owns a flow table shard */
+	for (lcore_id = 0; lcore_id < RTE_MAX_LCORE; lcore_id++) {
+		if (lcore_conf[lcore_id].n_rx_queue == 0)
+			continue;
+		rx_socket[nb_rx_lcores] = numa_on ?
+			(int)rte_lcore_to_socket_id(lcore_id) : SOCKET_ID_ANY;
+		lcore_conf[lcore_id].rx_id = nb_rx_lcores++;
+		if (nb_workers > 0)
+			continue;
+		shard_socket[nb_shards] = rx_socket[lcore_conf[lcore_id].rx_id];
+		lcore_conf[lcore_id].shard_id = nb_shards++;
+	}
+	/* ... unless the pipeline workers do */
+	for (i = 0; i < nb_workers; i++) {
+		lcore_id = worker_lcores[i];
+		if (!rte_lcore_is_enabled(lcore_id) ||
+				lcore_conf[lcore_id].n_rx_queue > 0 ||
+				lcore_conf[lcore_id].worker) {
+			printf("error: worker lcore %u is not enabled, polls queues "
+				"or is given twice\n", lcore_id);
+			return -1;
+		}
+		lcore_conf[lcore_id].worker = 1;
+		lcore_conf[lcore_id].worker_id = i;
+		if (use_eventdev)
+			continue;
+		shard_socket[nb_shards] = numa_on ?
+			(int)rte_lcore_to_socket_id(lcore_id) : SOCKET_ID_ANY;
+		lcore_conf[lcore_id].shard_id = nb_shards++;
+	}
+	/* eventdev: more shards than workers, any worker can process any of them */
+	if (use_eventdev) {
+		if (nb_workers * FLOWBOOK_EVENT_SHARDS_PER_WORKER > RTE_MAX_LCORE) {
+			printf("error: too many workers for the eventdev\n");
+			return -1;
+		}
+		for (i = 0; i < nb_workers * FLOWBOOK_EVENT_SHARDS_PER_WORKER; i++)
+			shard_socket[nb_shards++] = numa_on ? (int)rte_lcore_to_socket_id(
+				worker_lcores[i % nb_workers]) : SOCKET_ID_ANY;
+	}
 	return 0;
 }
 
@@ -269,7 +375,16 @@ print_usage(const char *prgname)
 		" [--tx-queue-size NPKTS]"
 		" [--max-pkt-len PKTLEN]"
 		" [--no-numa]"
-		" [--hash-entry-num]\n\n"
+		" [--pdu]"
+		" [--hash-entry-num]"
+		" [--replay PCAP [--replay-loop N] [--replay-speed X]]"
+		" [--gen SPEC [--gen-lcore N]]"
+		" [--workers LCORES [--eventdev]]"
+		" [--rebalance-ms MS]"
+#ifdef ENABLE_TRACE
+		" [--trace-sample N]"
+#endif
+		"\n\n"
 
 		"  -p PORTMASK: Hexadecimal bitmask of ports to configure\n"
 		"  -P : Enable promiscuous mode\n"
@@ -280,8 +395,49 @@ print_usage(const char *prgname)
 		"            Default: %d\n"
 		"  --max-pkt-len PKTLEN: maximum packet length in decimal (64-9600)\n"
 		"  --no-numa: Disable numa awareness\n"
-		"  --table-entry-num: Specify the hash entry number in hexadecimal to be setup\n",
-		prgname, RX_DESC_DEFAULT, TX_DESC_DEFAULT);
+		"  --pdu: Decode the switch reports sent to UDP port %d\n"
+		"  --table-entry-num: Specify the hash entry number in hexadecimal to be setup\n"
+		"            Default: %x, at most %x, IPv6 and VLAN tables get 1/%d of it\n"
+		"  --report-lcore N: Lcore that switches and exports the tables\n"
+		"            Default: main lcore\n"
+		"  --report-period SEC: Seconds between two table switches\n"
+		"            Default: %d\n"
+		"  --window-us US: Width of the per-flow counter windows\n"
+		"            Default: %d\n"
+		"  --idle-timeout SEC: Export a flow after SEC seconds without packets\n"
+		"  --active-timeout SEC: Export a flow SEC seconds after its first packet\n"
+		"            With aging the tables only switch on load, unless --report-period is given\n"
+		"  --admit-pkts N: Only track a flow in the tables from its N-th packet on\n"
+		"  --admit-bytes N: Only track a flow in the tables from its N-th byte on\n"
+		"            Smaller flows are counted in a sketch and reported in aggregate\n"
+		"  --sketch-width N: Counters per sketch row (4 rows of 8 bytes)\n"
+		"            Default: %d\n"
+		"  --replay PCAP: Replay PCAP on the --config lcores instead of polling ports\n"
+		"            Ports and queues of --config are ignored, -p is not needed\n"
+		"  --replay-loop N: Replay the capture N times, 0: until stopped (default 1)\n"
+		"  --replay-speed X: X times the captured rate, 0: as fast as possible (default 1)\n"
+		"            Packets overflowing --rx-queue-size while paced are dropped\n"
+		"  --gen SPEC: Feed the --config lcores with synthetic traffic, key=value list of\n"
+		"            dist=uniform|zipf|syn, flows=N, skew=S, proto=udp|tcp|mix, len=BYTES,\n"
+		"            rate=MPPS (0: max), pkts=N (0: until stopped)\n"
+		"  --gen-lcore N: Lcore generating the traffic, default: first lcore without queues\n"
+		"  --workers LCORES: Pipeline mode, LCORES (e.g. 4-7 or 4,6) own the table shards\n"
+		"            and the --config lcores only receive and parse, for ports with few queues\n"
+		"  --eventdev: Pipeline through an event device (event_sw if the EAL has none),\n"
+		"            shards scheduled atomic and balanced over the workers\n"
+		"  --rebalance-ms MS: Move RSS RETA buckets from saturated lcores to idle ones,\n"
+		"            every MS milliseconds at most, on an early table switch\n"
+#ifdef ENABLE_TRACE
+		"  --trace-sample N: Trace one of every N packets (default %d)\n"
+#endif
+		,
+		prgname, RX_DESC_DEFAULT, TX_DESC_DEFAULT, FLOW_BOOK_PDU_UDP_PORT,
+		DEFAULT_TABLE_SIZE, MAX_TABLE_SIZE, FLOWBOOK_AUX_TABLE_DIV, TABLE_SWITCH_COND_TIMER, FLOWBOOK_WINDOW_US_DEFAULT,
+		FLOW_SKETCH_WIDTH_DEFAULT
+#ifdef ENABLE_TRACE
+		, FLOWBOOK_TRACE_SAMPLE_DEFAULT
+#endif
+		);
 }
 
 static int
@@ -301,6 +457,22 @@ parse_max_pkt_len(const char *pktlen)
 	return len;
 }
 
+/* parse a positive decimal option value, -1 on error */
+static long
+parse_decimal(const char *arg)
+{
+	char *end = NULL;
+	unsigned long val;
+
+	val = strtoul(arg, &end, 10);
+	if ((arg[0] == '\0') || (end == NULL) || (*end != '\0'))
+		return -1;
+	if (val == 0 || val > INT32_MAX)
+		return -1;
+
+	return val;
+}
+
 static int
 parse_portmask(const char *portmask)
 {
@@ -325,12 +497,46 @@ parse_table_entry_number(const char *hash_entry_num)
 	if ((hash_entry_num[0] == '\0') || (end == NULL) || (*end != '\0'))
 		return -1;
 
-	if (hash_en == 0)
+	if (hash_en == 0 || hash_en > MAX_TABLE_SIZE)
 		return -1;
 
 	return hash_en;
 }
 
+/* lcore list like "4-7" or "4,6,8" */
+static int
+parse_worker_lcores(const char *arg)
+{
+	const char *p = arg;
+	char *end = NULL;
+	unsigned long first, last, i;
+
+	nb_workers = 0;
+	while (*p != '\0') {
+		first = strtoul(p, &end, 10);
+		if (end == p)
+			return -1;
+		last = first;
+		if (*end == '-') {
+			p = end + 1;
+			last = strtoul(p, &end, 10);
+			if (end == p)
+				return -1;
+		}
+		if (first > last || last >= RTE_MAX_LCORE ||
+				nb_workers + (last - first) >= RTE_MAX_LCORE)
+			return -1;
+		for (i = first; i <= last; i++)
+			worker_lcores[nb_workers++] = i;
+		if (*end == ',')
+			end++;
+		else if (*end != '\0')
+			return -1;
+		p = end;
+	}
+	return nb_workers > 0 ? 0 : -1;
+}
+
 static int
 parse_config(const char *q_arg)
 {
@@ -428,8 +634,26 @@ static const char short_options[] =
 #define CMD_LINE_OPT_RX_QUEUE_SIZE "rx-queue-size"
 #define CMD_LINE_OPT_TX_QUEUE_SIZE "tx-queue-size"
 #define CMD_LINE_OPT_NO_NUMA "no-numa"
+#define CMD_LINE_OPT_PDU "pdu"
 #define CMD_LINE_OPT_MAX_PKT_LEN "max-pkt-len"
 #define CMD_LINE_OPT_TABLE_ENTRY_NUM "table-entry-num"
+#define CMD_LINE_OPT_TRACE_SAMPLE "trace-sample"
+#define CMD_LINE_OPT_REPORT_LCORE "report-lcore"
+#define CMD_LINE_OPT_REPORT_PERIOD "report-period"
+#define CMD_LINE_OPT_WINDOW_US "window-us"
+#define CMD_LINE_OPT_IDLE_TIMEOUT "idle-timeout"
+#define CMD_LINE_OPT_ACTIVE_TIMEOUT "active-timeout"
+#define CMD_LINE_OPT_ADMIT_PKTS "admit-pkts"
+#define CMD_LINE_OPT_ADMIT_BYTES "admit-bytes"
+#define CMD_LINE_OPT_SKETCH_WIDTH "sketch-width"
+#define CMD_LINE_OPT_REPLAY "replay"
+#define CMD_LINE_OPT_REPLAY_LOOP "replay-loop"
+#define CMD_LINE_OPT_REPLAY_SPEED "replay-speed"
+#define CMD_LINE_OPT_GEN "gen"
+#define CMD_LINE_OPT_GEN_LCORE "gen-lcore"
+#define CMD_LINE_OPT_WORKERS "workers"
+#define CMD_LINE_OPT_EVENTDEV "eventdev"
+#define CMD_LINE_OPT_REBALANCE_MS "rebalance-ms"
 
 enum {
 	/* long options mapped to a short option */
@@ -441,8 +665,26 @@ enum {
 	CMD_LINE_OPT_RX_QUEUE_SIZE_NUM,
 	CMD_LINE_OPT_TX_QUEUE_SIZE_NUM,
 	CMD_LINE_OPT_NO_NUMA_NUM,
+	CMD_LINE_OPT_PDU_NUM,
 	CMD_LINE_OPT_MAX_PKT_LEN_NUM,
-	CMD_LINE_OPT_TABLE_ENTRY_NUM_NUM
+	CMD_LINE_OPT_TABLE_ENTRY_NUM_NUM,
+	CMD_LINE_OPT_TRACE_SAMPLE_NUM,
+	CMD_LINE_OPT_REPORT_LCORE_NUM,
+	CMD_LINE_OPT_REPORT_PERIOD_NUM,
+	CMD_LINE_OPT_WINDOW_US_NUM,
+	CMD_LINE_OPT_IDLE_TIMEOUT_NUM,
+	CMD_LINE_OPT_ACTIVE_TIMEOUT_NUM,
+	CMD_LINE_OPT_ADMIT_PKTS_NUM,
+	CMD_LINE_OPT_ADMIT_BYTES_NUM,
+	CMD_LINE_OPT_SKETCH_WIDTH_NUM,
+	CMD_LINE_OPT_REPLAY_NUM,
+	CMD_LINE_OPT_REPLAY_LOOP_NUM,
+	CMD_LINE_OPT_REPLAY_SPEED_NUM,
+	CMD_LINE_OPT_GEN_NUM,
+	CMD_LINE_OPT_GEN_LCORE_NUM,
+	CMD_LINE_OPT_WORKERS_NUM,
+	CMD_LINE_OPT_EVENTDEV_NUM,
+	CMD_LINE_OPT_REBALANCE_MS_NUM
 };
 
 static const struct option lgopts[] = {
@@ -450,8 +692,28 @@ static const struct option lgopts[] = {
 	{CMD_LINE_OPT_RX_QUEUE_SIZE, 1, 0, CMD_LINE_OPT_RX_QUEUE_SIZE_NUM},
 	{CMD_LINE_OPT_TX_QUEUE_SIZE, 1, 0, CMD_LINE_OPT_TX_QUEUE_SIZE_NUM},
 	{CMD_LINE_OPT_NO_NUMA, 0, 0, CMD_LINE_OPT_NO_NUMA_NUM},
+	{CMD_LINE_OPT_PDU, 0, 0, CMD_LINE_OPT_PDU_NUM},
 	{CMD_LINE_OPT_MAX_PKT_LEN, 1, 0, CMD_LINE_OPT_MAX_PKT_LEN_NUM},
 	{CMD_LINE_OPT_TABLE_ENTRY_NUM, 1, 0, CMD_LINE_OPT_TABLE_ENTRY_NUM_NUM},
+	{CMD_LINE_OPT_REPORT_LCORE, 1, 0, CMD_LINE_OPT_REPORT_LCORE_NUM},
+	{CMD_LINE_OPT_REPORT_PERIOD, 1, 0, CMD_LINE_OPT_REPORT_PERIOD_NUM},
+	{CMD_LINE_OPT_WINDOW_US, 1, 0, CMD_LINE_OPT_WINDOW_US_NUM},
+	{CMD_LINE_OPT_IDLE_TIMEOUT, 1, 0, CMD_LINE_OPT_IDLE_TIMEOUT_NUM},
+	{CMD_LINE_OPT_ACTIVE_TIMEOUT, 1, 0, CMD_LINE_OPT_ACTIVE_TIMEOUT_NUM},
+	{CMD_LINE_OPT_ADMIT_PKTS, 1, 0, CMD_LINE_OPT_ADMIT_PKTS_NUM},
+	{CMD_LINE_OPT_ADMIT_BYTES, 1, 0, CMD_LINE_OPT_ADMIT_BYTES_NUM},
+	{CMD_LINE_OPT_SKETCH_WIDTH, 1, 0, CMD_LINE_OPT_SKETCH_WIDTH_NUM},
+	{CMD_LINE_OPT_REPLAY, 1, 0, CMD_LINE_OPT_REPLAY_NUM},
+	{CMD_LINE_OPT_REPLAY_LOOP, 1, 0, CMD_LINE_OPT_REPLAY_LOOP_NUM},
+	{CMD_LINE_OPT_REPLAY_SPEED, 1, 0, CMD_LINE_OPT_REPLAY_SPEED_NUM},
+	{CMD_LINE_OPT_GEN, 1, 0, CMD_LINE_OPT_GEN_NUM},
+	{CMD_LINE_OPT_GEN_LCORE, 1, 0, CMD_LINE_OPT_GEN_LCORE_NUM},
+	{CMD_LINE_OPT_WORKERS, 1, 0, CMD_LINE_OPT_WORKERS_NUM},
+	{CMD_LINE_OPT_EVENTDEV, 0, 0, CMD_LINE_OPT_EVENTDEV_NUM},
+	{CMD_LINE_OPT_REBALANCE_MS, 1, 0, CMD_LINE_OPT_REBALANCE_MS_NUM},
+#ifdef ENABLE_TRACE
+	{CMD_LINE_OPT_TRACE_SAMPLE, 1, 0, CMD_LINE_OPT_TRACE_SAMPLE_NUM},
+#endif
 	{NULL, 0, 0, 0}
 };
 
@@ -520,13 +782,17 @@ parse_args(int argc, char **argv)
 			numa_on = 0;
 			break;
 
+		case CMD_LINE_OPT_PDU_NUM:
+			pdu_on = 1;
+			break;
+
 		case CMD_LINE_OPT_MAX_PKT_LEN_NUM:
 			max_pkt_len = parse_max_pkt_len(optarg);
 			break;
 
 		case CMD_LINE_OPT_TABLE_ENTRY_NUM_NUM:
 			ret = parse_table_entry_number(optarg);
-			if ((ret > 0) && (ret <= L3FWD_HASH_ENTRIES)) {
+			if ((ret > 0) && (ret <= MAX_TABLE_SIZE)) {
 				table_entry_number = ret;
 			} else {
 				fprintf(stderr, "invalid hash entry number\n");
@@ -535,11 +801,191 @@ parse_args(int argc, char **argv)
 			}
 			break;
 
+		case CMD_LINE_OPT_REPORT_LCORE_NUM:
+			/* lcore 0 is valid, so no parse_decimal() here */
+			{
+				char *end = NULL;
+				unsigned long val = strtoul(optarg, &end, 10);
+				if (optarg[0] == '\0' || *end != '\0' ||
+						val >= RTE_MAX_LCORE) {
+					fprintf(stderr, "invalid report lcore\n");
+					print_usage(prgname);
+					return -1;
+				}
+				report_lcore = val;
+			}
+			break;
+
+		case CMD_LINE_OPT_REPORT_PERIOD_NUM:
+			ret = parse_decimal(optarg);
+			if (ret <= 0) {
+				fprintf(stderr, "invalid report period\n");
+				print_usage(prgname);
+				return -1;
+			}
+			report_period = ret;
+			report_period_set = 1;
+			break;
+
+		case CMD_LINE_OPT_WINDOW_US_NUM:
+			ret = parse_decimal(optarg);
+			if (ret <= 0) {
+				fprintf(stderr, "invalid window width\n");
+				print_usage(prgname);
+				return -1;
+			}
+			window_us = ret;
+			break;
+
+		case CMD_LINE_OPT_IDLE_TIMEOUT_NUM:
+		case CMD_LINE_OPT_ACTIVE_TIMEOUT_NUM:
+			ret = parse_decimal(optarg);
+			if (ret <= 0) {
+				fprintf(stderr, "invalid flow timeout\n");
+				print_usage(prgname);
+				return -1;
+			}
+			if (opt == CMD_LINE_OPT_IDLE_TIMEOUT_NUM)
+				idle_timeout = ret;
+			else
+				active_timeout = ret;
+			break;
+
+		case CMD_LINE_OPT_ADMIT_PKTS_NUM:
+		case CMD_LINE_OPT_ADMIT_BYTES_NUM:
+			ret = parse_decimal(optarg);
+			if (ret <= 0) {
+				fprintf(stderr, "invalid admission threshold\n");
+				print_usage(prgname);
+				return -1;
+			}
+			if (opt == CMD_LINE_OPT_ADMIT_PKTS_NUM)
+				admit_pkts = ret;
+			else
+				admit_bytes = ret;
+			break;
+
+		case CMD_LINE_OPT_SKETCH_WIDTH_NUM:
+			ret = parse_decimal(optarg);
+			if (ret <= 0) {
+				fprintf(stderr, "invalid sketch width\n");
+				print_usage(prgname);
+				return -1;
+			}
+			sketch_width = ret;
+			break;
+
+		case CMD_LINE_OPT_REPLAY_NUM:
+			replay_file = optarg;
+			break;
+
+		case CMD_LINE_OPT_REPLAY_LOOP_NUM:
+			/* 0 is valid, so no parse_decimal() here */
+			{
+				char *end = NULL;
+				unsigned long val = strtoul(optarg, &end, 10);
+				if (optarg[0] == '\0' || *end != '\0' ||
+						val > UINT32_MAX) {
+					fprintf(stderr, "invalid replay loop count\n");
+					print_usage(prgname);
+					return -1;
+				}
+				replay_loops = val;
+			}
+			break;
+
+		case CMD_LINE_OPT_REPLAY_SPEED_NUM:
+			{
+				char *end = NULL;
+				double val = strtod(optarg, &end);
+				if (optarg[0] == '\0' || *end != '\0' || !(val >= 0)) {
+					fprintf(stderr, "invalid replay speed\n");
+					print_usage(prgname);
+					return -1;
+				}
+				replay_speed = val;
+			}
+			break;
+
+		case CMD_LINE_OPT_GEN_NUM:
+			if (flowbook_gen_parse(optarg, &gen_conf) != 0) {
+				fprintf(stderr, "invalid generator spec\n");
+				print_usage(prgname);
+				return -1;
+			}
+			gen_spec = optarg;
+			break;
+
+		case CMD_LINE_OPT_GEN_LCORE_NUM:
+			{
+				char *end = NULL;
+				unsigned long val = strtoul(optarg, &end, 10);
+				if (optarg[0] == '\0' || *end != '\0' ||
+						val >= RTE_MAX_LCORE) {
+					fprintf(stderr, "invalid generator lcore\n");
+					print_usage(prgname);
+					return -1;
+				}
+				gen_lcore = val;
+			}
+			break;
+
+		case CMD_LINE_OPT_WORKERS_NUM:
+			if (parse_worker_lcores(optarg) != 0) {
+				fprintf(stderr, "invalid worker lcores\n");
+				print_usage(prgname);
+				return -1;
+			}
+			break;
+
+		case CMD_LINE_OPT_EVENTDEV_NUM:
+			use_eventdev = true;
+			break;
+
+		case CMD_LINE_OPT_REBALANCE_MS_NUM:
+			ret = parse_decimal(optarg);
+			if (ret <= 0) {
+				fprintf(stderr, "invalid rebalance period\n");
+				print_usage(prgname);
+				return -1;
+			}
+			rebalance_ms = ret;
+			break;
+
+#ifdef ENABLE_TRACE
+		case CMD_LINE_OPT_TRACE_SAMPLE_NUM:
+			ret = parse_decimal(optarg);
+			if (ret <= 0) {
+				fprintf(stderr, "invalid trace sample rate\n");
+				print_usage(prgname);
+				return -1;
+			}
+			trace_sample = ret;
+			break;
+#endif
+
 		default:
 			print_usage(prgname);
 			return -1;
 		}
 	}
+	if (replay_file != NULL && gen_spec != NULL) {
+		fprintf(stderr, "--replay and --gen are exclusive\n");
+		print_usage(prgname);
+		return -1;
+	}
+	if (use_eventdev && nb_workers == 0) {
+		fprintf(stderr, "--eventdev needs --workers\n");
+		print_usage(prgname);
+		return -1;
+	}
+	/* the pipeline spreads flows by hash already, replay and gen have no RETA */
+	if (rebalance_ms > 0 && (nb_workers > 0 || replay_file != NULL ||
+			gen_spec != NULL)) {
+		fprintf(stderr, "--rebalance-ms needs ports polled by the --config lcores\n");
+		print_usage(prgname);
+		return -1;
+	}
 
 	if (optind >= 0)
 		argv[optind-1] = prgname;
@@ -720,6 +1166,44 @@ config_port_max_pkt_len(struct rte_eth_conf *conf,
  *  3. configure port memory (seperated or shared).
  *  4. map port queue to lcore by lcore_conf
 */
+/*
+ * Ask the PMD to classify every packet. Returns 1 if it recognizes
+ * Ethernet, IPv4, TCP and UDP, so that the data path can trust
+ * m->packet_type, 0 if the software parser has to do the work.
+ */
+static int
+flowbook_setup_ptypes(uint16_t portid)
+{
+	const uint32_t mask = RTE_PTYPE_L2_MASK | RTE_PTYPE_L3_MASK |
+		RTE_PTYPE_L4_MASK;
+	uint32_t ptypes[64];
+	int has_ether = 0, has_ipv4 = 0, has_tcp = 0, has_udp = 0;
+	int i, ret;
+
+	ret = rte_eth_dev_get_supported_ptypes(portid, mask, ptypes,
+			RTE_DIM(ptypes));
+	if (ret <= 0)
+		return 0;
+	for (i = 0; i < RTE_MIN(ret, (int)RTE_DIM(ptypes)); i++) {
+		if (ptypes[i] == RTE_PTYPE_L2_ETHER)
+			has_ether = 1;
+		else if (RTE_ETH_IS_IPV4_HDR(ptypes[i]))
+			has_ipv4 = 1;
+		else if (ptypes[i] == RTE_PTYPE_L4_TCP)
+			has_tcp = 1;
+		else if (ptypes[i] == RTE_PTYPE_L4_UDP)
+			has_udp = 1;
+	}
+	if (!(has_ether && has_ipv4 && has_tcp && has_udp))
+		return 0;
+
+	/* nothing beyond L4 is needed, PMDs may skip the rest */
+	ret = rte_eth_dev_set_ptypes(portid, mask, NULL, 0);
+	if (ret < 0 && ret != -ENOTSUP)
+		return 0;
+	return 1;
+}
+
 static void
 l3fwd_poll_resource_setup(void)
 {
@@ -746,6 +1230,7 @@ l3fwd_poll_resource_setup(void)
 		rte_exit(EXIT_FAILURE, "check_port_config failed\n");
 
 	nb_lcores = rte_lcore_count();
+	rss_hash_on = 1;
 
 	/* initialize all ports */
 	RTE_ETH_FOREACH_DEV(portid) {
@@ -800,6 +1285,14 @@ l3fwd_poll_resource_setup(void)
 			printf("Port %u modified RSS hash function.", portid);
 		}
 
+		/* deliver the RSS hash in the mbuf: it becomes the flow hash */
+		if (local_port_conf.rxmode.mq_mode == RTE_ETH_MQ_RX_RSS &&
+			local_port_conf.rx_adv_conf.rss_conf.rss_hf != 0 &&
+			(dev_info.rx_offload_capa & RTE_ETH_RX_OFFLOAD_RSS_HASH))
+			local_port_conf.rxmode.offloads |= RTE_ETH_RX_OFFLOAD_RSS_HASH;
+		else
+			rss_hash_on = 0;
+
 		ret = rte_eth_dev_configure(portid, nb_rx_queue,
 					(uint16_t)n_tx_queue, &local_port_conf);
 		if (ret < 0)
@@ -899,6 +1392,8 @@ l3fwd_poll_resource_setup(void)
 
 			rxq_conf = dev_info.default_rxconf;
 			rxq_conf.offloads = port_conf.rxmode.offloads;
+			if (rss_hash_on)
+				rxq_conf.offloads |= RTE_ETH_RX_OFFLOAD_RSS_HASH;
 			if (!per_port_pool)
 				ret = rte_eth_rx_queue_setup(portid, queueid,
 						nb_rxd, socketid,
@@ -917,83 +1412,161 @@ l3fwd_poll_resource_setup(void)
 	}
 }
 
-/* A tsc-based timer responsible for triggering table reporting check */
-static uint64_t timer_period = 5; /* default period is 3 seconds */
+/*
+ * A tsc-based timer responsible for triggering table reporting check,
+ * FLOWBOOK_CHECK_PERIOD_MS in cycles once the TSC is calibrated.
+ */
+static uint64_t timer_period;
+
 
+/* one table per key family, see flowbook_parse_burst() */
+static flowbook_table<flow_key> *g_flowtable;
+static flowbook_table<flow_key_v6> *g_flowtable6;
+static flowbook_table<flow_key_vlan> *g_flowtable_vlan;
+/* reporting threads of all three tables, on the control cpuset */
+static flowbook_report_pool *g_report_pool;
 
-static flowbook_table g_flowtable(DEBUG_TABLE_SIZE);
+/* apply @fn to the table of every key family */
+template <typename F>
+static inline void
+flowbook_for_each_table(F &&fn)
+{
+	fn(g_flowtable);
+	fn(g_flowtable6);
+	fn(g_flowtable_vlan);
+}
 
-/**
- * @m: packet mbuf ref.
- * @p: portid: receiving port.
- * 
-*/
+/*
+ * Merge the flow records carried by the switch reports of a burst into the
+ * IPv4 table, FLOWBOOK_PARSE_MAX_BURST records per upsert_bulk(). @recs->v4
+ * is reused as the staging area, its packets are upserted already.
+ */
 static void
-flowbook_recording(struct rte_mbuf *m, unsigned portid, unsigned queueid)
+flowbook_ingest_pdus(struct flowbook_burst *recs, unsigned shard_id)
 {
-	struct rte_ether_hdr *eth_hdr;
-	uint32_t packet_type = RTE_PTYPE_UNKNOWN;
-	uint16_t ether_type;
-	void *l3;
-	void *l4;
-	int hdr_len;
-	struct rte_ipv4_hdr *ipv4_hdr;
-	struct rte_tcp_hdr *tcp_hdr;
-	struct rte_udp_hdr *udp_hdr;
-	
-	flow_key  key;
-	flow_attr attr;
-
-	eth_hdr = rte_pktmbuf_mtod(m, struct rte_ether_hdr *);
-	// Note that the field is big ending (be).
-	ether_type = eth_hdr->ether_type; 
-	// Move the pointer.
-	l3 = (uint8_t *)eth_hdr + sizeof(struct rte_ether_hdr);
-	if ( ether_type == rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4) ) {
-		ipv4_hdr = (struct rte_ipv4_hdr *)l3;
-		hdr_len = rte_ipv4_hdr_len(ipv4_hdr);
-		key._srcip = ipv4_hdr->src_addr;
-		key._dstip = ipv4_hdr->dst_addr;
-		if ( hdr_len == sizeof(struct rte_ipv4_hdr) ){
-			packet_type |= RTE_PTYPE_L3_IPV4;
-			l4 = (uint8_t *)ipv4_hdr + hdr_len;
-			key._protocol = ipv4_hdr->next_proto_id;
-			if ( key._protocol == IPPROTO_TCP ){
-				packet_type |= RTE_PTYPE_L4_TCP;
-				tcp_hdr = (struct rte_tcp_hdr *) l4;
-				key._srcport = rte_be_to_cpu_16(tcp_hdr->src_port);
-				key._dstport = rte_be_to_cpu_16(tcp_hdr->dst_port);
-			}
-			else if ( key._protocol == IPPROTO_UDP )
-			{
-				packet_type |= RTE_PTYPE_L4_UDP;
-				udp_hdr = (struct rte_udp_hdr *) l4;
-				key._srcport = rte_be_to_cpu_16(udp_hdr->src_port);
-				key._dstport = rte_be_to_cpu_16(udp_hdr->dst_port);
-			}
-		} else {
-			packet_type |= RTE_PTYPE_L3_IPV4_EXT;
+	struct flowbook_recs<flow_key> *out = &recs->v4;
+	uint16_t i, next;
+
+	out->n = 0;
+	for (i = 0; i < recs->nb_pdu_pkts; i++) {
+		next = 0;
+		while (flowbook_decode_pdus(recs->pdu_pkts[i], recs->pdu_wid,
+				&next, out)) {
+			g_flowtable->upsert_bulk(shard_id, out->keys, out->hashes,
+					out->attrs, out->n);
+			out->n = 0;
+		}
+	}
+	if (out->n > 0)
+		g_flowtable->upsert_bulk(shard_id, out->keys, out->hashes,
+				out->attrs, out->n);
+}
+
+/* Pipeline: hand parsed records to the workers, over the rings or the event device. */
+static inline void
+flowbook_ship_recs(uint16_t rx_id, const struct flowbook_burst *recs)
+{
+	if (use_eventdev)
+		flowbook_event_dispatch(rx_id, recs);
+	else
+		flowbook_pipeline_dispatch(rx_id, recs);
+}
+
+/* Pipeline: hand the records of the switch reports of a burst to the workers. */
+static void
+flowbook_dispatch_pdus(struct flowbook_burst *recs, uint16_t rx_id)
+{
+	struct flowbook_recs<flow_key> *out = &recs->v4;
+	uint16_t i, next;
+
+	/* the other families of the burst are dispatched already */
+	recs->v6.n = 0;
+	recs->vlan.n = 0;
+	out->n = 0;
+	for (i = 0; i < recs->nb_pdu_pkts; i++) {
+		next = 0;
+		while (flowbook_decode_pdus(recs->pdu_pkts[i], recs->pdu_wid,
+				&next, out)) {
+			flowbook_ship_recs(rx_id, recs);
+			out->n = 0;
 		}
-		/* print the parsed flow */
-		RTE_LOG(INFO, FLOWBOOK, "[Port %d: Queue %d] %s\n", portid, queueid, key.to_string().c_str()); 
-		// TODO use a real flow attr.
-		attr._byte_tot = m->pkt_len;
-		attr._byte_max = m->pkt_len;
-		attr._packet_tot = 1;
-		attr._packet_max = 1;
-		attr._start_wid = (uint32_t)rte_rdtsc();
-		attr._max_wid  = 0;
-		attr._pktctrs.resize(1);
-		attr._bytectrs.resize(1);
-		attr._pktctrs[0] = 1;
-		attr._bytectrs[0] = 1;
-		g_flowtable.upsert(key, attr);
-	} else {
-		// Currently only support ipv4 packets.
-		packet_type |= RTE_PTYPE_L3_IPV6;
 	}
-	m->packet_type = packet_type;
-    /* do not send anymore */
+	if (out->n > 0)
+		flowbook_ship_recs(rx_id, recs);
+}
+
+/* Upsert the records of a burst into the tables of @shard_id. */
+static inline void
+flowbook_upsert_recs(uint16_t shard_id, struct flowbook_burst *recs)
+{
+	g_flowtable->upsert_bulk(shard_id, recs->v4.keys, recs->v4.hashes,
+			recs->v4.attrs, recs->v4.n);
+	if (recs->v6.n > 0)
+		g_flowtable6->upsert_bulk(shard_id, recs->v6.keys,
+				recs->v6.hashes, recs->v6.attrs, recs->v6.n);
+	if (recs->vlan.n > 0)
+		g_flowtable_vlan->upsert_bulk(shard_id, recs->vlan.keys,
+				recs->vlan.hashes, recs->vlan.attrs, recs->vlan.n);
+	if (unlikely(recs->nb_pdu_pkts > 0))
+		flowbook_ingest_pdus(recs, shard_id);
+}
+
+/* A burst from an RX queue, or from the replay / generator of the RX lcore. */
+static inline uint16_t
+flowbook_rx_burst(uint16_t rx_id, uint16_t portid, uint16_t queueid,
+		struct rte_mbuf **pkts)
+{
+	if (replay_file != NULL)
+		return flowbook_replay_rx(rx_id, pkts, MAX_PKT_BURST);
+	if (gen_spec != NULL)
+		return flowbook_gen_rx(rx_id, pkts, MAX_PKT_BURST);
+	return rte_eth_rx_burst(portid, queueid, pkts, MAX_PKT_BURST);
+}
+
+/*
+ * Check the switch of every table. A table writer (@writer_id >= 0) leaves
+ * its epoch meanwhile: the switch waits for all writers, including us.
+ * Pending RETA moves are written first, the switch of all tables they force
+ * follows on a later check, once the old queues of the moved buckets
+ * drained; see flowbook_rebalance.h for the records this splits.
+ */
+static void
+flowbook_check_tables(int writer_id)
+{
+	bool reporting = false;
+	bool rebalance = false;
+
+	/* a table still exporting would not switch, keep the moves for later */
+	flowbook_for_each_table([&](auto *t) {
+		reporting = reporting || t->is_reporting();
+	});
+	if (rebalance_ms > 0 && flowbook_rebalance_plan() && !reporting)
+		flowbook_rebalance_apply();
+	if (rebalance_ms > 0 && !reporting)
+		rebalance = flowbook_rebalance_switch_due();
+	flowbook_for_each_table([&](auto *t) {
+		if (writer_id >= 0)
+			t->writer_offline(writer_id);
+		if (rebalance)
+			t->request_switch();
+		t->check_and_report();
+		if (writer_id >= 0)
+			t->writer_online(writer_id);
+	});
+}
+
+/* Check the tables once the timer expired, on the report lcore. */
+static inline void
+flowbook_report_tick(unsigned lcore_id, int writer_id, uint64_t diff_tsc,
+		uint64_t *timer_tsc)
+{
+	if (timer_period == 0 || lcore_id != report_lcore)
+		return;
+	*timer_tsc += diff_tsc;
+	if (likely(*timer_tsc < timer_period))
+		return;
+	flowbook_check_tables(writer_id);
+	*timer_tsc = 0;
 }
 
 /* main processing loop */
@@ -1001,14 +1574,18 @@ static void
 flowbook_main_loop(void)
 {
 	struct rte_mbuf *pkts_burst[MAX_PKT_BURST];
-	struct rte_mbuf *m;
+	/* flow records of one burst, upserted into the tables in bulk */
+	struct flowbook_burst recs;
 	
 	unsigned lcore_id;
 	uint64_t prev_tsc, diff_tsc, cur_tsc, timer_tsc;
-	unsigned i, j, portid, queueid, nb_rx;
+	unsigned i, portid, queueid, nb_rx;
+	uint32_t wid;
 	struct lcore_conf *qconf;
+	int busy = 0;       /* the last iteration got packets */
+	int drained = 0;    /* no queue gave a full burst in it */
 
-	prev_tsc = 0;
+	prev_tsc = rte_rdtsc();
 	timer_tsc = 0;
 
 	lcore_id = rte_lcore_id();
@@ -1026,6 +1603,8 @@ flowbook_main_loop(void)
 		RTE_LOG(INFO, FLOWBOOK, " -- lcoreid=%u portid=%u queueid=%u\n", 
             lcore_id, portid, queueid);
 	}
+	/* take part in the table epoch (QSBR) protocol as owner of a shard */
+	flowbook_for_each_table([&](auto *t) { t->register_writer(qconf->shard_id); });
 
 	while (!force_quit) {
 		/*
@@ -1033,50 +1612,251 @@ flowbook_main_loop(void)
 		 */
 		cur_tsc = rte_rdtsc();
 		diff_tsc = cur_tsc - prev_tsc;
-		/* if timer is enabled */
-		if (timer_period > 0) {
-			/* advance the timer */
-			timer_tsc += diff_tsc;
-			/* if timer has reached its timeout */
-			if (unlikely(timer_tsc >= timer_period)) {
-				/* do this only on main core */
-				if (lcore_id == rte_get_main_lcore()) {
-					#ifdef ENABLE_DB
-					g_flowtable.check_and_report();
-					#endif
-					/* reset the timer */
-					timer_tsc = 0;
-				}
-			}
-		}
+		flowbook_report_tick(lcore_id, qconf->shard_id, diff_tsc, &timer_tsc);
 		prev_tsc = cur_tsc;
+		if (rebalance_ms > 0)
+			flowbook_rebalance_cycles(qconf->rx_id, diff_tsc, busy,
+					drained);
+		busy = 0;
+		drained = 1;
         
 		/* Read packet from RX queues. */
 		for (i = 0; i < qconf->n_rx_queue; ++i) {
 			portid = qconf->rx_queue_list[i].port_id;
 			queueid = qconf->rx_queue_list[i].queue_id;
-			nb_rx = rte_eth_rx_burst(portid, queueid, pkts_burst,
-				MAX_PKT_BURST);
+			nb_rx = flowbook_rx_burst(qconf->rx_id, portid, queueid,
+					pkts_burst);
 			if (unlikely(nb_rx == 0))
 				continue;
             port_statistics[portid].rx += nb_rx;
-            for (j = 0; j < nb_rx; j++) {
-				m = pkts_burst[j];
-				// m is just an address.
-				// the packet body has not been loaded.
-				rte_prefetch0(rte_pktmbuf_mtod(m, void *));
-				flowbook_recording(m, portid, queueid);
-			}
-			rte_pktmbuf_free_bulk(pkts_burst, nb_rx); // Free packets in bulk.
+			busy = 1;
+			if (nb_rx == MAX_PKT_BURST)
+				drained = 0;
+			if (rebalance_ms > 0)
+				flowbook_rebalance_count(qconf->rx_id, portid, pkts_burst,
+						nb_rx);
+			/* one clock read per burst, all its packets share the window */
+			wid = flowbook_wid_now();
+			flowbook_parse_burst(pkts_burst, nb_rx, portid, queueid, wid,
+					ptype_hw[portid], rss_hash_on, pdu_on, &recs);
+			flowbook_upsert_recs(qconf->shard_id, &recs);
+			/* replayed mbufs are handed out again on the next loop */
+			if (replay_file == NULL)
+				rte_pktmbuf_free_bulk(pkts_burst, nb_rx); // Free packets in bulk.
 		}
 		/* End of read packet from RX queues. */
+		/* expire idle and long lived flows, before leaving the epoch */
+		flowbook_for_each_table([&](auto *t) {
+			t->age(qconf->shard_id, flowbook_tsc_to_wid64(cur_tsc));
+			/* no reference into the write table is held across iterations */
+			t->quiescent(qconf->shard_id);
+		});
+		/* the last lcore through the capture stops everybody */
+		if (unlikely(replay_file != NULL) && flowbook_replay_finished())
+			force_quit = true;
+	}
+	flowbook_for_each_table([&](auto *t) { t->unregister_writer(qconf->shard_id); });
+}
+
+/*
+ * Pipeline RX loop: parse the bursts of the queues and hand the records to
+ * the workers owning their flows. Owns no shard, so it never holds up an
+ * epoch switch, even as report lcore.
+ */
+static void
+flowbook_rx_loop(void)
+{
+	struct rte_mbuf *pkts_burst[MAX_PKT_BURST];
+	struct flowbook_burst recs;
+	unsigned lcore_id = rte_lcore_id();
+	struct lcore_conf *qconf = &lcore_conf[lcore_id];
+	uint64_t prev_tsc, cur_tsc, timer_tsc = 0;
+	unsigned i, portid, queueid, nb_rx;
+
+	RTE_LOG(INFO, FLOWBOOK, "entering pipeline RX loop on lcore %u\n",
+		lcore_id);
+	for (i = 0; i < qconf->n_rx_queue; i++)
+		RTE_LOG(INFO, FLOWBOOK, " -- lcoreid=%u portid=%u queueid=%u\n",
+			lcore_id, qconf->rx_queue_list[i].port_id,
+			qconf->rx_queue_list[i].queue_id);
+
+	prev_tsc = rte_rdtsc();
+	while (!force_quit) {
+		cur_tsc = rte_rdtsc();
+		flowbook_report_tick(lcore_id, -1, cur_tsc - prev_tsc, &timer_tsc);
+		prev_tsc = cur_tsc;
+
+		for (i = 0; i < qconf->n_rx_queue; ++i) {
+			portid = qconf->rx_queue_list[i].port_id;
+			queueid = qconf->rx_queue_list[i].queue_id;
+			nb_rx = flowbook_rx_burst(qconf->rx_id, portid, queueid,
+					pkts_burst);
+			if (unlikely(nb_rx == 0))
+				continue;
+			port_statistics[portid].rx += nb_rx;
+			flowbook_parse_burst(pkts_burst, nb_rx, portid, queueid,
+					flowbook_wid_now(), ptype_hw[portid], rss_hash_on,
+					pdu_on, &recs);
+			flowbook_ship_recs(qconf->rx_id, &recs);
+			if (unlikely(recs.nb_pdu_pkts > 0))
+				flowbook_dispatch_pdus(&recs, qconf->rx_id);
+			/* records are copied out, the mbufs go back right away */
+			if (replay_file == NULL)
+				rte_pktmbuf_free_bulk(pkts_burst, nb_rx);
+		}
+		if (use_eventdev)
+			flowbook_event_poll(qconf->rx_id);
+		else
+			flowbook_pipeline_flush(qconf->rx_id);
+		if (unlikely(replay_file != NULL) && flowbook_replay_finished())
+			force_quit = true;
+	}
+}
+
+/* Pipeline worker loop: upsert the records the RX lcores send to our shard. */
+static void
+flowbook_worker_loop(void)
+{
+	struct flowbook_burst recs;
+	unsigned lcore_id = rte_lcore_id();
+	struct lcore_conf *qconf = &lcore_conf[lcore_id];
+	uint64_t prev_tsc, cur_tsc, timer_tsc = 0;
+	uint16_t r;
+
+	RTE_LOG(INFO, FLOWBOOK, "entering worker loop on lcore %u, shard %u\n",
+		lcore_id, qconf->shard_id);
+	flowbook_for_each_table([&](auto *t) { t->register_writer(qconf->shard_id); });
+
+	prev_tsc = rte_rdtsc();
+	while (!force_quit) {
+		cur_tsc = rte_rdtsc();
+		flowbook_report_tick(lcore_id, qconf->shard_id, cur_tsc - prev_tsc,
+				&timer_tsc);
+		prev_tsc = cur_tsc;
+
+		for (r = 0; r < nb_rx_lcores; r++)
+			if (flowbook_pipeline_recv(qconf->shard_id, r, &recs) > 0)
+				flowbook_upsert_recs(qconf->shard_id, &recs);
+
+		flowbook_for_each_table([&](auto *t) {
+			t->age(qconf->shard_id, flowbook_tsc_to_wid64(cur_tsc));
+			t->quiescent(qconf->shard_id);
+		});
+	}
+	flowbook_for_each_table([&](auto *t) { t->unregister_writer(qconf->shard_id); });
+}
+
+/* Eventdev: upsert a batch into the shard of its event, or age that shard. */
+static inline void
+flowbook_event_upsert(const struct rte_event *ev)
+{
+	uint16_t shard_id = ev->flow_id;
+
+	switch (ev->sub_event_type) {
+	case FLOWBOOK_EVENT_V4: {
+		auto *b = (struct flowbook_event_batch<flow_key> *)ev->event_ptr;
+		g_flowtable->upsert_bulk(shard_id, b->keys, b->hashes, b->attrs, b->n);
+		break;
+	}
+	case FLOWBOOK_EVENT_V6: {
+		auto *b = (struct flowbook_event_batch<flow_key_v6> *)ev->event_ptr;
+		g_flowtable6->upsert_bulk(shard_id, b->keys, b->hashes, b->attrs, b->n);
+		break;
+	}
+	case FLOWBOOK_EVENT_VLAN: {
+		auto *b = (struct flowbook_event_batch<flow_key_vlan> *)ev->event_ptr;
+		g_flowtable_vlan->upsert_bulk(shard_id, b->keys, b->hashes, b->attrs,
+				b->n);
+		break;
+	}
+	case FLOWBOOK_EVENT_AGE: {
+		uint64_t now_wid = flowbook_tsc_to_wid64(rte_rdtsc());
+
+		flowbook_for_each_table([&](auto *t) { t->age(shard_id, now_wid); });
+		break;
+	}
+	}
+}
+
+/*
+ * Eventdev worker loop. The shards are not ours: the device hands us the
+ * atomic flow of a shard until our next dequeue, so the table writer id is
+ * the worker index and we are quiescent between two dequeues.
+ */
+static void
+flowbook_event_worker_loop(void)
+{
+	struct rte_event evs[FLOWBOOK_EVENT_DEQ_BURST];
+	unsigned lcore_id = rte_lcore_id();
+	struct lcore_conf *qconf = &lcore_conf[lcore_id];
+	uint64_t prev_tsc, cur_tsc, timer_tsc = 0;
+	uint16_t i, nb_evs;
+
+	RTE_LOG(INFO, FLOWBOOK, "entering event worker loop on lcore %u, port %u\n",
+		lcore_id, qconf->worker_id);
+	flowbook_for_each_table([&](auto *t) { t->register_writer(qconf->worker_id); });
+
+	prev_tsc = rte_rdtsc();
+	while (!force_quit) {
+		cur_tsc = rte_rdtsc();
+		flowbook_report_tick(lcore_id, qconf->worker_id, cur_tsc - prev_tsc,
+				&timer_tsc);
+		prev_tsc = cur_tsc;
+
+		nb_evs = flowbook_event_recv(qconf->worker_id, evs, RTE_DIM(evs));
+		for (i = 0; i < nb_evs; i++)
+			flowbook_event_upsert(&evs[i]);
+		flowbook_event_done(evs, nb_evs);
+
+		flowbook_for_each_table([&](auto *t) { t->quiescent(qconf->worker_id); });
+	}
+	flowbook_for_each_table([&](auto *t) { t->unregister_writer(qconf->worker_id); });
+}
+
+/*
+ * Report loop of a report lcore without RX queues. It is not a table
+ * writer, so switching an epoch never stalls a packet loop, and the
+ * export itself runs on the reporting threads of the table.
+ */
+static void
+flowbook_report_loop(void)
+{
+	uint64_t prev_tsc, cur_tsc, timer_tsc;
+
+	RTE_LOG(INFO, FLOWBOOK, "entering report loop on lcore %u\n",
+		rte_lcore_id());
+	prev_tsc = rte_rdtsc();
+	timer_tsc = 0;
+	while (!force_quit) {
+		cur_tsc = rte_rdtsc();
+		timer_tsc += cur_tsc - prev_tsc;
+		prev_tsc = cur_tsc;
+		if (timer_tsc >= timer_period) {
+			flowbook_check_tables(-1);
+			timer_tsc = 0;
+		}
+		/* nothing is latency critical here, give the core away */
+		rte_delay_us_sleep(1000);
 	}
 }
 
 static int
 flowbook_launch_one_lcore(__rte_unused void *dummy)
 {
-	flowbook_main_loop();
+	unsigned lcore_id = rte_lcore_id();
+
+	if (gen_spec != NULL && lcore_id == gen_lcore)
+		flowbook_gen_loop(&force_quit);
+	else if (lcore_conf[lcore_id].worker && use_eventdev)
+		flowbook_event_worker_loop();
+	else if (lcore_conf[lcore_id].worker)
+		flowbook_worker_loop();
+	else if (lcore_id == report_lcore && lcore_conf[lcore_id].n_rx_queue == 0)
+		flowbook_report_loop();
+	else if (nb_workers > 0 && lcore_conf[lcore_id].n_rx_queue > 0)
+		flowbook_rx_loop();
+	else
+		flowbook_main_loop();
 	return 0;
 }
 
@@ -1106,12 +1886,58 @@ main(int argc, char **argv)
 	ret = parse_args(argc, argv);
 	if (ret < 0)
 		rte_exit(EXIT_FAILURE, "Invalid L3FWD parameters\n");
+	if (report_lcore == RTE_MAX_LCORE)
+		report_lcore = rte_get_main_lcore();
+	else if (!rte_lcore_is_enabled(report_lcore))
+		rte_exit(EXIT_FAILURE, "report lcore %u is not enabled\n",
+			report_lcore);
+	if (flowbook_time_init(window_us) != 0)
+		rte_exit(EXIT_FAILURE, "Cannot calibrate the TSC clock\n");
+	timer_period = flowbook_ms_to_tsc(FLOWBOOK_CHECK_PERIOD_MS);
 
 	/**************************************************************
 	 *  Configure hardware queues and bind to mbuf pools.
 	 *  NOTE: most of them should not be changed.
 	 *************************************************************/
-	l3fwd_poll_resource_setup();
+	if (replay_file != NULL || gen_spec != NULL) {
+		/* no ports: every lcore of --config polls a replay queue or ring */
+		enabled_port_mask = 0;
+		if (check_lcore_params() < 0)
+			rte_exit(EXIT_FAILURE, "check_lcore_params failed\n");
+		if (init_lcore_rx_queues() < 0)
+			rte_exit(EXIT_FAILURE, "init_lcore_rx_queues failed\n");
+	}
+	if (replay_file != NULL) {
+		if (flowbook_replay_load(replay_file, nb_rx_lcores, rx_socket) != 0)
+			rte_exit(EXIT_FAILURE, "Cannot load %s\n", replay_file);
+	} else if (gen_spec != NULL) {
+		if (gen_lcore == RTE_MAX_LCORE) {
+			RTE_LCORE_FOREACH(gen_lcore) {
+				if (lcore_conf[gen_lcore].n_rx_queue == 0 &&
+						!lcore_conf[gen_lcore].worker &&
+						gen_lcore != report_lcore)
+					break;
+			}
+		}
+		if (gen_lcore >= RTE_MAX_LCORE || !rte_lcore_is_enabled(gen_lcore) ||
+				lcore_conf[gen_lcore].n_rx_queue > 0 ||
+				lcore_conf[gen_lcore].worker || gen_lcore == report_lcore)
+			rte_exit(EXIT_FAILURE,
+				"the generator needs an lcore without queues, shard nor reports\n");
+		if (flowbook_gen_init(&gen_conf, nb_rx_lcores, rx_socket, gen_lcore,
+				nb_rxd) != 0)
+			rte_exit(EXIT_FAILURE, "Cannot set up the generator\n");
+	} else {
+		l3fwd_poll_resource_setup();
+	}
+	if (use_eventdev) {
+		if (flowbook_event_init(nb_rx_lcores, rx_socket, nb_workers, nb_shards,
+				idle_timeout > 0 || active_timeout > 0) != 0)
+			rte_exit(EXIT_FAILURE, "Cannot set up the event pipeline\n");
+	} else if (nb_workers > 0 && flowbook_pipeline_init(nb_rx_lcores,
+			rx_socket, nb_workers, shard_socket, nb_rxd) != 0) {
+		rte_exit(EXIT_FAILURE, "Cannot set up the pipeline\n");
+	}
 	RTE_ETH_FOREACH_DEV(portid) {
 		if ((enabled_port_mask & (1 << portid)) == 0) {
 			continue;
@@ -1122,6 +1948,12 @@ main(int argc, char **argv)
 			rte_exit(EXIT_FAILURE,
 				"rte_eth_dev_start: err=%d, port=%d\n",
 				ret, portid);
+		/*
+		 * The supported ptypes depend on the RX burst function the PMD
+		 * picked at start, so they are only queried now.
+		 */
+		ptype_hw[portid] = flowbook_setup_ptypes(portid);
+		printf("Port %u: ptype %s\n", portid, ptype_hw[portid] ? "hw" : "sw");
 
 		/*
 		 * If enabled, put device in promiscuous mode.
@@ -1138,9 +1970,54 @@ main(int argc, char **argv)
 		}
 	}
 	printf("\n");
+	/* the buckets are counted from the RSS hash of the mbufs */
+	if (rebalance_ms > 0) {
+		struct lcore_conf *qconf;
+		unsigned lcore_id;
+		uint16_t queue;
+
+		if (!rss_hash_on)
+			rte_exit(EXIT_FAILURE, "--rebalance-ms needs the RSS hash offload\n");
+		for (lcore_id = 0; lcore_id < RTE_MAX_LCORE; lcore_id++) {
+			qconf = &lcore_conf[lcore_id];
+			for (queue = 0; queue < qconf->n_rx_queue; queue++)
+				flowbook_rebalance_add_queue(
+					qconf->rx_queue_list[queue].port_id,
+					qconf->rx_queue_list[queue].queue_id, qconf->rx_id);
+		}
+		if (flowbook_rebalance_start(rebalance_ms, nb_rx_lcores, rx_socket) != 0)
+			rte_exit(EXIT_FAILURE, "Cannot set up the RETA rebalancing\n");
+	}
+	/* one private table shard per RX lcore, merged only at report time */
+	if ((idle_timeout > 0 || active_timeout > 0) && !report_period_set)
+		report_period = 0;	/* aging keeps the table small, switch on load */
+	g_report_pool = new flowbook_report_pool();
+	g_flowtable = new flowbook_table<flow_key>(table_entry_number,
+			nb_shards, report_period, shard_socket, g_report_pool);
+	/* IPv6 and tagged traffic is the minority, their tables are smaller */
+	g_flowtable6 = new flowbook_table<flow_key_v6>(
+			table_entry_number / FLOWBOOK_AUX_TABLE_DIV, nb_shards,
+			report_period, shard_socket, g_report_pool);
+	g_flowtable_vlan = new flowbook_table<flow_key_vlan>(
+			table_entry_number / FLOWBOOK_AUX_TABLE_DIV, nb_shards,
+			report_period, shard_socket, g_report_pool);
+	/* window ids are compared as 32 bit distances */
+	flowbook_for_each_table([&](auto *t) {
+		t->set_aging(
+			RTE_MIN(flowbook_s_to_wid(idle_timeout), (uint64_t)INT32_MAX / 2),
+			RTE_MIN(flowbook_s_to_wid(active_timeout), (uint64_t)INT32_MAX / 2));
+		t->set_admission(admit_pkts, admit_bytes, sketch_width);
+	});
+#ifdef ENABLE_TRACE
+	if (flowbook_trace_init(trace_sample, g_report_pool) != 0)
+		rte_exit(EXIT_FAILURE, "Cannot init packet trace\n");
+#endif
     /* initialize port stats */
 	memset(&port_statistics, 0, sizeof(port_statistics));
-	check_all_ports_link_status(enabled_port_mask);
+	if (replay_file != NULL)
+		flowbook_replay_start(replay_loops, replay_speed, nb_rxd);
+	else if (gen_spec == NULL)
+		check_all_ports_link_status(enabled_port_mask);
 
 
     /**************************************************************
@@ -1166,6 +2043,30 @@ main(int argc, char **argv)
         rte_eth_dev_close(portid);
         printf(" Done\n");
     }
+	if (replay_file != NULL) {
+		flowbook_replay_report();
+		flowbook_replay_free();
+	}
+	if (gen_spec != NULL) {
+		flowbook_gen_report();
+		flowbook_gen_free();
+	}
+	if (rebalance_ms > 0) {
+		flowbook_rebalance_report();
+		flowbook_rebalance_free();
+	}
+	if (use_eventdev) {
+		flowbook_event_report();
+		flowbook_event_free();
+	} else if (nb_workers > 0) {
+		flowbook_pipeline_report();
+		flowbook_pipeline_free();
+	}
+#ifdef ENABLE_TRACE
+	flowbook_trace_free();
+#endif
+	flowbook_for_each_table([](auto *t) { delete t; });
+	delete g_report_pool;
 	rte_eal_cleanup();
 	printf("Bye...\n");
 	return ret;